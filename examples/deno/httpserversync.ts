@@ -88,6 +88,21 @@ export const libc = Deno.dlopen("libc.so.6", {
   },
 });
 
+// Per-request reset of ephemeral VMs on keep-alive connections, when
+// running in kvmserver with libkvmserverguest.so on the library path.
+const kvmserverguest = (() => {
+  if (Deno.env.get("KVM_NAME") === undefined) {
+    return null;
+  }
+  try {
+    return Deno.dlopen("libkvmserverguest.so", {
+      kvmserverguest_request_done: { parameters: [], result: "isize" },
+    });
+  } catch {
+    return null;
+  }
+})();
+
 const errnoPtr = new Deno.UnsafePointerView(libc.symbols.errno!);
 export const errno = () => errnoPtr.getInt32();
 export const strerror = (errnum: number = errno()) => {
@@ -127,53 +142,67 @@ export function serve(listenfd: number) {
       throw new LibcError("accept");
     }
     try {
-      const bytesRead = Number(libc.symbols.recv(
-        connfd,
-        buf,
-        BigInt(buf.byteLength),
-        0,
-      ));
-      if (bytesRead > 0) {
-        let value;
-        // Array.from("GET ", c => c.charCodeAt(0)) // [ 71, 69, 84, 32 ]
-        if (buf[0] !== 71 || buf[1] !== 69 || buf[2] !== 84 || buf[3] !== 32) {
-          console.error("Bad request", buf);
-          value = "HTTP/1.1 405 Method Not Allowed\r\n" +
-            "Connection: close\r\n" +
-            "Content-Type: text/plain; charset=utf-8\r\n" +
-            "\r\n" +
-            "Method Not Allowed";
-        } else {
-          value = "HTTP/1.1 200 OK\r\n" +
-            "Connection: close\r\n" +
-            "Content-Type: text/plain; charset=utf-8\r\n" +
-            "\r\n" +
-            "Hello, World!";
-        }
-        const { written } = new TextEncoder().encodeInto(value, buf);
-        let totalSent = 0;
-        while (totalSent < written) {
-          const wbuf = new Uint8Array(
-            buf.buffer,
-            totalSent,
-            written - totalSent,
-          );
-          const bytesSent = Number(
-            libc.symbols.send(connfd, wbuf, BigInt(wbuf.length), 0),
+      while (true) {
+        const bytesRead = Number(libc.symbols.recv(
+          connfd,
+          buf,
+          BigInt(buf.byteLength),
+          0,
+        ));
+        if (bytesRead > 0) {
+          let value;
+          let close = /\r\nconnection:\s*close/i.test(
+            new TextDecoder().decode(buf.subarray(0, bytesRead)),
           );
-          if (bytesSent > 0) {
-            totalSent += bytesSent;
-            continue;
-          } else if (bytesSent === 0) {
-            break;
+          // Array.from("GET ", c => c.charCodeAt(0)) // [ 71, 69, 84, 32 ]
+          if (
+            buf[0] !== 71 || buf[1] !== 69 || buf[2] !== 84 || buf[3] !== 32
+          ) {
+            console.error("Bad request", buf);
+            close = true;
+            value = "HTTP/1.1 405 Method Not Allowed\r\n" +
+              "Connection: close\r\n" +
+              "Content-Type: text/plain; charset=utf-8\r\n" +
+              "\r\n" +
+              "Method Not Allowed";
           } else {
-            throw new LibcError("send");
+            value = "HTTP/1.1 200 OK\r\n" +
+              `Connection: ${close ? "close" : "keep-alive"}\r\n` +
+              "Content-Length: 13\r\n" +
+              "Content-Type: text/plain; charset=utf-8\r\n" +
+              "\r\n" +
+              "Hello, World!";
+          }
+          const { written } = new TextEncoder().encodeInto(value, buf);
+          let totalSent = 0;
+          while (totalSent < written) {
+            const wbuf = new Uint8Array(
+              buf.buffer,
+              totalSent,
+              written - totalSent,
+            );
+            const bytesSent = Number(
+              libc.symbols.send(connfd, wbuf, BigInt(wbuf.length), 0),
+            );
+            if (bytesSent > 0) {
+              totalSent += bytesSent;
+              continue;
+            } else if (bytesSent === 0) {
+              break;
+            } else {
+              throw new LibcError("send");
+            }
           }
+          if (close) {
+            break;
+          }
+          // Ephemeral VMs are reset here and accept this connection again
+          kvmserverguest?.symbols.kvmserverguest_request_done();
+        } else if (bytesRead === 0) {
+          break;
+        } else {
+          throw new LibcError("recv");
         }
-      } else if (bytesRead === 0) {
-        break;
-      } else {
-        throw new LibcError("recv");
       }
     } finally {
       if (libc.symbols.shutdown(connfd, SHUT_WR) < 0) {
@@ -1,11 +1,14 @@
 import { DatabaseSync } from "node:sqlite";
 import { assert, assertEquals } from "@std/assert";
-import { testHelloWorld } from "../testutil.ts";
+import { testHelloWorld, testKvmServer } from "../testutil.ts";
 
 const cwd = import.meta.dirname;
 const allowAll = true;
 const ephemeral = true;
 const warmup = 1;
+const standbyFork = ["--standby-fork"];
+const requests = 3;
+const acceptors = ["--acceptors", "2"];
 const env = {
   // Could not initialize cache database '$HOME/.cache/deno/dep_analysis_cache_v2', deleting and retrying...
   // (SqliteFailure(Error { code: FileLockingProtocolFailed, extended_code: 15 }, Some("locking protocol")))
@@ -37,6 +40,51 @@ const env = {
     "Deno.serve ephemeral warmup",
     testHelloWorld({ ...common, ephemeral, warmup }),
   );
+  Deno.test(
+    "Deno.serve ephemeral requests",
+    testHelloWorld({ ...common, ephemeral, requests }),
+  );
+  Deno.test(
+    "Deno.serve ephemeral acceptors",
+    testHelloWorld({ ...common, ephemeral, extra: acceptors, requests }),
+  );
+  Deno.test(
+    "Deno.serve ephemeral standby-fork",
+    testHelloWorld({ ...common, ephemeral, extra: standbyFork, requests }),
+  );
+}
+
+{
+  // Request bodies above the frontend's 1MB buffer, which are read
+  // whole before they are forwarded
+  const common = {
+    cwd,
+    program: "deno",
+    args: [
+      "run",
+      "--allow-all",
+      "data:,Deno.serve(async (req) => new Response(String((await req.bytes()).length)))",
+    ],
+    env,
+    allowAll,
+    ephemeral,
+    extra: ["--frontend", "127.0.0.1:8080"],
+  };
+  Deno.test(
+    "Deno.serve frontend large body",
+    testKvmServer(common, async () => {
+      using client = Deno.createHttpClient({});
+      for (const size of [0, 1 << 20, 8 << 20]) {
+        const response = await fetch("http://127.0.0.1:8080/", {
+          method: "POST",
+          body: new Uint8Array(size),
+          client,
+        });
+        assertEquals(response.status, 200);
+        assertEquals(await response.text(), String(size));
+      }
+    }),
+  );
 }
 
 {
@@ -77,6 +125,14 @@ const env = {
     "Deno compile httpserversync ephemeral warmup",
     testHelloWorld({ ...common, ephemeral, warmup }),
   );
+  Deno.test(
+    "Deno compile httpserversync ephemeral requests",
+    testHelloWorld({ ...common, ephemeral, requests }),
+  );
+  Deno.test(
+    "Deno compile httpserversync ephemeral standby-fork",
+    testHelloWorld({ ...common, ephemeral, extra: standbyFork, requests }),
+  );
 }
 
 {
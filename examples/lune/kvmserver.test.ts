@@ -8,6 +8,8 @@ const common = {
 };
 const ephemeral = true;
 const warmup = 1;
+const standbyFork = ["--standby-fork"];
+const requests = 3;
 
 {
   const args = ["run", "./test.luau"];
@@ -23,4 +25,18 @@ const warmup = 1;
     "net.serve ephemeral warmup",
     testHelloWorld({ ...common, args, ephemeral, warmup }),
   );
+  Deno.test(
+    "net.serve ephemeral requests",
+    testHelloWorld({ ...common, args, ephemeral, requests }),
+  );
+  Deno.test(
+    "net.serve ephemeral standby-fork",
+    testHelloWorld({
+      ...common,
+      args,
+      ephemeral,
+      extra: standbyFork,
+      requests,
+    }),
+  );
 }
@@ -1,4 +1,9 @@
-import { testHelloWorld } from "../testutil.ts";
+import { assert, assertEquals } from "@std/assert";
+import {
+  testHelloWorld,
+  testKeepAlive,
+  testKvmServer,
+} from "../testutil.ts";
 
 const common = {
   cwd: import.meta.dirname,
@@ -7,6 +12,9 @@ const common = {
 };
 const ephemeral = true;
 const warmup = 1;
+const standbyFork = ["--standby-fork"];
+const requests = 3;
+const acceptors = ["--acceptors", "2"];
 
 {
   const args = ["hellowsgi.py"];
@@ -22,6 +30,16 @@ const warmup = 1;
     "wsgiref ephemeral warmup",
     testHelloWorld({ ...common, args, ephemeral, warmup }),
   );
+  Deno.test(
+    "wsgiref ephemeral standby-fork",
+    testHelloWorld({
+      ...common,
+      args,
+      ephemeral,
+      extra: standbyFork,
+      requests,
+    }),
+  );
 }
 
 {
@@ -38,6 +56,28 @@ const warmup = 1;
     "asyncio ephemeral warmup",
     testHelloWorld({ ...common, args, ephemeral, warmup }),
   );
+  Deno.test(
+    "asyncio ephemeral requests",
+    testHelloWorld({ ...common, args, ephemeral, requests }),
+  );
+  Deno.test(
+    "asyncio ephemeral keep-alive",
+    testKeepAlive({ ...common, args, ephemeral }),
+  );
+  Deno.test(
+    "asyncio ephemeral acceptors",
+    testHelloWorld({ ...common, args, ephemeral, extra: acceptors, requests }),
+  );
+  Deno.test(
+    "asyncio ephemeral standby-fork",
+    testHelloWorld({
+      ...common,
+      args,
+      ephemeral,
+      extra: standbyFork,
+      requests,
+    }),
+  );
 }
 
 {
@@ -71,3 +111,62 @@ const warmup = 1;
     testHelloWorld({ ...common, args, ephemeral, warmup }),
   );
 }
+
+{
+  // A second listener, so that restoring more than the one the
+  // program waits on first is tested too
+  const args = [
+    "-c",
+    `
+import asyncio
+from helloasyncio import HelloProtocol
+
+async def main():
+    loop = asyncio.get_running_loop()
+    servers = [
+        await loop.create_server(HelloProtocol, "127.0.0.1", port)
+        for port in (8000, 8001)
+    ]
+    await asyncio.gather(*(server.serve_forever() for server in servers))
+
+asyncio.run(main())
+`,
+  ];
+  // The first start boots the program and saves the snapshot, the
+  // second serves from the restored state
+  const testSnapshot = (
+    options: { ephemeral?: boolean; threads?: number },
+    ports: number[],
+  ) =>
+  async () => {
+    const tmpdir = await Deno.makeTempDir({ prefix: "kvmsnapshot" });
+    try {
+      const snapshot = `${tmpdir}/python.snapshot`;
+      const extra = ["--snapshot-file", snapshot];
+      await testHelloWorld({ ...common, ...options, args, extra })();
+      assert((await Deno.stat(snapshot)).size > 0, "snapshot saved");
+      await testKvmServer({ ...common, ...options, args, extra }, async () => {
+        using client = Deno.createHttpClient({ poolMaxIdlePerHost: 0 });
+        for (const port of ports) {
+          const response = await fetch(`http://127.0.0.1:${port}/`, {
+            client,
+          });
+          assertEquals(response.status, 200);
+          assertEquals(await response.text(), "Hello, World!");
+        }
+      })();
+    } finally {
+      await Deno.remove(tmpdir, { recursive: true });
+    }
+  };
+  // Forks, as without them requests write to the snapshot memory
+  Deno.test(
+    "asyncio snapshot two listeners",
+    testSnapshot({ threads: 2 }, [8000, 8001]),
+  );
+  // Ephemeral VMs only serve the listener the program waits on first
+  Deno.test(
+    "asyncio snapshot ephemeral",
+    testSnapshot({ ephemeral }, [8000]),
+  );
+}
@@ -1,4 +1,4 @@
-import { testHelloWorld } from "../testutil.ts";
+import { testHelloWorld, testKeepAlive } from "../testutil.ts";
 
 const common = {
   cwd: import.meta.dirname,
@@ -6,6 +6,9 @@ const common = {
 };
 const ephemeral = true;
 const warmup = 1;
+const standbyFork = ["--standby-fork"];
+const requests = 3;
+const acceptors = ["--acceptors", "2"];
 
 {
   const program = "./target/release/httpserver";
@@ -21,6 +24,20 @@ const warmup = 1;
     "httpserver ephemeral warmup",
     testHelloWorld({ ...common, program, ephemeral, warmup }),
   );
+  Deno.test(
+    "httpserver ephemeral requests",
+    testHelloWorld({ ...common, program, ephemeral, requests }),
+  );
+  Deno.test(
+    "httpserver ephemeral standby-fork",
+    testHelloWorld({
+      ...common,
+      program,
+      ephemeral,
+      extra: standbyFork,
+      requests,
+    }),
+  );
 }
 
 {
@@ -37,6 +54,38 @@ const warmup = 1;
     "httpserversync ephemeral warmup",
     testHelloWorld({ ...common, program, ephemeral, warmup }),
   );
+  Deno.test(
+    "httpserversync ephemeral requests",
+    testHelloWorld({ ...common, program, ephemeral, requests }),
+  );
+  Deno.test(
+    "httpserversync ephemeral keep-alive",
+    testKeepAlive({ ...common, program, ephemeral }),
+  );
+  Deno.test(
+    "httpserversync ephemeral keep-alive standby-fork",
+    testKeepAlive({ ...common, program, ephemeral, extra: standbyFork }),
+  );
+  Deno.test(
+    "httpserversync ephemeral acceptors",
+    testHelloWorld({
+      ...common,
+      program,
+      ephemeral,
+      extra: acceptors,
+      requests,
+    }),
+  );
+  Deno.test(
+    "httpserversync ephemeral standby-fork",
+    testHelloWorld({
+      ...common,
+      program,
+      ephemeral,
+      extra: standbyFork,
+      requests,
+    }),
+  );
 }
 
 {
@@ -58,3 +107,17 @@ const warmup = 1;
     testHelloWorld({ ...common, storage, program, ephemeral, warmup }),
   );
 }
+
+{
+  // Without a prefix, an allowed 0.0.0.0 means any IPv4 address
+  const program = "./target/release/httpserversync";
+  const extra = ["--allow-read=/lib", "--allow-listen=0.0.0.0:8000"];
+  Deno.test(
+    "httpserversync allow-listen any address",
+    testHelloWorld({ cwd: common.cwd, program, extra }),
+  );
+  Deno.test(
+    "httpserversync allow-listen any address ephemeral",
+    testHelloWorld({ cwd: common.cwd, program, extra, ephemeral }),
+  );
+}
@@ -6,6 +6,8 @@ use std::net::Shutdown;
 use std::net::TcpListener;
 use std::os::unix::net::UnixListener;
 
+use kvmserver_examples_rust::request_done;
+
 fn main() -> Result<(), Error> {
     let addr = std::env::args()
         .nth(1)
@@ -119,6 +121,12 @@ fn process<Stream: Read + Write>(stream: &mut Stream) -> Result<(), Error> {
                     }
                     buf.copy_within(bytes_consumed..offset, 0);
                     offset -= bytes_consumed;
+                    if offset == 0 {
+                        // Ephemeral VMs are reset here and accept this
+                        // connection again, unless a pipelined request is
+                        // already buffered. Elsewhere this returns an error.
+                        request_done();
+                    }
                     break;
                 }
                 Ok(httparse::Status::Partial) => {
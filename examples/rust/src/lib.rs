@@ -1,9 +1,51 @@
+use std::ffi::{c_char, c_int, c_void};
+use std::sync::OnceLock;
+
 #[link(name = "kvmserverguest", kind = "dylib")]
 unsafe extern "C" {
     unsafe fn kvmserverguest_remote_resume(buffer: *mut u8, len: isize) -> isize;
     unsafe fn kvmserverguest_storage_wait_paused(bufferptr: *mut *mut u8, ret: isize) -> isize;
 }
 
+// request_done() is looked up at runtime, so that programs calling it
+// also run outside kvmserver, without libkvmserverguest.so.
+unsafe extern "C" {
+    unsafe fn dlopen(filename: *const c_char, flags: c_int) -> *mut c_void;
+    unsafe fn dlsym(handle: *mut c_void, symbol: *const c_char) -> *mut c_void;
+}
+const RTLD_NOW: c_int = 2;
+const ENOSYS: isize = 38;
+
+type RequestDoneFn = unsafe extern "C" fn() -> isize;
+
+fn load_request_done() -> Option<RequestDoneFn> {
+    std::env::var_os("KVM_NAME")?;
+    unsafe {
+        let handle = dlopen(c"libkvmserverguest.so".as_ptr(), RTLD_NOW);
+        if handle.is_null() {
+            return None;
+        }
+        let symbol = dlsym(handle, c"kvmserverguest_request_done".as_ptr());
+        if symbol.is_null() {
+            return None;
+        }
+        Some(std::mem::transmute::<*mut c_void, RequestDoneFn>(symbol))
+    }
+}
+
+/// Reset the ephemeral VM after a response on a keep-alive connection.
+/// Call once the response is written and nothing of the next request has
+/// been read. Only returns (with a negative error) when the VM is not an
+/// ephemeral request VM, or outside kvmserver, in which case the
+/// connection is served as usual.
+pub fn request_done() -> isize {
+    static REQUEST_DONE: OnceLock<Option<RequestDoneFn>> = OnceLock::new();
+    match REQUEST_DONE.get_or_init(load_request_done) {
+        Some(request_done) => unsafe { request_done() },
+        None => -ENOSYS,
+    }
+}
+
 pub fn remote_resume(buffer: &mut [u8]) -> Result<&[u8], isize> {
     let len = unsafe { kvmserverguest_remote_resume(buffer.as_mut_ptr(), buffer.len() as isize) };
     if len < 0 {
@@ -90,13 +90,10 @@ export function waitForLine(
   return promise;
 }
 
-export function testHelloWorld(
+// Run kvmserver until the program is ready, then the test
+export function testKvmServer(
   options: KvmServerCommandOptions,
-  onResponse: (response: Response) => Promise<void> = async (response) => {
-    const text = await response.text();
-    assertEquals(response.status, 200);
-    assertEquals(text, "Hello, World!");
-  },
+  test: () => Promise<void>,
 ) {
   return async () => {
     const command = kvmServerCommand(options);
@@ -107,8 +104,73 @@ export function testHelloWorld(
         throw new Error(`Status code: ${code}`);
       }),
     ]);
-    using client = Deno.createHttpClient({ poolMaxIdlePerHost: 0 });
-    const response = await fetch("http://127.0.0.1:8000/", { client });
-    await onResponse(response);
+    await test();
   };
 }
+
+type HelloWorldOptions = KvmServerCommandOptions & {
+  // Sequential requests, each on a new connection
+  requests?: number;
+};
+
+export function testHelloWorld(
+  options: HelloWorldOptions,
+  onResponse: (response: Response) => Promise<void> = async (response) => {
+    const text = await response.text();
+    assertEquals(response.status, 200);
+    assertEquals(text, "Hello, World!");
+  },
+) {
+  return testKvmServer(options, async () => {
+    using client = Deno.createHttpClient({ poolMaxIdlePerHost: 0 });
+    for (let i = 0; i < (options.requests ?? 1); i++) {
+      const response = await fetch("http://127.0.0.1:8000/", { client });
+      await onResponse(response);
+    }
+  });
+}
+
+// Send the requests one at a time on a single connection, so that an
+// ephemeral VM calling request_done() serves them from a clean slate
+export function testKeepAlive(
+  options: KvmServerCommandOptions,
+  requests = 2,
+) {
+  return testKvmServer(options, async () => {
+    using conn = await Deno.connect({ hostname: "127.0.0.1", port: 8000 });
+    const reader = conn.readable.getReader();
+    const decoder = new TextDecoder("latin1");
+    let text = "";
+    const readResponse = async () => {
+      while (true) {
+        const end = text.indexOf("\r\n\r\n");
+        if (end >= 0) {
+          const head = text.slice(0, end);
+          const length = Number(
+            /\r\ncontent-length: *(\d+)/i.exec(head)?.[1] ?? 0,
+          );
+          if (text.length >= end + 4 + length) {
+            const status = Number(head.split(" ")[1]);
+            const body = text.slice(end + 4, end + 4 + length);
+            text = text.slice(end + 4 + length);
+            return { status, body };
+          }
+        }
+        const { value, done } = await reader.read();
+        if (done) {
+          throw new Error("Connection closed");
+        }
+        text += decoder.decode(value, { stream: true });
+      }
+    };
+    for (let i = 0; i < requests; i++) {
+      await conn.write(
+        new TextEncoder().encode("GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"),
+      );
+      const { status, body } = await readResponse();
+      assertEquals(status, 200);
+      assertEquals(body, "Hello, World!");
+    }
+    reader.releaseLock();
+  });
+}
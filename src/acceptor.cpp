@@ -0,0 +1,485 @@
+#include "acceptor.hpp"
+
+#include "vm.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+
+Acceptor::Acceptor(const VirtualMachine& master, unsigned threads, size_t max_vms)
+	: m_master(master),
+	  m_listener_fd(master.listener_fd()),
+	  m_num_threads(threads),
+	  m_idle(max_vms)
+{
+	if (m_listener_fd < 0) {
+		throw std::runtime_error("Acceptor: the master VM has no listening socket");
+	}
+	// Acceptor threads race for each connection, and the losers must
+	// not block in accept4() when the winner took it
+	const int flags = fcntl(m_listener_fd, F_GETFL);
+	if (flags < 0 || fcntl(m_listener_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		throw std::runtime_error("Acceptor: fcntl() failed: " + std::string(strerror(errno)));
+	}
+	m_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (m_stop_fd < 0) {
+		throw std::runtime_error("Acceptor: eventfd() failed: " + std::string(strerror(errno)));
+	}
+}
+Acceptor::~Acceptor()
+{
+	this->stop();
+	for (auto& thread : m_threads) {
+		thread.join();
+	}
+	close(m_stop_fd);
+}
+
+void Acceptor::stop()
+{
+	if (m_stop.exchange(true))
+		return;
+	// Never read, so that every poll sees it
+	const uint64_t one = 1;
+	if (write(m_stop_fd, &one, sizeof(one)) < 0) {
+		fprintf(stderr, "Acceptor: eventfd write failed: %s\n", strerror(errno));
+	}
+	{
+		// The dispatcher either sees m_stop or is already waiting
+		std::scoped_lock lock(m_queue_mutex);
+	}
+	m_queue_cond.notify_all();
+	// A waiter that wakes up stopped passes the wakeup on (see acquire_idle)
+	m_idle_count.release();
+}
+
+void Acceptor::start()
+{
+	m_threads.reserve(m_num_threads + 1);
+	for (unsigned i = 0; i < m_num_threads; i++) {
+		m_threads.emplace_back(&Acceptor::acceptor_thread, this);
+	}
+	if (m_queue_limit > 0) {
+		m_threads.emplace_back(&Acceptor::dispatch_thread, this);
+	}
+}
+
+void Acceptor::set_admission(size_t limit, std::chrono::microseconds slo)
+{
+	m_queue_limit = limit;
+	m_queue_slo = slo;
+}
+
+void Acceptor::push_idle(VirtualMachine& vm)
+{
+	if (!m_idle.push(&vm)) {
+		throw std::runtime_error("Acceptor: idle VM queue is full");
+	}
+	m_idle_count.release();
+}
+
+void Acceptor::set_on_starved(on_starved_t callback, std::chrono::microseconds grow_wait)
+{
+	m_on_starved = std::move(callback);
+	m_grow_wait = grow_wait;
+}
+
+bool Acceptor::acquire_idle(std::chrono::microseconds timeout)
+{
+	const bool acquired = m_idle_count.try_acquire_for(timeout);
+	if (acquired && m_stop.load(std::memory_order_relaxed)) {
+		// Not an idle VM, but the wakeup of stop()
+		m_idle_count.release();
+		return false;
+	}
+	return acquired;
+}
+
+VirtualMachine* Acceptor::take_idle()
+{
+	if (m_stop.load(std::memory_order_relaxed) || !m_idle_count.try_acquire())
+		return nullptr;
+	if (m_stop.load(std::memory_order_relaxed)) {
+		m_idle_count.release();
+		return nullptr;
+	}
+	VirtualMachine* vm = nullptr;
+	while (!m_idle.pop(vm)) {
+		std::this_thread::yield();
+	}
+	return vm;
+}
+
+unsigned Acceptor::pending_connections() const
+{
+	// For TCP listeners the kernel reports the accept queue length
+	struct tcp_info info {};
+	socklen_t len = sizeof(info);
+	if (getsockopt(m_listener_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+		return info.tcpi_unacked;
+	}
+	struct pollfd pfd {
+		.fd = m_listener_fd,
+		.events = POLLIN,
+		.revents = 0,
+	};
+	return (poll(&pfd, 1, 0) > 0) ? 1 : 0;
+}
+
+VirtualMachine* Acceptor::wait_idle(const std::function<unsigned()>& pending_connections)
+{
+	if (m_on_starved) {
+		while (!this->acquire_idle(m_grow_wait)) {
+			if (m_stop.load(std::memory_order_relaxed))
+				return nullptr;
+			const unsigned pending = pending_connections();
+			if (pending > 0) {
+				m_on_starved(pending);
+			}
+		}
+	} else {
+		m_idle_count.acquire();
+		if (m_stop.load(std::memory_order_relaxed)) {
+			m_idle_count.release();
+			return nullptr;
+		}
+	}
+	VirtualMachine* vm = nullptr;
+	// The semaphore guarantees a published entry, but a concurrent
+	// pop may still be finishing its sequence update.
+	while (!m_idle.pop(vm)) {
+		std::this_thread::yield();
+	}
+	return vm;
+}
+
+int Acceptor::accept_connection()
+{
+	while (true)
+	{
+		struct pollfd pfds[2] {
+			{ .fd = m_listener_fd, .events = POLLIN, .revents = 0 },
+			{ .fd = m_stop_fd, .events = POLLIN, .revents = 0 },
+		};
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Acceptor: poll() failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if (pfds[1].revents != 0)
+			return -1;
+		const int fd = accept4(m_listener_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd >= 0) {
+			return fd;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+			fprintf(stderr, "Acceptor: accept4() failed: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+}
+
+void Acceptor::acceptor_thread()
+{
+	while (m_queue_limit > 0)
+	{
+		// Admission control: the dispatcher pairs connections with VMs
+		const int fd = accept_connection();
+		if (m_stop.load(std::memory_order_relaxed)) {
+			if (fd >= 0)
+				close(fd);
+			return;
+		}
+		if (fd < 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			continue;
+		}
+		this->admit(fd);
+	}
+	while (true)
+	{
+		// Only accept once a VM is idle, so that pending connections
+		// stay in the kernel backlog rather than in our hands
+		VirtualMachine* vm = wait_idle([this] { return this->pending_connections(); });
+		if (vm == nullptr)
+			return;
+		const int fd = accept_connection();
+		if (m_stop.load(std::memory_order_relaxed)) {
+			if (fd >= 0)
+				close(fd);
+			return;
+		}
+		if (fd < 0) {
+			this->push_idle(*vm);
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			continue;
+		}
+		vm->deliver_connection(fd);
+	}
+}
+
+void Acceptor::admit(int fd)
+{
+	const auto now = std::chrono::steady_clock::now();
+	{
+		std::scoped_lock lock(m_queue_mutex);
+		if (m_queue.size() < m_queue_limit) {
+			m_queue.push_back(Admitted {
+				.fd = fd,
+				.deadline = (m_queue_slo.count() > 0) ? now + m_queue_slo :
+					std::chrono::steady_clock::time_point::max(),
+			});
+			m_queue_depth.store(m_queue.size(), std::memory_order_relaxed);
+			m_queue_cond.notify_one();
+			return;
+		}
+	}
+	this->shed(fd);
+}
+
+void Acceptor::shed(int fd)
+{
+	static constexpr char response[] =
+		"HTTP/1.1 503 Service Unavailable\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n"
+		"Retry-After: 1\r\n"
+		"\r\n";
+	// Read what already arrived of the request, so that closing the
+	// socket is less likely to reset the connection before the client
+	// reads the response
+	char buffer[4096];
+	while (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+	send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(fd, SHUT_WR);
+	close(fd);
+	m_shed.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Acceptor::dispatch_thread()
+{
+	using namespace std::chrono;
+	while (true)
+	{
+		Admitted conn;
+		{
+			std::unique_lock lock(m_queue_mutex);
+			m_queue_cond.wait(lock, [this] { return !m_queue.empty() || m_stop; });
+			if (m_stop) {
+				for (const Admitted& admitted : m_queue)
+					close(admitted.fd);
+				m_queue.clear();
+				return;
+			}
+			conn = m_queue.front();
+			m_queue.pop_front();
+			m_queue_depth.store(m_queue.size(), std::memory_order_relaxed);
+		}
+		// Wait for an idle VM, at most until the connection's deadline
+		bool idle = false;
+		while (true)
+		{
+			const auto now = steady_clock::now();
+			if (now >= conn.deadline)
+				break;
+			auto wait = duration_cast<microseconds>(std::min<steady_clock::duration>(conn.deadline - now, hours(1)));
+			if (m_on_starved)
+				wait = std::min(wait, m_grow_wait);
+			if (this->acquire_idle(wait)) {
+				idle = true;
+				break;
+			}
+			if (m_stop.load(std::memory_order_relaxed)) {
+				close(conn.fd);
+				return;
+			}
+			if (m_on_starved) {
+				m_on_starved(this->queue_depth() + 1);
+			}
+		}
+		if (!idle) {
+			this->shed(conn.fd);
+			const auto now = steady_clock::now();
+			if (now - m_last_shed_report >= seconds(1)) {
+				m_last_shed_report = now;
+				fprintf(stderr, "Admission: shedding connections (queue: %zu, shed: %lu)\n",
+					this->queue_depth(), this->shed_connections());
+			}
+			continue;
+		}
+		VirtualMachine* vm = nullptr;
+		while (!m_idle.pop(vm)) {
+			std::this_thread::yield();
+		}
+		vm->deliver_connection(conn.fd);
+	}
+}
+
+void VirtualMachine::deliver_connection(int fd)
+{
+	this->m_pending_fd.store(fd, std::memory_order_release);
+	this->m_pending_fd.notify_one();
+}
+
+void VirtualMachine::wait_for_connection()
+{
+	this->m_acceptor->push_idle(*this);
+	int fd;
+	while ((fd = this->m_pending_fd.exchange(-1, std::memory_order_acquire)) == -1) {
+		this->m_pending_fd.wait(-1, std::memory_order_acquire);
+	}
+	if (fd == PENDING_RETIRE) {
+		this->m_retired = true;
+		return;
+	}
+	this->inject_connection(fd);
+}
+
+void VirtualMachine::retire()
+{
+	this->deliver_connection(PENDING_RETIRE);
+}
+
+void VirtualMachine::pre_accept_connection()
+{
+	if (this->m_accept_epoll_fd < 0) {
+		// EPOLLEXCLUSIVE wakes a single idle VM per incoming connection
+		this->m_accept_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (this->m_accept_epoll_fd < 0) {
+			throw std::runtime_error("epoll_create1() failed: " + std::string(strerror(errno)));
+		}
+		for (const int listener : { this->m_listener_fd, this->m_drain_listener_fd }) {
+			if (listener < 0)
+				continue;
+			struct epoll_event event {};
+			event.events = EPOLLIN | EPOLLEXCLUSIVE;
+			event.data.fd = listener;
+			if (epoll_ctl(this->m_accept_epoll_fd, EPOLL_CTL_ADD, listener, &event) < 0) {
+				throw std::runtime_error("epoll_ctl() failed: " + std::string(strerror(errno)));
+			}
+		}
+	}
+	while (true)
+	{
+		struct epoll_event event;
+		if (epoll_wait(this->m_accept_epoll_fd, &event, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("epoll_wait() failed: " + std::string(strerror(errno)));
+		}
+		const int fd = accept4(event.data.fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd >= 0) {
+			this->inject_connection(fd);
+			return;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+			throw std::runtime_error("accept4() failed: " + std::string(strerror(errno)));
+		}
+	}
+}
+
+void VirtualMachine::inject_connection(int fd)
+{
+	// The VM is paused right after its poll, epoll_wait or accept4
+	// system call. Complete that call as if the listener became ready.
+	this->trace(TraceEvent::Inject, fd);
+	this->m_injected_fd = fd;
+	auto& regs = machine().registers();
+	switch (this->m_poll_method)
+	{
+	case PollMethod::Blocking:
+		// Re-doing accept4() picks up the injected connection
+		this->restart_poll_syscall();
+		return;
+	case PollMethod::Poll: {
+		// poll(fds, nfds, timeout): only the listener becomes readable
+		const uint64_t fds_addr = regs.rdi;
+		const unsigned nfds = regs.rsi;
+		unsigned ready = 0;
+		struct pollfd pfds[64];
+		for (unsigned i = 0; i < nfds; i += std::size(pfds)) {
+			const unsigned count = std::min<unsigned>(nfds - i, std::size(pfds));
+			const uint64_t addr = fds_addr + i * sizeof(struct pollfd);
+			machine().copy_from_guest(pfds, addr, count * sizeof(struct pollfd));
+			for (unsigned j = 0; j < count; j++) {
+				pfds[j].revents = (pfds[j].fd == this->m_listener_vfd) ? POLLIN : 0;
+				ready += (pfds[j].revents != 0);
+			}
+			machine().copy_to_guest(addr, pfds, count * sizeof(struct pollfd));
+		}
+		if (ready == 0) {
+			// Not waiting on the listener (see below)
+			this->restart_poll_syscall();
+			return;
+		}
+		regs.rax = ready;
+		break;
+	}
+	case PollMethod::Epoll: {
+		// epoll_wait(epfd, events, maxevents, timeout): return the
+		// listener's registered event data as the single ready event
+		const auto& entry = machine().fds().get_epoll_entry_for_vfd(regs.rdi);
+		auto it = entry.epoll_fds.find(this->m_listener_vfd);
+		if (it == entry.epoll_fds.end()) {
+			// Not waiting on the listener: re-do the system call as
+			// without an acceptor. The connection stays pending for
+			// the guest's next accept4 on the listener.
+			this->restart_poll_syscall();
+			return;
+		}
+		struct epoll_event event = it->second;
+		event.events = EPOLLIN;
+		machine().copy_to_guest(regs.rsi, &event, sizeof(event));
+		regs.rax = 1;
+		break;
+	}
+	case PollMethod::Undefined:
+		close(fd);
+		this->m_injected_fd = -1;
+		throw std::runtime_error("VM does not have a known polling method");
+	}
+	machine().set_registers(regs);
+}
+
+void VirtualMachine::accept_injected_connection(int flags)
+{
+	const int fd = std::exchange(this->m_injected_fd, -1);
+	// A parked keep-alive connection keeps its previous file flags
+	const int fl = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, (flags & SOCK_NONBLOCK) ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK));
+	struct sockaddr_storage addr {};
+	socklen_t addrlen = sizeof(addr);
+	if (getpeername(fd, reinterpret_cast<struct sockaddr *>(&addr), &addrlen) < 0) {
+		addrlen = 0;
+	}
+	// accept4(fd, addr, addrlen, flags)
+	auto& regs = machine().registers();
+	const uint64_t g_addr = regs.rsi;
+	const uint64_t g_addrlen = regs.rdx;
+	const int vfd = machine().fds().accept_socket_callback(
+		this->m_listener_vfd, this->m_listener_fd, fd, addr, addrlen);
+	if (vfd < 0) {
+		close(fd);
+		regs.rax = vfd;
+		machine().set_registers(regs);
+		return;
+	}
+	if (g_addr != 0 && g_addrlen != 0) {
+		socklen_t guest_addrlen = 0;
+		machine().copy_from_guest(&guest_addrlen, g_addrlen, sizeof(guest_addrlen));
+		machine().copy_to_guest(g_addr, &addr, std::min(guest_addrlen, addrlen));
+		machine().copy_to_guest(g_addrlen, &addrlen, sizeof(addrlen));
+	}
+	regs.rax = vfd;
+	machine().set_registers(regs);
+}
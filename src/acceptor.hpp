@@ -0,0 +1,152 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <thread>
+#include <vector>
+struct VirtualMachine;
+
+// Bounded lock-free multi-producer multi-consumer queue
+// (Dmitry Vyukov's sequenced ring buffer).
+template <typename T>
+struct IdleQueue
+{
+	bool push(T data)
+	{
+		size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		while (true) {
+			Cell& cell = m_cells[pos & m_mask];
+			const size_t seq = cell.sequence.load(std::memory_order_acquire);
+			const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.data = data;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false; // Full
+			} else {
+				pos = m_enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+	bool pop(T& data)
+	{
+		size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		while (true) {
+			Cell& cell = m_cells[pos & m_mask];
+			const size_t seq = cell.sequence.load(std::memory_order_acquire);
+			const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					data = cell.data;
+					cell.sequence.store(pos + m_mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false; // Empty
+			} else {
+				pos = m_dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+	size_t size() const noexcept
+	{
+		return m_enqueue_pos.load(std::memory_order_relaxed) - m_dequeue_pos.load(std::memory_order_relaxed);
+	}
+
+	IdleQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		m_mask = size - 1;
+		m_cells = std::make_unique<Cell[]>(size);
+		for (size_t i = 0; i < size; i++)
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+	std::unique_ptr<Cell[]> m_cells;
+	size_t m_mask;
+	alignas(64) std::atomic<size_t> m_enqueue_pos = 0;
+	alignas(64) std::atomic<size_t> m_dequeue_pos = 0;
+};
+
+// Host-side acceptor: one or more host threads own the listening socket
+// the master VM set up, and hand each accepted connection to an idle
+// request VM. The VM receives it as the result of its pending poll,
+// epoll_wait or accept4, so request VMs never contend on the listener.
+struct Acceptor
+{
+	// Called by a request VM thread when it is ready for a connection
+	void push_idle(VirtualMachine&);
+	// Remove an idle VM from the queue without blocking, or nullptr
+	VirtualMachine* take_idle();
+	size_t idle_vms() const noexcept { return m_idle.size(); }
+	// Called with the number of waiting connections when no VM
+	// became idle within grow_wait (see RequestPool)
+	using on_starved_t = std::function<void(unsigned pending)>;
+	void set_on_starved(on_starved_t callback, std::chrono::microseconds grow_wait);
+	// Block until a VM is idle, or nullptr once stopped. While starved,
+	// pending() tells how many connections are waiting for a VM.
+	VirtualMachine* wait_idle(const std::function<unsigned()>& pending);
+
+	// Admission control: accept eagerly into a bounded queue, and shed
+	// connections with a 503 when the queue is full or when they wait
+	// for a VM longer than the queue-time SLO (zero for no SLO)
+	void set_admission(size_t limit, std::chrono::microseconds slo);
+	size_t queue_depth() const noexcept { return m_queue_depth.load(std::memory_order_relaxed); }
+	uint64_t shed_connections() const noexcept { return m_shed.load(std::memory_order_relaxed); }
+
+	void start();
+	// Wake every thread waiting for a connection or an idle VM, which
+	// then returns. Also called by the destructor.
+	void stop();
+
+	Acceptor(const VirtualMachine& master, unsigned threads, size_t max_vms);
+	~Acceptor();
+
+private:
+	int accept_connection();
+	bool acquire_idle(std::chrono::microseconds timeout);
+	unsigned pending_connections() const;
+	void acceptor_thread();
+	void admit(int fd);
+	void shed(int fd);
+	void dispatch_thread();
+
+	const VirtualMachine& m_master;
+	const int m_listener_fd;
+	const unsigned m_num_threads;
+	IdleQueue<VirtualMachine*> m_idle;
+	std::counting_semaphore<> m_idle_count {0};
+	on_starved_t m_on_starved = nullptr;
+	std::chrono::microseconds m_grow_wait {0};
+	std::vector<std::thread> m_threads;
+	std::atomic<bool> m_stop = false;
+	int m_stop_fd = -1; // eventfd, readable once stopped
+
+	struct Admitted {
+		int fd;
+		std::chrono::steady_clock::time_point deadline;
+	};
+	size_t m_queue_limit = 0;
+	std::chrono::microseconds m_queue_slo {0};
+	std::deque<Admitted> m_queue;
+	std::mutex m_queue_mutex;
+	std::condition_variable m_queue_cond;
+	std::atomic<size_t> m_queue_depth = 0;
+	std::atomic<uint64_t> m_shed = 0;
+	std::chrono::steady_clock::time_point m_last_shed_report;
+};
@@ -4,6 +4,8 @@
 extern size_t sys_kvmserverguest_remote_resume(void* buffer, ssize_t len);
 /* Wait for remote resume (in storage) */
 extern size_t sys_kvmserverguest_storage_wait_paused(void** req, ssize_t len);
+/* The response on the current connection is complete */
+extern long sys_kvmserverguest_request_done(void);
 
 size_t kvmserverguest_remote_resume(void *buffer, ssize_t len) {
 	return sys_kvmserverguest_remote_resume(buffer, len);
@@ -14,6 +16,17 @@ size_t kvmserverguest_storage_wait_paused(void** req, ssize_t len)
 	return sys_kvmserverguest_storage_wait_paused(req, len);
 }
 
+/* Reset an ephemeral VM after each request on a keep-alive connection.
+   Call it once a response has been written and no bytes of the next
+   request have been read. On success it does not return: the VM is
+   reset and accepts the same connection again. Otherwise (eg. not an
+   ephemeral request VM) it returns a negative error and the program
+   continues serving the connection as usual. */
+long kvmserverguest_request_done(void)
+{
+	return sys_kvmserverguest_request_done();
+}
+
 asm(".global sys_kvmserverguest_remote_resume\n"
 	".type sys_kvmserverguest_remote_resume, @function\n"
 	"sys_kvmserverguest_remote_resume:\n"
@@ -21,6 +34,13 @@ asm(".global sys_kvmserverguest_remote_resume\n"
 	"	out %eax, $0\n"
 	"   ret\n");
 
+asm(".global sys_kvmserverguest_request_done\n"
+	".type sys_kvmserverguest_request_done, @function\n"
+	"sys_kvmserverguest_request_done:\n"
+	"	mov $0x10003, %eax\n"
+	"	out %eax, $0\n"
+	"   ret\n");
+
 asm(".global sys_kvmserverguest_storage_wait_paused\n"
 	".type sys_kvmserverguest_storage_wait_paused, @function\n"
 	"sys_kvmserverguest_storage_wait_paused:\n"
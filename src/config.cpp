@@ -121,79 +121,106 @@ std::string lookup_program(const std::string& program)
 	throw CLI::ValidationError("program: Not an executable", program);
 }
 
+// [first-]last, where port 0 is any port
+static NetworkAllowList::PortRange parse_ports(const std::string& ports, const std::string& value)
+{
+	const size_t dash = ports.find('-');
+	unsigned long first, last;
+	try {
+		first = std::stoul(ports.substr(0, dash));
+		last = (dash != std::string::npos) ? std::stoul(ports.substr(dash + 1)) : first;
+	} catch (...) {
+		throw CLI::ValidationError("Invalid port", value);
+	}
+	if (last > std::numeric_limits<in_port_t>::max() || first > last) {
+		throw CLI::ValidationError("Invalid port", value);
+	}
+	if (dash == std::string::npos && first == 0) {
+		return NetworkAllowList::ANY_PORT;
+	}
+	return { uint16_t(first), uint16_t(last) };
+}
+
+// address[/prefix][:ports], where an IPv6 address and prefix are in
+// brackets, eg. 10.0.0.0/8:443 or [fd00::/8]:8000-8999
 static bool parse_addresses(
 	const std::vector<std::string>& config,
-	std::vector<struct sockaddr_storage>& allowed_ipv4,
-	std::vector<struct sockaddr_storage>& allowed_ipv6,
+	NetworkAllowList& allowed,
 	const bool verbose
 ) {
 	for (const auto& value : config) {
 		if (value.empty() || value == "false") {
 			continue;
 		}
-		uint port = 0;
+		NetworkAllowList::PortRange ports = NetworkAllowList::ANY_PORT;
 		std::string address(value);
 		if (value == "true") {
 			address = "";
 		}
-		size_t maybe_colon = address.find_last_not_of("0123456789");
+		size_t maybe_colon = address.find_last_not_of("0123456789-");
 		if (maybe_colon != std::string::npos && value[maybe_colon] == ':') {
-			uint parsed_port;
-			try {
-				port = std::stoul(address.substr(maybe_colon + 1, std::string::npos));
-			} catch (...) {
-				throw CLI::ValidationError("Invalid port", value);
-			}
+			ports = parse_ports(address.substr(maybe_colon + 1), value);
 			address = address.substr(0, maybe_colon);
 		}
-
-		if (port > std::numeric_limits<in_port_t>::max()) {
-			throw CLI::ValidationError("Invalid port", value);
-		}
+		const bool any_port = ports.first == 0 && ports.last == NetworkAllowList::ANY_PORT.last;
 
 		if (address == "") {
-			if (port == 0) {
-				allowed_ipv4.clear();
-				allowed_ipv6.clear();
+			if (any_port) {
+				allowed.clear();
 			}
-			auto& storage = allowed_ipv4.emplace_back((struct sockaddr_storage) {});
-			storage.ss_family = AF_INET;
-			reinterpret_cast<sockaddr_in*>(&storage)->sin_port = htons(port);
-			storage = allowed_ipv6.emplace_back((struct sockaddr_storage) {});
-			storage.ss_family = AF_INET6;
-			reinterpret_cast<sockaddr_in6*>(&storage)->sin6_port = htons(port);
-			if (port == 0) {
+			allowed.add_any(ports);
+			if (any_port) {
 				return true;
 			};
 			continue;
 		}
 
-		// IPv6
-		if (address.front() == '[') {
+		// IPv6, or IPv4 with an optional prefix length
+		const bool ipv6 = address.front() == '[';
+		if (ipv6) {
 			if (address.back() != ']') {
 				throw CLI::ValidationError("Invalid ipv6 address", value);
 			}
-			std::string new_address(address.substr(1, value.length() - 2));
-			auto& storage = allowed_ipv6.emplace_back((struct sockaddr_storage) {});
-			sockaddr_in6* addr = reinterpret_cast<sockaddr_in6*>(&storage);
-			addr->sin6_family = AF_INET6;
-			if (inet_pton(AF_INET6, new_address.c_str(), &addr->sin6_addr) <= 0) {
+			address = address.substr(1, address.size() - 2);
+		}
+		const size_t slash = address.find('/');
+		unsigned prefix_len = ipv6 ? 128 : 32;
+		if (slash != std::string::npos) {
+			try {
+				size_t end = 0;
+				prefix_len = std::stoul(address.substr(slash + 1), &end);
+				if (end != address.size() - slash - 1)
+					throw std::invalid_argument("prefix");
+			} catch (...) {
+				throw CLI::ValidationError("Invalid prefix length", value);
+			}
+			if (prefix_len > (ipv6 ? 128u : 32u)) {
+				throw CLI::ValidationError("Invalid prefix length", value);
+			}
+			address = address.substr(0, slash);
+		}
+		if (ipv6) {
+			struct in6_addr sin6_addr;
+			if (inet_pton(AF_INET6, address.c_str(), &sin6_addr) <= 0) {
 				throw CLI::ValidationError("Invalid IPv6 address", value);
 			}
-			addr->sin6_port = htons(port);
+			if (slash == std::string::npos && IN6_IS_ADDR_UNSPECIFIED(&sin6_addr)) {
+				prefix_len = 0; // [::] means any IPv6 address
+			}
+			allowed.add(AF_INET6, &sin6_addr, prefix_len, ports);
 			continue;
 		}
-
-		// IPv4
-		in_addr sin_addr;
+		struct in_addr sin_addr;
 		if (inet_pton(AF_INET, address.c_str(), &sin_addr) > 0) {
-			auto& storage = allowed_ipv4.emplace_back((struct sockaddr_storage) {});
-			sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(&storage);
-			addr->sin_family = AF_INET;
-			addr->sin_addr = sin_addr;
-			addr->sin_port = htons(port);
+			if (slash == std::string::npos && sin_addr.s_addr == INADDR_ANY) {
+				prefix_len = 0; // 0.0.0.0 means any IPv4 address
+			}
+			allowed.add(AF_INET, &sin_addr, prefix_len, ports);
 			continue;
 		}
+		if (slash != std::string::npos) {
+			throw CLI::ValidationError("Invalid IPv4 address", value);
+		}
 
 		// Resolve the domain name to an IP address
 		struct addrinfo hints = {};
@@ -204,33 +231,22 @@ static bool parse_addresses(
 			throw CLI::ValidationError("Invalid domain name", value);
 		}
 		for (struct addrinfo* res = head; res != nullptr; res = res->ai_next) {
+			const void* addr;
 			if (res->ai_family == AF_INET) {
-				auto& storage = allowed_ipv4.emplace_back((struct sockaddr_storage) {});
-				sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(&storage);
-				addr->sin_family = AF_INET;
-				addr->sin_addr = reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr;
-				addr->sin_port = htons(port);
-				if (verbose) {
-					std::string found;
-					found.reserve(64);
-					inet_ntop(AF_INET, reinterpret_cast<void*>(&addr->sin_addr), found.data(), found.capacity());
-					printf("Resolved %s to %s\n", address.c_str(), found.c_str());
-				}
+				addr = &reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr;
+				allowed.add(AF_INET, addr, 32, ports);
 			} else if (res->ai_family == AF_INET6) {
-				auto& storage = allowed_ipv6.emplace_back((struct sockaddr_storage) {});
-				sockaddr_in6* addr = reinterpret_cast<sockaddr_in6*>(&storage);
-				addr->sin6_family = AF_INET6;
-				addr->sin6_addr = reinterpret_cast<sockaddr_in6*>(res->ai_addr)->sin6_addr;
-				addr->sin6_port = htons(port);
-				if (verbose) {
-					std::string found;
-					found.reserve(64);
-					inet_ntop(AF_INET6, reinterpret_cast<void*>(&addr->sin6_addr), found.data(), found.capacity());
-					printf("Resolved %s to %s\n", address.c_str(), found.c_str());
-				}
+				addr = &reinterpret_cast<sockaddr_in6*>(res->ai_addr)->sin6_addr;
+				allowed.add(AF_INET6, addr, 128, ports);
 			} else {
+				freeaddrinfo(head);
 				throw CLI::ValidationError("Invalid address family for domain", value);
 			}
+			if (verbose) {
+				char found[INET6_ADDRSTRLEN];
+				inet_ntop(res->ai_family, addr, found, sizeof(found));
+				printf("Resolved %s to %s\n", address.c_str(), found);
+			}
 		}
 		freeaddrinfo(head);
 	}
@@ -312,16 +328,24 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 	// TODO: This does not allow env=[] in config file.
 	app.add_option("--env", config.environ, "add an environment variable")->allow_extra_args(false);
 
-	app.add_option("-t,--threads", config.concurrency, "Number of request VMs (0 to use cpu count)")->capture_default_str();
+	app.add_option("-t,--threads,--min-threads", config.concurrency, "Number of request VMs (0 to use cpu count)")->capture_default_str();
+	app.add_option("--max-threads", config.max_concurrency, "Grow the request VMs on demand up to this number (0 for a fixed pool)")->capture_default_str();
 	app.add_flag("-e,--ephemeral", config.ephemeral, "Use ephemeral VMs");
 	app.add_option("-w,--warmup", config.warmup_connect_requests, "Number of warmup requests")->capture_default_str();
 	app.add_option("--snapshot-file", config.snapshot_filename, "Snapshot filename");
+	app.add_option("--snapshot-hot-pages", config.snapshot_hot_pages_filename, "Prefetch the snapshot pages listed in a file at start, or record the list when there is none");
+	app.add_option("--frontend", config.frontend_address, "Serve HTTP keep-alive clients on [host:]port and forward requests to ephemeral VMs, instead of the program's listener");
+	app.add_option("--metrics", config.metrics_address, "Serve Prometheus metrics on a unix socket path or [host:]port");
 
 	app.add_flag("-v,--verbose", config.verbose, "Enable verbose output")->group("Verbose");
 	app.add_flag("--verbose-syscalls", config.verbose_syscalls, "Enable verbose syscall output")->group("Verbose");
 	app.add_flag("--verbose-mmap-syscalls", config.verbose_mmap_syscalls, "Enable verbose mmap syscall output")->group("Verbose");
 	app.add_flag("--verbose-thread-syscalls", config.verbose_thread_syscalls, "Enable verbose thread syscall output")->group("Verbose");
 	app.add_flag("--verbose-pagetables", config.verbose_pagetable, "Enable verbose pagetable output")->group("Verbose");
+	app.add_option("--trace", config.trace_filename, "Write a binary trace of request events to a file")->group("Verbose");
+	app.add_option("--profile-hz", config.profile_hz, "Sample guest stacks of request VMs, served as folded stacks on --metrics /profile")->group("Verbose");
+	app.add_option("--dirty-report", config.dirty_report_filename, "Attribute the pages dirtied by requests to guest mappings and variables, written to a file")->group("Verbose");
+	app.add_option("--dirty-report-requests", config.dirty_report_requests, "Rewrite the dirty report every N requests")->capture_default_str()->group("Verbose");
 
 	app.add_flag("--allow-all", [&](bool allow_all) {
 		if (allow_all) {
@@ -335,8 +359,8 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 	app.add_flag("--allow-write{/}", allow_write, "Allow filesystem write access")->delimiter(',')->excludes("--allow-all")->group("Permissions");
 	app.add_flag("--allow-env{*}", allow_env, "Allow access to environment variables. Optionally specify accessible environment variables (e.g. --allow-env=USER,PATH,API_*).")->delimiter(',')->excludes("--allow-all")->group("Permissions");
 	app.add_flag("--allow-net", allow_net, "Allow network access")->delimiter(',')->excludes("--allow-all")->group("Permissions");
-	app.add_flag("--allow-connect", allow_connect, "Allow outgoing network access")->delimiter(',')->excludes("--allow-all")->group("Permissions");
-	app.add_flag("--allow-listen", allow_listen, "Allow incoming network access")->delimiter(',')->excludes("--allow-all")->group("Permissions");
+	app.add_flag("--allow-connect", allow_connect, "Allow outgoing network access to address[/prefix][:port[-port]]")->delimiter(',')->excludes("--allow-all")->group("Permissions");
+	app.add_flag("--allow-listen", allow_listen, "Allow incoming network access on address[/prefix][:port[-port]]")->delimiter(',')->excludes("--allow-all")->group("Permissions");
 	app.add_flag("--volume", volume, "<host-path>:<guest-path>[:r?w?=r]")->delimiter(',')->excludes("--allow-all")->group("Permissions");
 
 	app.add_option("--max-boot-time", config.max_boot_time)->capture_default_str()->group("Advanced");
@@ -355,6 +379,15 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 	app.add_flag("!--no-split-hugepages", config.split_hugepages)->group("Advanced");
 	app.add_flag("--transparent-hugepages", config.transparent_hugepages)->group("Advanced");
 	app.add_flag("!--no-ephemeral-keep-working-memory", config.ephemeral_keep_working_memory)->group("Advanced");
+	app.add_flag("--standby-fork", config.standby_forks, "Keep a reset standby fork per request VM")->group("Advanced");
+	app.add_flag("--pre-accept", config.pre_accept, "Accept on the host before resuming ephemeral VMs, for programs that only wait on their listener")->group("Advanced");
+	app.add_option("--pool-grow-wait", config.pool_grow_wait, "Milliseconds a connection waits for an idle VM before the pool grows")->capture_default_str()->group("Advanced");
+	app.add_option("--pool-cooldown", config.pool_cooldown, "Seconds of idle VMs before the pool shrinks")->capture_default_str()->group("Advanced");
+	app.add_option("--acceptors", config.acceptor_threads, "Host threads accepting connections for request VMs (0 to disable)")->capture_default_str()->group("Advanced");
+	app.add_option("--admission-queue", config.admission_queue, "Connections that may wait for a request VM before the rest get a 503 (0 to disable)")->capture_default_str()->group("Advanced");
+	app.add_option("--queue-slo", config.queue_slo, "Milliseconds a connection may wait for a request VM before it gets a 503 (0 for no limit)")->capture_default_str()->group("Advanced");
+	app.add_flag("--numa", config.numa, "Replicate the master VM per NUMA node and pin request VMs")->group("Advanced");
+	app.add_flag("--reuseport", config.reuseport, "One SO_REUSEPORT listener per request VM, steered by CPU")->group("Advanced");
 
 	// This allows ++ to be used as an escape from subcommand positionals.
 	app.add_subcommand("++", "")->silent()->group("")->fallthrough();
@@ -418,6 +451,79 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 		if (config.concurrency == 0) {
 			config.concurrency = std::thread::hardware_concurrency();
 		}
+		if (config.standby_forks && !config.ephemeral) {
+			throw CLI::ValidationError("--standby-fork requires --ephemeral");
+		}
+		if (config.profile_hz > 0 && config.metrics_address.empty()) {
+			throw CLI::ValidationError("--profile-hz requires --metrics");
+		}
+		if (!config.snapshot_hot_pages_filename.empty() && config.snapshot_filename.empty()) {
+			throw CLI::ValidationError("--snapshot-hot-pages requires --snapshot-file");
+		}
+		if (config.dirty_report_requests == 0) {
+			throw CLI::ValidationError("--dirty-report-requests must be at least 1");
+		}
+		if (config.queue_slo > 0.0f && config.admission_queue == 0) {
+			throw CLI::ValidationError("--queue-slo requires --admission-queue");
+		}
+		if (config.admission_queue > 0) {
+			if (!config.ephemeral) {
+				throw CLI::ValidationError("--admission-queue requires --ephemeral");
+			}
+			if (!config.frontend_address.empty()) {
+				throw CLI::ValidationError("--admission-queue cannot be combined with --frontend");
+			}
+		}
+		if (!config.frontend_address.empty()) {
+			if (!config.ephemeral) {
+				throw CLI::ValidationError("--frontend requires --ephemeral");
+			}
+			// An acceptor thread would hold on to idle VMs while waiting
+			// for connections on the program's own listener
+			if (config.acceptor_threads > 0) {
+				throw CLI::ValidationError("--frontend cannot be combined with --acceptors");
+			}
+			// Both accept from the program's own listener, which the
+			// frontend leaves unserved
+			if (config.pre_accept) {
+				throw CLI::ValidationError("--frontend cannot be combined with --pre-accept");
+			}
+		}
+		if (config.max_concurrency > 0) {
+			if (config.max_concurrency < config.concurrency) {
+				throw CLI::ValidationError("--max-threads must be at least --threads");
+			}
+			if (!config.ephemeral) {
+				throw CLI::ValidationError("--max-threads requires --ephemeral");
+			}
+			// The acceptor is what notices connections waiting for a VM
+			if (config.acceptor_threads == 0 && config.frontend_address.empty()) {
+				config.acceptor_threads = 1;
+			}
+		}
+		// Admitted connections are accepted by the acceptor
+		if (config.admission_queue > 0 && config.acceptor_threads == 0) {
+			config.acceptor_threads = 1;
+		}
+		if (config.acceptor_threads > 0 && !config.ephemeral) {
+			throw CLI::ValidationError("--acceptors requires --ephemeral");
+		}
+		if (config.pre_accept && !config.ephemeral) {
+			throw CLI::ValidationError("--pre-accept requires --ephemeral");
+		}
+		if (config.reuseport) {
+			// Forks accept from their own listener on the host
+			if (!config.ephemeral) {
+				throw CLI::ValidationError("--reuseport requires --ephemeral");
+			}
+			config.pre_accept = true;
+			if (config.acceptor_threads > 0 || !config.frontend_address.empty()) {
+				throw CLI::ValidationError("--reuseport cannot be combined with --acceptors, --admission-queue, --max-threads or --frontend");
+			}
+			if (config.numa) {
+				throw CLI::ValidationError("--reuseport cannot be combined with --numa");
+			}
+		}
 		for (auto& path : allow_read) {
 			ensure_path(path, path, config.allowed_paths, true, false, false);
 		}
@@ -515,23 +621,19 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 
 		bool skip_allow_connect_listen = parse_addresses(
 			allow_net,
-			config.allowed_connect_ipv4,
-			config.allowed_connect_ipv6,
+			config.allowed_connect,
 			config.verbose
 		);
-		config.allowed_listen_ipv4 = config.allowed_connect_ipv4;
-		config.allowed_listen_ipv6 = config.allowed_connect_ipv6;
+		config.allowed_listen = config.allowed_connect;
 		if (!skip_allow_connect_listen) {
 			parse_addresses(
 				allow_connect,
-				config.allowed_connect_ipv4,
-				config.allowed_connect_ipv6,
+				config.allowed_connect,
 				config.verbose
 			);
 			parse_addresses(
 				allow_listen,
-				config.allowed_listen_ipv4,
-				config.allowed_listen_ipv6,
+				config.allowed_listen,
 				config.verbose
 			);
 		}
@@ -1,17 +1,32 @@
 #pragma once
+#include <algorithm>
 #include <filesystem>
 #include <map>
 #include <string>
 #include <sys/socket.h> // for sockaddr_storage
 #include <tinykvm/common.hpp>
 #include <vector>
+#include "network.hpp"
 
 struct Configuration
 {
 	std::string main_filename;
 	std::string storage_filename;
 	std::string snapshot_filename;
+	std::string snapshot_hot_pages_filename; /* Pages of the snapshot to prefetch at start */
+	std::string frontend_address; /* [host:]port of the HTTP frontend */
+	std::string metrics_address; /* Unix socket path or [host:]port of the metrics endpoint */
+	std::string trace_filename; /* Binary request trace, see kvmserver_trace */
+	uint32_t profile_hz = 0; /* Guest stack samples per second per request VM, 0 to disable */
+	std::string dirty_report_filename; /* Dirty page attribution report */
+	uint32_t dirty_report_requests = 1000; /* Rewrite the dirty report every N requests */
 	uint16_t concurrency = 1; /* Request VMs */
+	uint16_t max_concurrency = 0; /* Elastic pool upper bound, 0 for a fixed pool */
+	float    pool_grow_wait = 1.0f; /* Milliseconds waiting for an idle VM before growing */
+	float    pool_cooldown = 30.0f; /* Seconds of idle VMs before shrinking */
+	uint16_t acceptor_threads = 0; /* Host threads accepting for request VMs */
+	uint32_t admission_queue = 0; /* Connections waiting for a request VM, 0 for no admission control */
+	float    queue_slo = 0.0f; /* Milliseconds a connection may wait for a VM, 0 for no SLO */
 	uint16_t warmup_connect_requests = 0; /* Warmup requests, individual connections */
 	uint16_t warmup_intra_connect_requests = 1; /* Send N requests while connected */
 	std::string warmup_path = "/"; /* Path to send requests to */
@@ -39,6 +54,10 @@ struct Configuration
 	bool     transparent_hugepages = false;
 	bool     ephemeral = false;
 	bool     ephemeral_keep_working_memory = true;
+	bool     standby_forks = false; /* Reset a standby fork in the background */
+	bool     pre_accept = false; /* Accept on the host before resuming ephemeral VMs */
+	bool     numa = false; /* Master replica and pinned request VMs per NUMA node */
+	bool     reuseport = false; /* One SO_REUSEPORT listener per request VM */
 	bool     verbose = false;
 	bool     verbose_syscalls = false;
 	bool     verbose_mmap_syscalls = false;
@@ -83,10 +102,8 @@ struct Configuration
 	std::map<std::filesystem::path, VirtualPath, ComparePathSegments> allowed_paths;
 	std::string current_working_directory;
 
-	std::vector<struct sockaddr_storage> allowed_connect_ipv4;
-	std::vector<struct sockaddr_storage> allowed_listen_ipv4;
-	std::vector<struct sockaddr_storage> allowed_connect_ipv6;
-	std::vector<struct sockaddr_storage> allowed_listen_ipv6;
+	NetworkAllowList allowed_connect;
+	NetworkAllowList allowed_listen;
 
 	static Configuration FromArgs(int argc, char* argv[]);
 };
@@ -0,0 +1,133 @@
+#include "dirty_report.hpp"
+
+#include "settings.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <tinykvm/amd64/paging.hpp>
+#include <vector>
+
+// Page table entry bits (Intel SDM 4.5)
+static constexpr uint64_t PTE_PRESENT = 1ULL << 0;
+static constexpr uint64_t PTE_RW = 1ULL << 1;
+static constexpr uint64_t PTE_USER = 1ULL << 2;
+static constexpr uint64_t PTE_DIRTY = 1ULL << 6;
+static constexpr uint64_t PTE_NX = 1ULL << 63;
+static constexpr uint64_t PAGE_SIZE = 4096;
+// Report this many of the most dirtied variables
+static constexpr size_t REPORT_VARIABLES = 50;
+
+DirtyReport::DirtyReport(const VirtualMachine& master, std::string filename, unsigned interval)
+	: m_filename(std::move(filename)),
+	  m_interval(interval),
+	  m_symbols(master.load_guest_symbols())
+{
+	const auto& machine = master.machine();
+	// The brk heap ends where the mmap area starts
+	m_heap_begin = machine.heap_address();
+	m_heap_end = machine.mmap_start();
+	m_stack_begin = machine.stack_address() - settings::MAIN_STACK_SIZE;
+	m_stack_end = machine.stack_address();
+}
+
+std::string DirtyReport::region_of(uint64_t addr, bool executable) const
+{
+	if (const auto* obj = m_symbols.object_of(addr))
+		return obj->name + (executable ? " code" : " data");
+	if (addr >= m_stack_begin && addr < m_stack_end)
+		return "stack";
+	if (addr >= m_heap_begin && addr < m_heap_end)
+		return "heap";
+	if (addr >= m_heap_end)
+		return (executable) ? "jit" : "mmap";
+	return "other";
+}
+
+void DirtyReport::record(tinykvm::Machine& fork, uint64_t working_pages)
+{
+	std::map<std::string, uint64_t> regions;
+	std::map<std::string, uint64_t> variables;
+	uint64_t pages = 0;
+	// Copy-on-write pages are read-only in a fresh fork, and the CPU sets
+	// the dirty bit of the private copy when the guest writes to it
+	tinykvm::foreach_page(fork.main_memory(),
+		[&](uint64_t addr, uint64_t& entry, size_t size) {
+			constexpr uint64_t wanted = PTE_PRESENT | PTE_RW | PTE_USER | PTE_DIRTY;
+			if ((entry & wanted) != wanted)
+				return;
+			const uint64_t count = std::max<uint64_t>(size / PAGE_SIZE, 1);
+			const bool executable = (entry & PTE_NX) == 0;
+			pages += count;
+			regions[this->region_of(addr, executable)] += count;
+			const auto* var = m_symbols.variable_in(addr, addr + size);
+			const auto* obj = (var != nullptr) ? m_symbols.object_of(var->addr) : nullptr;
+			if (obj != nullptr) {
+				variables[obj->name + ": " + var->name] += count;
+			}
+		});
+
+	std::scoped_lock lock(m_mutex);
+	m_requests++;
+	m_pages += pages;
+	m_working_pages += working_pages;
+	m_histogram[std::min<size_t>(std::bit_width(pages), BUCKETS - 1)]++;
+	for (const auto& [name, count] : regions)
+		m_regions[name] += count;
+	for (const auto& [name, count] : variables)
+		m_variables[name] += count;
+	if (m_requests % m_interval == 0) {
+		this->write();
+	}
+}
+
+void DirtyReport::write() const
+{
+	const std::string temp = m_filename + ".tmp";
+	FILE* fp = fopen(temp.c_str(), "w");
+	if (fp == nullptr) {
+		fprintf(stderr, "Failed to write dirty report '%s': %s\n",
+			temp.c_str(), strerror(errno));
+		return;
+	}
+	const double requests = m_requests;
+	fprintf(fp, "# Dirty pages over %lu requests: %.2f per request (%.1f KiB)\n",
+		m_requests, m_pages / requests, m_pages * (PAGE_SIZE / 1024.0) / requests);
+	fprintf(fp, "# Working pages counted by tinykvm: %.2f per request\n\n",
+		m_working_pages / requests);
+
+	fprintf(fp, "%-16s %12s\n", "# Pages/request", "Requests");
+	for (size_t i = 0; i < BUCKETS; i++) {
+		if (i == 0)
+			fprintf(fp, "%-16s %12lu\n", "0", m_histogram[i]);
+		else if (i == BUCKETS - 1)
+			fprintf(fp, ">= %-13lu %12lu\n", 1UL << (i - 1), m_histogram[i]);
+		else
+			fprintf(fp, "%-16s %12lu\n", (std::to_string(1UL << (i - 1))
+				+ "-" + std::to_string((1UL << i) - 1)).c_str(), m_histogram[i]);
+	}
+
+	// Largest first
+	auto sorted = [](const std::map<std::string, uint64_t>& map) {
+		std::vector<std::pair<std::string, uint64_t>> entries(map.begin(), map.end());
+		std::stable_sort(entries.begin(), entries.end(),
+			[](const auto& a, const auto& b) { return a.second > b.second; });
+		return entries;
+	};
+	fprintf(fp, "\n%-40s %14s %12s %7s\n", "# Region", "Pages/request", "KiB/request", "Share");
+	for (const auto& [name, count] : sorted(m_regions)) {
+		fprintf(fp, "%-40s %14.2f %12.1f %6.1f%%\n", name.c_str(), count / requests,
+			count * (PAGE_SIZE / 1024.0) / requests, 100.0 * count / m_pages);
+	}
+	fprintf(fp, "\n%-40s %14s\n", "# Variable", "Pages/request");
+	const auto variables = sorted(m_variables);
+	for (size_t i = 0; i < variables.size() && i < REPORT_VARIABLES; i++) {
+		fprintf(fp, "%-40s %14.2f\n", variables[i].first.c_str(), variables[i].second / requests);
+	}
+	fclose(fp);
+	if (rename(temp.c_str(), m_filename.c_str()) < 0) {
+		fprintf(stderr, "Failed to write dirty report '%s': %s\n",
+			m_filename.c_str(), strerror(errno));
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include "symbols.hpp"
+namespace tinykvm { struct Machine; }
+struct VirtualMachine;
+
+// Which guest mappings and variables request VMs dirty (--dirty-report).
+// Before each reset the fork's page tables are walked for pages written
+// during the request, and every interval requests the aggregate is
+// rewritten to the report file.
+struct DirtyReport
+{
+	static constexpr size_t BUCKETS = 16; // Powers of two, the last is open
+
+	// Called by the VM thread before its fork is reset. Working pages is
+	// what tinykvm counts as banked, to compare with the page walk.
+	void record(tinykvm::Machine& fork, uint64_t working_pages);
+
+	DirtyReport(const VirtualMachine& master, std::string filename, unsigned interval);
+
+private:
+	std::string region_of(uint64_t addr, bool executable) const;
+	void write() const;
+
+	const std::string m_filename;
+	const unsigned m_interval;
+	GuestSymbols m_symbols;
+	uint64_t m_heap_begin;
+	uint64_t m_heap_end;
+	uint64_t m_stack_begin;
+	uint64_t m_stack_end;
+
+	std::mutex m_mutex;
+	uint64_t m_requests = 0;
+	uint64_t m_pages = 0;
+	uint64_t m_working_pages = 0;
+	std::array<uint64_t, BUCKETS> m_histogram {};
+	std::map<std::string, uint64_t> m_regions;
+	std::map<std::string, uint64_t> m_variables;
+};
@@ -0,0 +1,738 @@
+#include "frontend.hpp"
+
+#include "acceptor.hpp"
+#include "settings.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+struct Frontend::Connection {
+	int client_fd = -1;
+	int backend_fd = -1;
+	uint32_t client_events = 0;
+	uint32_t backend_events = 0;
+	std::string in;          // Client bytes not yet forwarded
+	std::string out;         // Bytes not yet written to the client
+	std::string backend_out; // Request bytes not yet written to the VM
+	std::string response;    // Response header, or EOF-delimited body
+	std::string response_header;
+	uint64_t body_remaining = 0;
+	bool has_length = false;
+	bool headers_done = false;
+	bool until_eof = false;  // The response ends when the VM closes
+	bool streaming = false;  // An EOF-delimited body too large to buffer
+	bool chunked_out = false; // Streamed to the client in chunks
+	bool http10 = false;
+	bool head_request = false;
+	bool continue_sent = false;
+	size_t request_size = 0; // Header and body of the next request, once known
+	bool keep_alive = true;
+	bool client_closed = false; // No more requests from the client
+	bool close_after = false;   // Close once everything is written
+	bool closed = false;
+
+	// A request body is read whole before it is forwarded
+	size_t in_limit() const noexcept {
+		return std::max(settings::FRONTEND_MAX_BUFFERED, request_size);
+	}
+};
+
+struct HttpHeader {
+	std::string_view name;
+	std::string_view value;
+};
+
+static bool iequals(std::string_view a, std::string_view b)
+{
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); i++) {
+		if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+			return false;
+	}
+	return true;
+}
+static bool icontains(std::string_view haystack, std::string_view needle)
+{
+	for (size_t i = 0; i + needle.size() <= haystack.size(); i++) {
+		if (iequals(haystack.substr(i, needle.size()), needle))
+			return true;
+	}
+	return false;
+}
+
+// Split a header block (ending with CRLF) into its start line and headers
+static std::string_view parse_headers(std::string_view block, std::vector<HttpHeader>& headers)
+{
+	size_t eol = block.find("\r\n");
+	const std::string_view start_line = block.substr(0, eol);
+	size_t pos = eol + 2;
+	while (pos < block.size())
+	{
+		eol = block.find("\r\n", pos);
+		if (eol == std::string_view::npos)
+			break;
+		const std::string_view line = block.substr(pos, eol - pos);
+		pos = eol + 2;
+		const size_t colon = line.find(':');
+		if (colon == std::string_view::npos)
+			continue;
+		std::string_view value = line.substr(colon + 1);
+		while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+			value.remove_prefix(1);
+		while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+			value.remove_suffix(1);
+		headers.push_back({line.substr(0, colon), value});
+	}
+	return start_line;
+}
+
+// Hop-by-hop headers are replaced by the frontend
+static bool is_hop_by_hop(std::string_view name)
+{
+	return iequals(name, "Connection") || iequals(name, "Keep-Alive")
+		|| iequals(name, "Proxy-Connection") || iequals(name, "Expect");
+}
+
+static bool parse_length(std::string_view value, uint64_t& length)
+{
+	if (value.empty())
+		return false;
+	length = 0;
+	for (const char c : value) {
+		if (c < '0' || c > '9' || length > (UINT64_MAX - 9) / 10)
+			return false;
+		length = length * 10 + (c - '0');
+	}
+	return true;
+}
+
+Frontend::Frontend(const Configuration& config, Acceptor& acceptor)
+	: m_config(config),
+	  m_acceptor(acceptor)
+{
+	// [host:]port, where an IPv6 host is in brackets
+	std::string host;
+	std::string port = config.frontend_address;
+	const size_t colon = port.rfind(':');
+	if (colon != std::string::npos) {
+		host = port.substr(0, colon);
+		port = port.substr(colon + 1);
+		if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.size() - 2);
+	}
+	struct addrinfo hints {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	struct addrinfo* result = nullptr;
+	const int res = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+	if (res != 0) {
+		throw std::runtime_error("Frontend: invalid address '" + config.frontend_address + "': " + gai_strerror(res));
+	}
+	const int fd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	const int one = 1;
+	if (fd < 0
+		|| setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+		|| bind(fd, result->ai_addr, result->ai_addrlen) < 0
+		|| listen(fd, SOMAXCONN) < 0)
+	{
+		const int error = errno;
+		freeaddrinfo(result);
+		if (fd >= 0)
+			close(fd);
+		throw std::runtime_error("Frontend: failed to listen on '" + config.frontend_address + "': " + strerror(error));
+	}
+	freeaddrinfo(result);
+	this->m_listener_fd = fd;
+
+	this->m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (this->m_epoll_fd < 0) {
+		throw std::runtime_error("Frontend: epoll_create1() failed: " + std::string(strerror(errno)));
+	}
+	struct epoll_event event {};
+	event.events = EPOLLIN;
+	event.data.fd = this->m_listener_fd;
+	if (epoll_ctl(this->m_epoll_fd, EPOLL_CTL_ADD, this->m_listener_fd, &event) < 0) {
+		throw std::runtime_error("Frontend: epoll_ctl() failed: " + std::string(strerror(errno)));
+	}
+	this->m_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	event.data.fd = this->m_stop_fd;
+	if (this->m_stop_fd < 0 || epoll_ctl(this->m_epoll_fd, EPOLL_CTL_ADD, this->m_stop_fd, &event) < 0) {
+		throw std::runtime_error("Frontend: eventfd() failed: " + std::string(strerror(errno)));
+	}
+}
+Frontend::~Frontend()
+{
+	m_stop = true;
+	const uint64_t one = 1;
+	if (m_stop_fd >= 0 && write(m_stop_fd, &one, sizeof(one)) < 0) {
+		fprintf(stderr, "Frontend: eventfd write failed: %s\n", strerror(errno));
+	}
+	{
+		std::scoped_lock lock(m_queue_mutex);
+	}
+	m_queue_cond.notify_all();
+	// The dispatcher may be waiting for an idle VM
+	m_acceptor.stop();
+	if (m_event_thread.joinable())
+		m_event_thread.join();
+	if (m_dispatch_thread.joinable())
+		m_dispatch_thread.join();
+
+	for (const int fd : m_queue)
+		close(fd);
+	for (const auto& [fd, conn] : m_fds)
+		close(fd);
+	for (const int fd : { m_listener_fd, m_epoll_fd, m_stop_fd }) {
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+void Frontend::start()
+{
+	m_dispatch_thread = std::thread(&Frontend::dispatch_thread, this);
+	m_event_thread = std::thread(&Frontend::event_loop, this);
+}
+
+void Frontend::dispatch_thread()
+{
+	while (true)
+	{
+		int fd;
+		{
+			std::unique_lock lock(m_queue_mutex);
+			m_queue_cond.wait(lock, [this] { return !m_queue.empty() || m_stop; });
+			if (m_stop)
+				return;
+			fd = m_queue.front();
+			m_queue.pop_front();
+		}
+		VirtualMachine* vm = m_acceptor.wait_idle([this] {
+			std::scoped_lock lock(m_queue_mutex);
+			return unsigned(m_queue.size() + 1);
+		});
+		if (vm == nullptr) {
+			close(fd);
+			return;
+		}
+		vm->deliver_connection(fd);
+	}
+}
+
+void Frontend::event_loop()
+{
+	struct epoll_event events[64];
+	while (true)
+	{
+		const int count = epoll_wait(m_epoll_fd, events, std::size(events), -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Frontend: epoll_wait() failed: %s\n", strerror(errno));
+			return;
+		}
+		for (int i = 0; i < count; i++)
+		{
+			const int fd = events[i].data.fd;
+			if (fd == m_stop_fd)
+				return;
+			if (fd == m_listener_fd) {
+				this->accept_clients();
+				continue;
+			}
+			auto it = m_fds.find(fd);
+			if (it == m_fds.end())
+				continue;
+			// Keep the connection alive while handling the event
+			std::shared_ptr<Connection> conn = it->second;
+			if (fd == conn->client_fd) {
+				this->on_client(*conn, events[i].events);
+			} else if (fd == conn->backend_fd) {
+				this->on_backend(*conn, events[i].events);
+			}
+			if (!conn->closed) {
+				this->update_events(*conn);
+			}
+		}
+	}
+}
+
+void Frontend::accept_clients()
+{
+	while (true)
+	{
+		const int fd = accept4(m_listener_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+				fprintf(stderr, "Frontend: accept4() failed: %s\n", strerror(errno));
+			}
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			return;
+		}
+		const int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+		auto conn = std::make_shared<Connection>();
+		conn->client_fd = fd;
+		conn->client_events = EPOLLIN | EPOLLRDHUP;
+		struct epoll_event event {};
+		event.events = conn->client_events;
+		event.data.fd = fd;
+		if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			close(fd);
+			continue;
+		}
+		m_fds.emplace(fd, std::move(conn));
+	}
+}
+
+void Frontend::on_client(Connection& conn, uint32_t events)
+{
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		this->close_connection(conn);
+		return;
+	}
+	if (events & (EPOLLIN | EPOLLRDHUP))
+	{
+		char buffer[16384];
+		while (!conn.client_closed && conn.in.size() < conn.in_limit())
+		{
+			const ssize_t len = read(conn.client_fd, buffer, sizeof(buffer));
+			if (len > 0) {
+				conn.in.append(buffer, len);
+			} else if (len == 0) {
+				conn.client_closed = true;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if (errno != EINTR) {
+				this->close_connection(conn);
+				return;
+			}
+		}
+	}
+	if (events & EPOLLOUT) {
+		this->flush_client(conn);
+		if (conn.closed)
+			return;
+	}
+	this->try_dispatch(conn);
+	if (!conn.closed && conn.client_closed && conn.backend_fd < 0 && conn.out.empty()) {
+		this->close_connection(conn);
+	}
+}
+
+void Frontend::try_dispatch(Connection& conn)
+{
+	if (conn.closed || conn.close_after || conn.backend_fd >= 0)
+		return;
+	const size_t end = conn.in.find("\r\n\r\n");
+	if (end == std::string::npos) {
+		if (conn.in.size() > settings::FRONTEND_MAX_HEADER) {
+			this->send_error(conn, "431 Request Header Fields Too Large");
+		}
+		return;
+	}
+	std::vector<HttpHeader> headers;
+	const std::string_view start_line =
+		parse_headers(std::string_view(conn.in).substr(0, end + 2), headers);
+	const std::string_view method = start_line.substr(0, start_line.find(' '));
+	const size_t version_pos = start_line.rfind(' ');
+	if (method.empty() || version_pos == std::string_view::npos) {
+		this->send_error(conn, "400 Bad Request");
+		return;
+	}
+	const std::string_view version = start_line.substr(version_pos + 1);
+	conn.http10 = (version == "HTTP/1.0");
+	bool keep_alive = !conn.http10;
+	bool expect_continue = false;
+	uint64_t content_length = 0;
+	for (const auto& header : headers)
+	{
+		if (iequals(header.name, "Connection")) {
+			if (icontains(header.value, "close"))
+				keep_alive = false;
+			else if (icontains(header.value, "keep-alive"))
+				keep_alive = true;
+		} else if (iequals(header.name, "Content-Length")) {
+			if (!parse_length(header.value, content_length)) {
+				this->send_error(conn, "400 Bad Request");
+				return;
+			}
+		} else if (iequals(header.name, "Transfer-Encoding")) {
+			// Request bodies must have a known length
+			this->send_error(conn, "411 Length Required");
+			return;
+		} else if (iequals(header.name, "Expect")) {
+			expect_continue = icontains(header.value, "100-continue");
+		}
+	}
+	if (content_length > settings::FRONTEND_MAX_BODY) {
+		this->send_error(conn, "413 Content Too Large");
+		return;
+	}
+	const size_t total = end + 4 + content_length;
+	conn.request_size = total;
+	if (conn.in.size() < total) {
+		if (expect_continue && !conn.continue_sent) {
+			conn.out += "HTTP/1.1 100 Continue\r\n\r\n";
+			conn.continue_sent = true;
+			this->flush_client(conn);
+		}
+		return;
+	}
+
+	// Forward the request with Connection: close, so that the VM
+	// closes (and resets) when the response is complete
+	std::string request;
+	request.reserve(total + 32);
+	request.append(start_line);
+	request += "\r\n";
+	for (const auto& header : headers)
+	{
+		if (is_hop_by_hop(header.name))
+			continue;
+		request.append(header.name);
+		request += ": ";
+		request.append(header.value);
+		request += "\r\n";
+	}
+	request += "Connection: close\r\n\r\n";
+	request.append(conn.in, end + 4, content_length);
+	conn.head_request = (method == "HEAD");
+	conn.keep_alive = keep_alive;
+	conn.in.erase(0, total);
+	conn.continue_sent = false;
+	conn.request_size = 0;
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		fprintf(stderr, "Frontend: socketpair() failed: %s\n", strerror(errno));
+		this->send_error(conn, "503 Service Unavailable");
+		return;
+	}
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+	conn.backend_fd = sv[0];
+	conn.backend_events = 0;
+	conn.backend_out = std::move(request);
+	conn.response.clear();
+	conn.response_header.clear();
+	conn.headers_done = false;
+	conn.until_eof = false;
+	conn.streaming = false;
+	conn.chunked_out = false;
+	conn.has_length = false;
+	m_fds.emplace(sv[0], m_fds.at(conn.client_fd));
+	this->flush_backend(conn);
+	{
+		std::scoped_lock lock(m_queue_mutex);
+		m_queue.push_back(sv[1]);
+	}
+	m_queue_cond.notify_one();
+}
+
+void Frontend::on_backend(Connection& conn, uint32_t events)
+{
+	if (events & EPOLLOUT) {
+		this->flush_backend(conn);
+	}
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+	{
+		char buffer[16384];
+		while (conn.backend_fd >= 0 && conn.out.size() < settings::FRONTEND_MAX_BUFFERED)
+		{
+			const ssize_t len = read(conn.backend_fd, buffer, sizeof(buffer));
+			if (len > 0) {
+				if (!conn.headers_done) {
+					conn.response.append(buffer, len);
+					if (!this->parse_response_header(conn))
+						return;
+				} else if (conn.streaming) {
+					this->append_chunk(conn, std::string_view(buffer, len));
+				} else if (conn.until_eof) {
+					conn.response.append(buffer, len);
+					if (conn.response.size() >= settings::FRONTEND_MAX_BUFFERED)
+						this->start_streaming(conn);
+				} else {
+					conn.out.append(buffer, len);
+					conn.body_remaining -= std::min<uint64_t>(conn.body_remaining, len);
+				}
+				if (conn.headers_done && conn.has_length && conn.body_remaining == 0) {
+					this->finish_response(conn);
+				}
+			} else if (len == 0) {
+				this->finish_response(conn);
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if (errno != EINTR) {
+				this->finish_response(conn);
+			}
+		}
+	}
+	if (!conn.closed) {
+		this->flush_client(conn);
+	}
+}
+
+bool Frontend::parse_response_header(Connection& conn)
+{
+	const size_t end = conn.response.find("\r\n\r\n");
+	if (end == std::string::npos) {
+		if (conn.response.size() > settings::FRONTEND_MAX_HEADER) {
+			this->close_backend(conn);
+			this->send_error(conn, "502 Bad Gateway");
+			return false;
+		}
+		return true;
+	}
+	std::vector<HttpHeader> headers;
+	const std::string_view start_line =
+		parse_headers(std::string_view(conn.response).substr(0, end + 2), headers);
+	// HTTP/1.1 200 OK
+	const size_t code_pos = start_line.find(' ');
+	const int status = (code_pos != std::string_view::npos) ? atoi(start_line.data() + code_pos + 1) : 0;
+	if (status >= 100 && status < 200 && status != 101) {
+		// Forward interim responses and wait for the final one
+		conn.out.append(conn.response, 0, end + 4);
+		conn.response.erase(0, end + 4);
+		return this->parse_response_header(conn);
+	}
+	bool chunked = false;
+	conn.has_length = false;
+	for (const auto& header : headers)
+	{
+		if (iequals(header.name, "Content-Length")) {
+			conn.has_length = parse_length(header.value, conn.body_remaining);
+		} else if (iequals(header.name, "Transfer-Encoding")) {
+			chunked = icontains(header.value, "chunked");
+		}
+	}
+	const bool no_body = conn.head_request || status == 101
+		|| status == 204 || status == 304;
+	if (no_body) {
+		conn.has_length = true;
+		conn.body_remaining = 0;
+	}
+	// Without a length the body has to be buffered to give the client one
+	conn.until_eof = !conn.has_length && !chunked;
+
+	std::string header;
+	header.append(start_line);
+	header += "\r\n";
+	for (const auto& h : headers)
+	{
+		if (is_hop_by_hop(h.name))
+			continue;
+		header.append(h.name);
+		header += ": ";
+		header.append(h.value);
+		header += "\r\n";
+	}
+	conn.headers_done = true;
+	if (conn.until_eof) {
+		conn.response_header = std::move(header);
+		conn.response.erase(0, end + 4);
+		if (conn.response.size() >= settings::FRONTEND_MAX_BUFFERED)
+			this->start_streaming(conn);
+		return true;
+	}
+	header += (conn.keep_alive) ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+	conn.out += header;
+	const uint64_t body = conn.response.size() - (end + 4);
+	conn.out.append(conn.response, end + 4, std::string::npos);
+	conn.body_remaining -= std::min(conn.body_remaining, body);
+	conn.response.clear();
+	if (conn.has_length && conn.body_remaining == 0) {
+		this->finish_response(conn);
+	}
+	return true;
+}
+
+void Frontend::finish_response(Connection& conn)
+{
+	if (conn.backend_fd < 0)
+		return;
+	if (!conn.headers_done) {
+		// The VM closed (or was reset) before responding
+		this->close_backend(conn);
+		this->send_error(conn, "502 Bad Gateway");
+		return;
+	}
+	if (conn.streaming) {
+		if (conn.chunked_out)
+			conn.out += "0\r\n\r\n";
+	} else if (conn.until_eof) {
+		conn.out += conn.response_header;
+		conn.out += "Content-Length: " + std::to_string(conn.response.size()) + "\r\n";
+		conn.out += (conn.keep_alive) ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+		conn.out += conn.response;
+		conn.response.clear();
+	} else if (conn.has_length && conn.body_remaining > 0) {
+		// A truncated body leaves the client connection unusable
+		conn.keep_alive = false;
+	}
+	this->close_backend(conn);
+	if (!conn.keep_alive || conn.client_closed) {
+		conn.close_after = true;
+	}
+	this->flush_client(conn);
+	// Pipelined requests
+	this->try_dispatch(conn);
+}
+
+void Frontend::start_streaming(Connection& conn)
+{
+	// Stop buffering: HTTP/1.1 clients get the rest in chunks, while
+	// HTTP/1.0 clients read it until the connection closes. Reading
+	// from the VM pauses with the client, as for other responses.
+	conn.streaming = true;
+	conn.chunked_out = !conn.http10;
+	conn.out += conn.response_header;
+	if (conn.chunked_out) {
+		conn.out += "Transfer-Encoding: chunked\r\n";
+		conn.out += (conn.keep_alive) ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+	} else {
+		conn.keep_alive = false;
+		conn.out += "Connection: close\r\n\r\n";
+	}
+	this->append_chunk(conn, conn.response);
+	conn.response.clear();
+	conn.response.shrink_to_fit();
+}
+
+void Frontend::append_chunk(Connection& conn, std::string_view data)
+{
+	if (!conn.chunked_out) {
+		conn.out.append(data);
+		return;
+	}
+	if (data.empty())
+		return;
+	char size[24];
+	const int len = snprintf(size, sizeof(size), "%zx\r\n", data.size());
+	conn.out.append(size, len);
+	conn.out.append(data);
+	conn.out += "\r\n";
+}
+
+void Frontend::send_error(Connection& conn, const char* status)
+{
+	conn.out += "HTTP/1.1 ";
+	conn.out += status;
+	conn.out += "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	conn.in.clear();
+	conn.close_after = true;
+	this->flush_client(conn);
+}
+
+void Frontend::flush_client(Connection& conn)
+{
+	while (!conn.out.empty())
+	{
+		const ssize_t len = send(conn.client_fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+		if (len > 0) {
+			conn.out.erase(0, len);
+		} else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		} else if (len < 0 && errno == EINTR) {
+			continue;
+		} else {
+			this->close_connection(conn);
+			return;
+		}
+	}
+	if (conn.close_after && conn.backend_fd < 0) {
+		this->close_connection(conn);
+	}
+}
+
+void Frontend::flush_backend(Connection& conn)
+{
+	while (!conn.backend_out.empty())
+	{
+		const ssize_t len = send(conn.backend_fd, conn.backend_out.data(), conn.backend_out.size(), MSG_NOSIGNAL);
+		if (len > 0) {
+			conn.backend_out.erase(0, len);
+		} else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		} else if (len < 0 && errno == EINTR) {
+			continue;
+		} else {
+			// The VM stopped reading, its response tells the rest
+			conn.backend_out.clear();
+		}
+	}
+}
+
+void Frontend::update_events(Connection& conn)
+{
+	uint32_t client = 0;
+	if (!conn.client_closed && conn.in.size() < conn.in_limit())
+		client |= EPOLLIN | EPOLLRDHUP;
+	if (!conn.out.empty())
+		client |= EPOLLOUT;
+	if (client != conn.client_events) {
+		struct epoll_event event {};
+		event.events = client;
+		event.data.fd = conn.client_fd;
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, conn.client_fd, &event);
+		conn.client_events = client;
+	}
+	if (conn.backend_fd < 0)
+		return;
+	// A slow client pauses the VM's response. The backend is removed
+	// from the epoll set, as a hang-up cannot be masked.
+	uint32_t backend = 0;
+	if (conn.out.size() < settings::FRONTEND_MAX_BUFFERED)
+		backend |= EPOLLIN | EPOLLRDHUP;
+	if (!conn.backend_out.empty())
+		backend |= EPOLLOUT;
+	if (backend != conn.backend_events) {
+		struct epoll_event event {};
+		event.events = backend;
+		event.data.fd = conn.backend_fd;
+		const int op = (backend == 0) ? EPOLL_CTL_DEL :
+			(conn.backend_events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+		epoll_ctl(m_epoll_fd, op, conn.backend_fd, &event);
+		conn.backend_events = backend;
+	}
+}
+
+void Frontend::close_backend(Connection& conn)
+{
+	if (conn.backend_fd < 0)
+		return;
+	if (conn.backend_events != 0) {
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, conn.backend_fd, nullptr);
+	}
+	m_fds.erase(conn.backend_fd);
+	close(conn.backend_fd);
+	conn.backend_fd = -1;
+	conn.backend_events = 0;
+	conn.backend_out.clear();
+}
+
+void Frontend::close_connection(Connection& conn)
+{
+	if (conn.closed)
+		return;
+	this->close_backend(conn);
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, conn.client_fd, nullptr);
+	m_fds.erase(conn.client_fd);
+	close(conn.client_fd);
+	conn.closed = true;
+}
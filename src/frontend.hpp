@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include "config.hpp"
+struct Acceptor;
+
+// Built-in HTTP/1.1 reverse proxy (--frontend). Clients keep their
+// connections alive, while every request is forwarded with
+// "Connection: close" to an idle ephemeral VM over a fresh socketpair.
+// The VM receives its end of the socketpair as if it had been accepted
+// on the program's own listener (see Acceptor and inject_connection).
+struct Frontend
+{
+	void start();
+
+	Frontend(const Configuration&, Acceptor&);
+	~Frontend();
+
+private:
+	struct Connection;
+	void event_loop();
+	void dispatch_thread();
+	void accept_clients();
+	void on_client(Connection&, uint32_t events);
+	void on_backend(Connection&, uint32_t events);
+	void try_dispatch(Connection&);
+	bool parse_response_header(Connection&);
+	void finish_response(Connection&);
+	void start_streaming(Connection&);
+	void append_chunk(Connection&, std::string_view);
+	void send_error(Connection&, const char* status);
+	void flush_client(Connection&);
+	void flush_backend(Connection&);
+	void update_events(Connection&);
+	void close_backend(Connection&);
+	void close_connection(Connection&);
+
+	const Configuration& m_config;
+	Acceptor& m_acceptor;
+	int m_listener_fd = -1;
+	int m_epoll_fd = -1;
+	int m_stop_fd = -1; // eventfd in the epoll set, readable once stopped
+	std::atomic<bool> m_stop = false;
+	// Client and backend fds both map to their connection
+	std::unordered_map<int, std::shared_ptr<Connection>> m_fds;
+
+	// VM ends of socketpairs waiting for an idle VM
+	std::deque<int> m_queue;
+	std::mutex m_queue_mutex;
+	std::condition_variable m_queue_cond;
+	std::thread m_event_thread;
+	std::thread m_dispatch_thread;
+};
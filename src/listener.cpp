@@ -0,0 +1,171 @@
+#include "listener.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+static void throw_errno(const char* what)
+{
+	throw std::runtime_error(std::string(what) + " failed: " + strerror(errno));
+}
+
+ListenerInfo ListenerInfo::capture(int fd)
+{
+	ListenerInfo info {};
+	socklen_t len = sizeof(info.domain);
+	if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &info.domain, &len) < 0) {
+		throw_errno("getsockopt(SO_DOMAIN)");
+	}
+	len = sizeof(info.type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &info.type, &len) < 0) {
+		throw_errno("getsockopt(SO_TYPE)");
+	}
+	len = sizeof(info.protocol);
+	if (getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &info.protocol, &len) < 0) {
+		throw_errno("getsockopt(SO_PROTOCOL)");
+	}
+	len = sizeof(info.reuseaddr);
+	if (getsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &info.reuseaddr, &len) < 0) {
+		throw_errno("getsockopt(SO_REUSEADDR)");
+	}
+	info.flags = fcntl(fd, F_GETFL, 0);
+	if (info.flags < 0) {
+		throw_errno("fcntl(F_GETFL)");
+	}
+	info.addr_len = sizeof(info.addr);
+	if (getsockname(fd, (struct sockaddr*)&info.addr, &info.addr_len) < 0) {
+		throw_errno("getsockname()");
+	}
+	// For listening TCP sockets tcpi_sacked is the backlog
+	info.backlog = 128;
+	struct tcp_info tcp {};
+	len = sizeof(tcp);
+	if ((info.domain == AF_INET || info.domain == AF_INET6) &&
+		getsockopt(fd, IPPROTO_TCP, TCP_INFO, &tcp, &len) == 0 && tcp.tcpi_sacked > 0) {
+		info.backlog = tcp.tcpi_sacked;
+	}
+	return info;
+}
+
+int ListenerInfo::create(bool reuseport) const
+{
+	const int fd = socket(this->domain, this->type, this->protocol);
+	if (fd < 0) {
+		throw_errno("socket()");
+	}
+	try {
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &this->reuseaddr, sizeof(this->reuseaddr)) < 0) {
+			throw_errno("setsockopt(SO_REUSEADDR)");
+		}
+		const int one = 1;
+		if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+			throw_errno("setsockopt(SO_REUSEPORT)");
+		}
+		if (fcntl(fd, F_SETFL, this->flags) < 0) {
+			throw_errno("fcntl(F_SETFL)");
+		}
+		if (bind(fd, (const struct sockaddr*)&this->addr, this->addr_len) < 0) {
+			throw_errno("bind()");
+		}
+		if (listen(fd, this->backlog) < 0) {
+			throw_errno("listen()");
+		}
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	return fd;
+}
+
+ReuseportGroup::ReuseportGroup(int master_fd, unsigned count)
+	: m_master_fd(master_fd)
+{
+	const ListenerInfo info = ListenerInfo::capture(master_fd);
+	if (info.domain != AF_INET && info.domain != AF_INET6) {
+		throw std::runtime_error("--reuseport requires a TCP listener");
+	}
+	// The master listener joins the group first, at index 0, and the
+	// steering program never selects it. Until the program is attached
+	// connections are hashed over the group, so the master may still
+	// hold some, and request VMs drain them without blocking each other.
+	const int one = 1;
+	if (setsockopt(master_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		throw_errno("setsockopt(SO_REUSEPORT)");
+	}
+	if (fcntl(master_fd, F_SETFL, info.flags | O_NONBLOCK) < 0) {
+		throw_errno("fcntl(F_SETFL)");
+	}
+	m_listeners.reserve(count);
+	for (unsigned i = 0; i < count; i++) {
+		m_listeners.push_back(info.create(true));
+	}
+	attach_steering(m_listeners.back());
+
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		throw_errno("sched_getaffinity()");
+	}
+	for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed))
+			m_cpus.push_back(cpu);
+	}
+	if (count > m_cpus.size()) {
+		fprintf(stderr, "Warning: --reuseport with more request VMs (%u) than CPUs (%zu)\n",
+			count, m_cpus.size());
+	}
+}
+ReuseportGroup::~ReuseportGroup()
+{
+	for (const int fd : m_listeners) {
+		close(fd);
+	}
+}
+
+void ReuseportGroup::attach_steering(int fd) const
+{
+	// Socket index = 1 + (cpu % count), in the order the sockets
+	// joined the group
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)m_listeners.size()),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 1),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		throw_errno("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+	}
+}
+
+void ReuseportGroup::pin_thread(unsigned reqid) const
+{
+	// The request VM receives the connections of every CPU where
+	// cpu % count == reqid
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	bool any = false;
+	for (const unsigned cpu : m_cpus) {
+		if (cpu % m_listeners.size() == reqid) {
+			CPU_SET(cpu, &set);
+			any = true;
+		}
+	}
+	if (!any)
+		return;
+	const int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (res != 0) {
+		fprintf(stderr, "Warning: Failed to pin request VM %u: %s\n", reqid, strerror(res));
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <sys/socket.h>
+#include <vector>
+
+// Everything needed to recreate a listening socket on the host.
+// The layout is part of the snapshot state (see vm_state.cpp).
+struct ListenerInfo {
+	int backlog;
+	int domain;
+	int type;
+	int protocol;
+	int flags;
+	int reuseaddr;
+	socklen_t addr_len;
+	struct sockaddr_storage addr;
+
+	static ListenerInfo capture(int fd);
+	// Create, bind and listen, optionally joining a SO_REUSEPORT group
+	int create(bool reuseport = false) const;
+};
+
+// One SO_REUSEPORT listener per request VM, cloned from the listener
+// of the master VM. A CBPF program steers each connection to the VM
+// pinned to the CPU that received it, so request VMs do not share an
+// accept queue and connection data stays in that core's cache.
+struct ReuseportGroup
+{
+	int listener(unsigned reqid) const { return m_listeners.at(reqid); }
+	// The master's listener, which keeps the connections it received
+	// before steering began. Every request VM accepts from it too.
+	int drain_listener() const noexcept { return m_master_fd; }
+	// Pin the calling thread to the CPUs steered to the request VM
+	void pin_thread(unsigned reqid) const;
+
+	ReuseportGroup(int master_fd, unsigned count);
+	~ReuseportGroup();
+
+private:
+	void attach_steering(int fd) const;
+
+	int m_master_fd;
+	std::vector<int> m_listeners;
+	std::vector<unsigned> m_cpus;
+};
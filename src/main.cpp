@@ -1,16 +1,39 @@
 #include <atomic>
 #include <cstdio>
+#include <cstring>
+#include "dirty_report.hpp"
+#include "frontend.hpp"
+#include "listener.hpp"
+#include "metrics.hpp"
 #include "mmap_file.hpp"
+#include "numa.hpp"
+#include "pool.hpp"
+#include "profiler.hpp"
+#include "snapshot_pages.hpp"
+#include "standby.hpp"
 #include <thread>
+#include "trace.hpp"
 #include "vm.hpp"
-static std::array<std::atomic<uint64_t>, 64> reset_counters;
+static std::unique_ptr<std::atomic<uint64_t>[]> reset_counters;
 
 int main(int argc, char* argv[], char* envp[])
 {
+	const auto startup_begin = std::chrono::steady_clock::now();
 	try {
 		Configuration config = Configuration::FromArgs(argc, argv);
 		VirtualMachine::init_kvm();
 
+		// Start prefetching the hot pages of an existing snapshot before
+		// it is mapped, so that the reads overlap with booting
+		std::unique_ptr<SnapshotHotPages> hot_pages;
+		std::error_code snapshot_error;
+		if (!config.snapshot_hot_pages_filename.empty()
+			&& std::filesystem::file_size(config.snapshot_filename, snapshot_error) > 0
+			&& !snapshot_error) {
+			hot_pages = std::make_unique<SnapshotHotPages>(
+				config.snapshot_filename, config.snapshot_hot_pages_filename);
+		}
+
 		// Read the binary file
 		MmapFile binary_file(config.main_filename);
 
@@ -34,16 +57,31 @@ int main(int argc, char* argv[], char* envp[])
 			storage_binary_file->dontneed(); // Lazily drop pages from the file
 		}
 
-		// Create a VirtualMachine instance
-		VirtualMachine vm(binary_file.view(), config);
-		if (storage_vm != nullptr) {
-			// Link the main storage VM to the main VM
-			if (config.storage_ipre_permanent) {
-				vm.machine().permanent_remote_connect(storage_vm->machine());
+		// With --numa the master is the replica for the first node
+		std::unique_ptr<NumaTopology> numa;
+		if (config.numa) {
+			numa = std::make_unique<NumaTopology>();
+			if (numa->is_numa()) {
+				numa->prefer_memory(0);
 			} else {
-				vm.machine().remote_connect(storage_vm->machine());
+				fprintf(stderr, "Warning: --numa found a single NUMA node\n");
+				numa = nullptr;
 			}
 		}
+
+		// Link the main storage VM to the main VM and its replicas
+		auto link_storage = [&config, &storage_vm] (VirtualMachine& main_vm) {
+			if (storage_vm == nullptr)
+				return;
+			if (config.storage_ipre_permanent) {
+				main_vm.machine().permanent_remote_connect(storage_vm->machine());
+			} else {
+				main_vm.machine().remote_connect(storage_vm->machine());
+			}
+		};
+		// Create a VirtualMachine instance
+		VirtualMachine vm(binary_file.view(), config);
+		link_storage(vm);
 		// Initialize the VM by running through main()
 		// and then do a warmup, if required
 		const bool just_one_vm = (config.concurrency == 1 && !config.ephemeral);
@@ -55,7 +93,9 @@ int main(int argc, char* argv[], char* envp[])
 			fprintf(stderr, "The program did not wait for requests\n");
 			return 1;
 		}
-		binary_file.dontneed(); // Lazily drop pages from the file
+		if (numa != nullptr) {
+			NumaTopology::default_memory();
+		}
 
 		if (config.storage_1_to_1 && !just_one_vm) {
 			// Prepare storage VM for forking
@@ -65,24 +105,52 @@ int main(int argc, char* argv[], char* envp[])
 			}
 			storage_vm->machine().prepare_copy_on_write();
 			// Create one storage VM per request VM
-			storage_forks.resize(config.concurrency);
+			storage_forks.resize(std::max(config.concurrency, config.max_concurrency));
+		}
+
+		// Forks are made from the master replica on their own NUMA node
+		std::vector<std::unique_ptr<VirtualMachine>> replicas;
+		std::vector<VirtualMachine*> masters { &vm };
+		if (numa != nullptr && !just_one_vm) {
+			struct sockaddr_storage addr {};
+			socklen_t addrlen = sizeof(addr);
+			getsockname(vm.listener_fd(), reinterpret_cast<struct sockaddr *>(&addr), &addrlen);
+			if (!config.snapshot_filename.empty()) {
+				fprintf(stderr, "Warning: --numa does not replicate snapshot-loaded masters\n");
+			} else if (addr.ss_family != AF_INET && addr.ss_family != AF_INET6) {
+				fprintf(stderr, "Warning: --numa only replicates masters listening on TCP\n");
+			} else {
+				replicas = numa->boot_replicas(vm, binary_file.view(), link_storage);
+				for (size_t n = 1; n < replicas.size(); n++) {
+					masters.push_back(replicas[n].get());
+				}
+			}
 		}
+		binary_file.dontneed(); // Lazily drop pages from the file
 
 		// Get warmup time (if any)
 		const std::string warmup_time = (init.warmup_time.count() > 0) ?
 			(" warmup=" + std::to_string(init.warmup_time.count()) + "ms") : "";
+		const std::string numa_nodes = (numa != nullptr) ?
+			(" numa=" + std::to_string(numa->size()) + "/" + std::to_string(masters.size())) : "";
 		// Get /proc/self RSS
-		std::string process_rss;
-		FILE* fp = fopen("/proc/self/statm", "r");
-		if (fp) {
-			uint64_t size = 0;
-			uint64_t rss = 0;
-			fscanf(fp, "%lu %lu", &size, &rss);
-			fclose(fp);
-			rss = (rss * getpagesize()) >> 20; // Convert to MB
-			process_rss = " rss=" + std::to_string(rss) + "MB";
+		std::string rss_mb;
+		if (const uint64_t rss = process_rss(); rss > 0) {
+			rss_mb = " rss=" + std::to_string(rss >> 20) + "MB";
 		}
 
+		// A snapshot that was created by this run has no hot pages to record
+		std::string hot_pages_info;
+		if (hot_pages != nullptr && !vm.machine().has_snapshot_state()) {
+			hot_pages = nullptr;
+		} else if (hot_pages != nullptr && hot_pages->mode() == SnapshotHotPages::Mode::Prefetch) {
+			hot_pages_info = " hot=" + std::to_string(hot_pages->pages());
+		} else if (hot_pages != nullptr) {
+			hot_pages_info = " hot=recording";
+		}
+		const auto startup_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - startup_begin);
+
 		// Print informational message
 		std::string method = "epoll";
 		if (vm.poll_method() == VirtualMachine::PollMethod::Poll) {
@@ -92,7 +160,7 @@ int main(int argc, char* argv[], char* envp[])
 		} else if (vm.poll_method() == VirtualMachine::PollMethod::Undefined) {
 			method = "undefined";
 		}
-		printf("Program '%s' loaded. %s vm=%u%s huge=%u/%u init=%lums%s%s\n",
+		printf("Program '%s' loaded. %s vm=%u%s huge=%u/%u init=%lums startup=%lums%s%s%s%s\n",
 			config.main_filename.c_str(),
 			method.c_str(),
 			config.concurrency,
@@ -100,8 +168,22 @@ int main(int argc, char* argv[], char* envp[])
 			config.hugepage_arena_size > 0,
 			config.hugepage_requests_arena > 0,
 			init.initialization_time.count(),
+			startup_time.count(),
 			warmup_time.c_str(),
-			process_rss.c_str());
+			hot_pages_info.c_str(),
+			numa_nodes.c_str(),
+			rss_mb.c_str());
+		if (!config.snapshot_filename.empty() && vm.machine().has_snapshot_state()) {
+			// Unwritten snapshot pages come from the page cache, shared
+			// with every other process mapping the same snapshot file
+			const MappedFileMemory snapshot = mapped_file_memory(config.snapshot_filename);
+			printf("Snapshot '%s' rss=%luMB shared=%luMB pss=%luMB\n",
+				config.snapshot_filename.c_str(), snapshot.rss >> 20,
+				snapshot.shared >> 20, snapshot.pss >> 20);
+			if (just_one_vm) {
+				fprintf(stderr, "Warning: Without forks, requests write to the snapshot memory of the main VM\n");
+			}
+		}
 
 		// Non-ephemeral single-threaded - we already have a VM
 		if (just_one_vm)
@@ -137,50 +219,144 @@ int main(int argc, char* argv[], char* envp[])
 			}
 		}
 
-		// Start VM forks
-		std::vector<std::thread> threads;
-		threads.reserve(config.concurrency);
+		// Enforce the max request time for ephemeral request VMs
+		std::unique_ptr<RequestTimer> request_timer;
+		if (config.ephemeral && config.max_req_time > 0.0f) {
+			request_timer = std::make_unique<RequestTimer>();
+			for (auto* master : masters) {
+				master->set_request_timer(request_timer.get());
+			}
+		}
 
-		for (unsigned int i = 0; i < config.concurrency; ++i)
-		{
-			const bool is_storage_1_to_1 = (config.storage && config.storage_1_to_1);
-			threads.emplace_back([&vm, &storage_forks, &storage_vm, i, is_storage_1_to_1]()
+		// Accept connections on the host and hand them to idle request VMs
+		const unsigned max_request_vms = std::max(config.concurrency, config.max_concurrency);
+		std::unique_ptr<Acceptor> acceptor;
+		if (config.acceptor_threads > 0 || !config.frontend_address.empty()) {
+			acceptor = std::make_unique<Acceptor>(vm, config.acceptor_threads, max_request_vms);
+			if (config.admission_queue > 0) {
+				acceptor->set_admission(config.admission_queue,
+					std::chrono::microseconds(uint64_t(config.queue_slo * 1000.0f)));
+			}
+			for (auto* master : masters) {
+				master->set_acceptor(acceptor.get());
+			}
+		}
+		reset_counters = std::make_unique<std::atomic<uint64_t>[]>(max_request_vms);
+		// Give every request VM its own listener and accept queue
+		std::unique_ptr<ReuseportGroup> reuseport;
+		if (config.reuseport) {
+			reuseport = std::make_unique<ReuseportGroup>(vm.listener_fd(), max_request_vms);
+		}
+		// Terminate client keep-alive connections in front of the VMs
+		std::unique_ptr<Frontend> frontend;
+		if (!config.frontend_address.empty()) {
+			frontend = std::make_unique<Frontend>(config, *acceptor);
+		}
+
+		// Serve statistics separately from the program's listener
+		std::unique_ptr<Metrics> metrics;
+		if (!config.metrics_address.empty()) {
+			metrics = std::make_unique<Metrics>(config, max_request_vms);
+			metrics->set_acceptor(acceptor.get());
+			metrics->set_listener(vm.listener_fd());
+			VirtualMachine::install_syscall_stats();
+		}
+		std::unique_ptr<Profiler> profiler;
+		if (metrics != nullptr && config.profile_hz > 0) {
+			profiler = std::make_unique<Profiler>(vm, max_request_vms, config.profile_hz);
+			metrics->set_profiler(profiler.get());
+		}
+
+		// Attribute the pages dirtied by requests
+		std::unique_ptr<DirtyReport> dirty_report;
+		if (!config.dirty_report_filename.empty()) {
+			dirty_report = std::make_unique<DirtyReport>(vm,
+				config.dirty_report_filename, config.dirty_report_requests);
+		}
+
+		// Record request events of every request VM
+		std::unique_ptr<Tracer> tracer;
+		if (!config.trace_filename.empty()) {
+			tracer = std::make_unique<Tracer>(config.trace_filename);
+			tracer->start();
+		}
+
+		// Start VM forks
+		std::unique_ptr<RequestPool> pool;
+		const bool is_storage_1_to_1 = (config.storage && config.storage_1_to_1);
+		pool = std::make_unique<RequestPool>(config, acceptor.get(),
+			[&vm, &masters, &numa, &reuseport, &metrics, &profiler, &dirty_report, &tracer, &storage_forks, &storage_vm, &pool, is_storage_1_to_1, max_request_vms](unsigned i)
 			{
-				// Create a new VM
+				// Run on, and fork from the master replica of, one NUMA node
+				const unsigned node = (numa != nullptr) ? numa->node_index_for(i) : 0;
+				if (numa != nullptr) {
+					numa->pin_thread(node);
+					numa->prefer_memory(node);
+				}
+				if (reuseport != nullptr) {
+					reuseport->pin_thread(i);
+				}
+				VirtualMachine& master = *masters[node % masters.size()];
+				VMStats* stats = (metrics != nullptr) ? &metrics->vm(i) : nullptr;
+				// Create new VMs, with a standby fork when enabled
+				std::unique_ptr<StandbyForks> standby;
 				std::unique_ptr<VirtualMachine> forked_vm;
+				VirtualMachine* active_vm = nullptr;
 				try {
-					// Fork a new VM
-					forked_vm = std::make_unique<VirtualMachine>(vm, i, false);
-					// Link the specific storage VM to the forked VM
+					// Link the specific storage VM to the forked VMs
 					if (is_storage_1_to_1 && i < storage_forks.size()) {
 						storage_forks[i] = std::make_unique<VirtualMachine>(*storage_vm, i, true);
-						if (vm.config().storage_ipre_permanent) {
-							forked_vm->machine().permanent_remote_connect(storage_forks[i]->machine());
-						} else {
-							forked_vm->machine().remote_connect(storage_forks[i]->machine());
-						}
 					}
-					forked_vm->set_on_reset_callback([&vm, i]()
+					auto create_fork = [&]() -> std::unique_ptr<VirtualMachine>
 					{
-						if (!vm.config().verbose)
-							return;
-						// Progressively print the reset counter
-						const uint64_t reset_counter = reset_counters.at(i).fetch_add(1);
-						if (i == 0) {
-							if (reset_counter % 64 == 0) {
-								std::string counters_str;
-								for (unsigned int j = 0; j < vm.config().concurrency; ++j) {
-									counters_str += std::to_string(j) + ": " + std::to_string(reset_counters[j].load()) + " ";
-								}
-								fprintf(stderr, "\rForked VMs have been reset: %s\n", counters_str.c_str());
+						// Fork a new VM
+						auto fork = std::make_unique<VirtualMachine>(master, i, false);
+						if (reuseport != nullptr) {
+							fork->use_listener(reuseport->listener(i), reuseport->drain_listener());
+						}
+						fork->set_stats(stats);
+						fork->set_profiler(profiler.get());
+						fork->set_dirty_report(dirty_report.get());
+						if (tracer != nullptr) {
+							fork->set_trace(tracer->create_ring(i));
+						}
+						if (is_storage_1_to_1 && i < storage_forks.size()) {
+							if (vm.config().storage_ipre_permanent) {
+								fork->machine().permanent_remote_connect(storage_forks[i]->machine());
 							} else {
-								// Print a dot in between resets
-								fprintf(stderr, ".");
+								fork->machine().remote_connect(storage_forks[i]->machine());
 							}
 						}
-					});
+						fork->set_on_reset_callback([&vm, i, max_request_vms]()
+						{
+							if (!vm.config().verbose)
+								return;
+							// Progressively print the reset counter
+							const uint64_t reset_counter = reset_counters[i].fetch_add(1);
+							if (i == 0) {
+								if (reset_counter % 64 == 0) {
+									std::string counters_str;
+									for (unsigned int j = 0; j < max_request_vms; ++j) {
+										counters_str += std::to_string(j) + ": " + std::to_string(reset_counters[j].load()) + " ";
+									}
+									fprintf(stderr, "\rForked VMs have been reset: %s\n", counters_str.c_str());
+								} else {
+									// Print a dot in between resets
+									fprintf(stderr, ".");
+								}
+							}
+						});
+						return fork;
+					};
+					if (vm.config().standby_forks) {
+						standby = std::make_unique<StandbyForks>(master, create_fork(), create_fork());
+						active_vm = &standby->active();
+					} else {
+						forked_vm = create_fork();
+						active_vm = forked_vm.get();
+					}
 					if (getenv("DEBUG_FORK") != nullptr) {
-						forked_vm->open_debugger();
+						active_vm->open_debugger();
 					}
 				} catch (const tinykvm::MachineTimeoutException& me) {
 					fprintf(stderr, "*** Forked VM %u failed to initialize: timed out\n", i);
@@ -200,7 +376,7 @@ int main(int argc, char* argv[], char* envp[])
 				while (true) {
 					bool failure = false;
 					try {
-						forked_vm->resume_fork();
+						active_vm->resume_fork();
 					} catch (const tinykvm::MachineTimeoutException& me) {
 						fprintf(stderr, "*** Forked VM %u timed out\n", i);
 						fprintf(stderr, "Error: %s Data: 0x%#lX\n", me.what(), me.data());
@@ -214,26 +390,60 @@ int main(int argc, char* argv[], char* envp[])
 						failure = true;
 					}
 					if (failure) {
+						active_vm->trace(TraceEvent::Failure);
+						if (stats != nullptr) {
+							stats->failures.fetch_add(1, std::memory_order_relaxed);
+						}
 						if (getenv("DEBUG") != nullptr) {
-							forked_vm->open_debugger();
+							active_vm->open_debugger();
+						}
+					} else if (active_vm->is_retired()) {
+						// Give back the working memory until the pool grows again
+						try {
+							active_vm->release_working_memory();
+						} catch (const std::exception& e) {
+							fprintf(stderr, "*** Forked VM %u failed to release its memory: %s\n", i, e.what());
+							// Keep the fork usable with a regular reset
+							try {
+								active_vm->reset_to(master);
+							} catch (const std::exception& re) {
+								fprintf(stderr, "*** Forked VM %u failed to reset: %s\n", i, re.what());
+							}
 						}
+						pool->park(i);
+						continue;
 					}
-					if (vm.is_ephemeral() || failure) {
-						printf("Forked VM %u finished. Resetting...\n", i);
+					if (standby != nullptr) {
+						// The used fork is reset in the background
+						active_vm = &standby->swap();
+					} else if (vm.is_ephemeral() || failure) {
+						if (vm.config().verbose) {
+							printf("Forked VM %u finished. Resetting...\n", i);
+						}
 						try {
-							forked_vm->reset_to(vm);
+							active_vm->reset_to(master);
 						} catch (const std::exception& e) {
 							fprintf(stderr, "*** Forked VM %u failed to reset: %s\n", i, e.what());
 						}
 					}
 				}
 			});
+		pool->start();
+		if (metrics != nullptr) {
+			metrics->set_pool(pool.get());
+			metrics->start();
+		}
+		if (acceptor != nullptr) {
+			acceptor->start();
+		}
+		if (frontend != nullptr) {
+			frontend->start();
 		}
 
 		// Wait for all threads to finish
-		for (auto& thread : threads) {
-			thread.join();
-		}
+		pool->join();
+		// The metrics thread reads the pool and profiler
+		metrics.reset();
 
 	} catch (const tinykvm::MachineTimeoutException& me) {
 		fprintf(stderr, "Machine timed out\n");
@@ -0,0 +1,439 @@
+#include "metrics.hpp"
+
+#include "acceptor.hpp"
+#include "pool.hpp"
+#include "profiler.hpp"
+#include "settings.hpp"
+#include <bit>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <map>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+void Histogram::record(uint64_t value) noexcept
+{
+	// Bucket N holds values up to first_bound << N
+	size_t bucket = (value == 0) ? 0 : std::bit_width((value - 1) / m_first_bound);
+	if (bucket > BUCKETS)
+		bucket = BUCKETS;
+	m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+void Histogram::add(const Histogram& other) noexcept
+{
+	for (size_t i = 0; i <= BUCKETS; i++)
+		m_counts[i].fetch_add(other.m_counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	m_sum.fetch_add(other.m_sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void Histogram::render(std::string& out, const char* name, const std::string& labels, double scale) const
+{
+	char line[256];
+	uint64_t cumulative = 0;
+	for (size_t i = 0; i <= BUCKETS; i++)
+	{
+		cumulative += m_counts[i].load(std::memory_order_relaxed);
+		if (i < BUCKETS) {
+			snprintf(line, sizeof(line), "%s_bucket{%s,le=\"%g\"} %lu\n",
+				name, labels.c_str(), double(m_first_bound << i) * scale, cumulative);
+		} else {
+			snprintf(line, sizeof(line), "%s_bucket{%s,le=\"+Inf\"} %lu\n",
+				name, labels.c_str(), cumulative);
+		}
+		out += line;
+	}
+	snprintf(line, sizeof(line), "%s_sum{%s} %.15g\n%s_count{%s} %lu\n",
+		name, labels.c_str(), double(m_sum.load(std::memory_order_relaxed)) * scale,
+		name, labels.c_str(), cumulative);
+	out += line;
+}
+
+unsigned SyscallStats::slot_for(uint32_t number) noexcept
+{
+	const unsigned used = m_used.load(std::memory_order_relaxed);
+	if (number < MAX_SYSCALL) {
+		if (m_index[number] != 0)
+			return m_index[number] - 1;
+	} else {
+		// kvmserver's own system calls, eg. 0x10003 request done
+		for (unsigned i = 0; i < used; i++) {
+			if (m_slots[i].number == number)
+				return i;
+		}
+	}
+	// Keep the last slot for everything that did not fit
+	if (used == SLOTS - 1) {
+		m_slots[used].number = OTHER;
+		m_used.store(SLOTS, std::memory_order_release);
+	}
+	if (used >= SLOTS - 1)
+		return SLOTS - 1;
+	m_slots[used].number = number;
+	if (number < MAX_SYSCALL)
+		m_index[number] = used + 1;
+	m_used.store(used + 1, std::memory_order_release);
+	return used;
+}
+
+void SyscallStats::record(uint32_t number, std::chrono::nanoseconds time) noexcept
+{
+	m_slots[this->slot_for(number)].time.record(time.count());
+}
+
+uint64_t process_rss()
+{
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp == nullptr)
+		return 0;
+	uint64_t size = 0;
+	uint64_t rss = 0;
+	if (fscanf(fp, "%lu %lu", &size, &rss) != 2)
+		rss = 0;
+	fclose(fp);
+	return rss * getpagesize();
+}
+
+MappedFileMemory mapped_file_memory(const std::string& filename)
+{
+	MappedFileMemory memory;
+	char path[PATH_MAX];
+	if (realpath(filename.c_str(), path) == nullptr)
+		return memory;
+	FILE* fp = fopen("/proc/self/smaps", "r");
+	if (fp == nullptr)
+		return memory;
+	const size_t path_len = strlen(path);
+	bool in_file = false;
+	char line[PATH_MAX + 128];
+	while (fgets(line, sizeof(line), fp) != nullptr) {
+		uint64_t begin, end;
+		if (sscanf(line, "%lx-%lx ", &begin, &end) == 2) {
+			// A mapping: address range, permissions, offset, device, inode and path
+			size_t len = strlen(line);
+			while (len > 0 && line[len - 1] == '\n')
+				len--;
+			in_file = len > path_len && line[len - path_len - 1] == ' '
+				&& memcmp(line + len - path_len, path, path_len) == 0;
+			continue;
+		}
+		if (!in_file)
+			continue;
+		uint64_t kb = 0;
+		if (sscanf(line, "Rss: %lu kB", &kb) == 1)
+			memory.rss += kb << 10;
+		else if (sscanf(line, "Pss: %lu kB", &kb) == 1)
+			memory.pss += kb << 10;
+		else if (sscanf(line, "Shared_Clean: %lu kB", &kb) == 1 || sscanf(line, "Shared_Dirty: %lu kB", &kb) == 1)
+			memory.shared += kb << 10;
+		else if (sscanf(line, "Private_Dirty: %lu kB", &kb) == 1)
+			memory.private_dirty += kb << 10;
+	}
+	fclose(fp);
+	return memory;
+}
+
+static uint64_t process_open_fds()
+{
+	DIR* dir = opendir("/proc/self/fd");
+	if (dir == nullptr)
+		return 0;
+	uint64_t count = 0;
+	while (const struct dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] != '.')
+			count++;
+	}
+	closedir(dir);
+	// Not counting the fd of the directory stream
+	return (count > 0) ? count - 1 : 0;
+}
+
+Metrics::Metrics(const Configuration& config, unsigned max_vms)
+	: m_config(config),
+	  m_max_vms(max_vms),
+	  m_vms(std::make_unique<VMStats[]>(max_vms))
+{
+	const std::string& address = config.metrics_address;
+	int fd = -1;
+	if (address.find('/') != std::string::npos)
+	{
+		// A unix socket path
+		struct sockaddr_un addr {};
+		addr.sun_family = AF_UNIX;
+		if (address.size() >= sizeof(addr.sun_path)) {
+			throw std::runtime_error("Metrics: socket path too long: " + address);
+		}
+		memcpy(addr.sun_path, address.c_str(), address.size());
+		// Replace the socket of a previous run
+		struct stat st;
+		if (stat(address.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+			unlink(address.c_str());
+		}
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		if (fd < 0
+			|| bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0
+			|| listen(fd, 16) < 0)
+		{
+			const int error = errno;
+			if (fd >= 0)
+				close(fd);
+			throw std::runtime_error("Metrics: failed to listen on '" + address + "': " + strerror(error));
+		}
+	}
+	else
+	{
+		// [host:]port, where an IPv6 host is in brackets
+		std::string host;
+		std::string port = address;
+		const size_t colon = port.rfind(':');
+		if (colon != std::string::npos) {
+			host = port.substr(0, colon);
+			port = port.substr(colon + 1);
+			if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+				host = host.substr(1, host.size() - 2);
+		}
+		struct addrinfo hints {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		struct addrinfo* result = nullptr;
+		const int res = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+		if (res != 0) {
+			throw std::runtime_error("Metrics: invalid address '" + address + "': " + gai_strerror(res));
+		}
+		fd = socket(result->ai_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		const int one = 1;
+		if (fd < 0
+			|| setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+			|| bind(fd, result->ai_addr, result->ai_addrlen) < 0
+			|| listen(fd, 16) < 0)
+		{
+			const int error = errno;
+			freeaddrinfo(result);
+			if (fd >= 0)
+				close(fd);
+			throw std::runtime_error("Metrics: failed to listen on '" + address + "': " + strerror(error));
+		}
+		freeaddrinfo(result);
+	}
+	this->m_server_fd = fd;
+	this->m_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (this->m_stop_fd < 0) {
+		const int error = errno;
+		close(fd);
+		throw std::runtime_error("Metrics: eventfd() failed: " + std::string(strerror(error)));
+	}
+}
+Metrics::~Metrics()
+{
+	if (m_thread.joinable()) {
+		const uint64_t one = 1;
+		if (write(m_stop_fd, &one, sizeof(one)) < 0) {
+			fprintf(stderr, "Metrics: eventfd write failed: %s\n", strerror(errno));
+		}
+		m_thread.join();
+	}
+	close(m_stop_fd);
+	close(m_server_fd);
+}
+
+void Metrics::start()
+{
+	this->m_thread = std::thread(&Metrics::server_thread, this);
+}
+
+void Metrics::server_thread()
+{
+	while (true)
+	{
+		struct pollfd pfds[2] {
+			{ .fd = m_server_fd, .events = POLLIN, .revents = 0 },
+			{ .fd = m_stop_fd, .events = POLLIN, .revents = 0 },
+		};
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Metrics: poll() failed: %s\n", strerror(errno));
+			return;
+		}
+		if (pfds[1].revents != 0)
+			return;
+		const int fd = accept4(this->m_server_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+				continue;
+			fprintf(stderr, "Metrics: accept4() failed: %s\n", strerror(errno));
+			return;
+		}
+		// A scraper that does not send its request is dropped
+		struct timeval timeout { .tv_sec = 1, .tv_usec = 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		std::string request;
+		char buffer[1024];
+		while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+			const ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+			if (len <= 0)
+				break;
+			request.append(buffer, len);
+		}
+		std::string response;
+		if (request.starts_with("GET /metrics ") || request.starts_with("GET / ")) {
+			const std::string body = this->render();
+			response = "HTTP/1.1 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: " + std::to_string(body.size()) + "\r\n"
+				"Connection: close\r\n\r\n" + body;
+		} else if (request.starts_with("GET /profile ") && m_profiler != nullptr) {
+			const std::string body = m_profiler->folded();
+			response = "HTTP/1.1 200 OK\r\n"
+				"Content-Type: text/plain\r\n"
+				"Content-Length: " + std::to_string(body.size()) + "\r\n"
+				"Connection: close\r\n\r\n" + body;
+		} else {
+			response = "HTTP/1.1 404 Not Found\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n\r\n";
+		}
+		size_t written = 0;
+		while (written < response.size()) {
+			const ssize_t len = send(fd, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+			if (len <= 0)
+				break;
+			written += len;
+		}
+		close(fd);
+	}
+}
+
+static void header(std::string& out, const char* name, const char* type, const char* help)
+{
+	out += "# HELP ";
+	out += name;
+	out += ' ';
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += ' ';
+	out += type;
+	out += '\n';
+}
+static void value(std::string& out, const char* name, const std::string& labels, double value)
+{
+	char line[256];
+	if (labels.empty()) {
+		snprintf(line, sizeof(line), "%s %.15g\n", name, value);
+	} else {
+		snprintf(line, sizeof(line), "%s{%s} %.15g\n", name, labels.c_str(), value);
+	}
+	out += line;
+}
+
+std::string Metrics::render() const
+{
+	std::string out;
+	out.reserve(4096 + m_max_vms * 8192);
+	std::vector<std::string> labels(m_max_vms);
+	for (unsigned i = 0; i < m_max_vms; i++)
+		labels[i] = "vm=\"" + std::to_string(i) + "\"";
+
+	auto counter = [&](const char* name, const char* help, auto field) {
+		header(out, name, "counter", help);
+		for (unsigned i = 0; i < m_max_vms; i++)
+			value(out, name, labels[i], double((m_vms[i].*field).load(std::memory_order_relaxed)));
+	};
+	counter("kvmserver_requests_total", "Requests served by the request VM", &VMStats::requests);
+	counter("kvmserver_timeouts_total", "Requests that exceeded the max request time", &VMStats::timeouts);
+	counter("kvmserver_failures_total", "Request VM errors and exceptions", &VMStats::failures);
+	counter("kvmserver_resets_total", "Resets of the request VM to the master", &VMStats::resets);
+	counter("kvmserver_reset_pages_total", "Dirty pages discarded by resets", &VMStats::reset_pages);
+
+	header(out, "kvmserver_vmresume_seconds_total", "counter", "Time spent running the guest");
+	for (unsigned i = 0; i < m_max_vms; i++)
+		value(out, "kvmserver_vmresume_seconds_total", labels[i],
+			double(m_vms[i].vmresume_ns.load(std::memory_order_relaxed)) * 1e-9);
+
+	auto histogram = [&](const char* name, const char* help, auto field, double scale) {
+		header(out, name, "histogram", help);
+		for (unsigned i = 0; i < m_max_vms; i++)
+			(m_vms[i].*field).render(out, name, labels[i], scale);
+	};
+	histogram("kvmserver_request_seconds", "Time in the guest per request", &VMStats::request_time, 1e-6);
+	histogram("kvmserver_reset_seconds", "Time per reset of the request VM", &VMStats::reset_time, 1e-6);
+	histogram("kvmserver_reset_pages", "Dirty pages discarded per reset", &VMStats::reset_page_count, 1.0);
+
+	// System calls of all request VMs, as per-VM series would be too many
+	std::map<uint32_t, Histogram> syscalls;
+	uint64_t path_lookups = 0;
+	uint64_t path_lookup_ns = 0;
+	for (unsigned i = 0; i < m_max_vms; i++) {
+		m_vms[i].syscalls.for_each([&](uint32_t number, const Histogram& time) {
+			syscalls.try_emplace(number, 256).first->second.add(time);
+		});
+		path_lookups += m_vms[i].syscalls.path_lookups.load(std::memory_order_relaxed);
+		path_lookup_ns += m_vms[i].syscalls.path_lookup_ns.load(std::memory_order_relaxed);
+	}
+	header(out, "kvmserver_syscall_seconds", "histogram", "Host time handling guest system calls, by system call number");
+	for (const auto& [number, time] : syscalls) {
+		const std::string label = (number == SyscallStats::OTHER) ?
+			"syscall=\"other\"" : "syscall=\"" + std::to_string(number) + "\"";
+		time.render(out, "kvmserver_syscall_seconds", label, 1e-9);
+	}
+	header(out, "kvmserver_path_lookups_total", "counter", "Guest paths checked against the allowed paths");
+	value(out, "kvmserver_path_lookups_total", "", double(path_lookups));
+	header(out, "kvmserver_path_lookup_seconds_total", "counter", "Time checking guest paths against the allowed paths");
+	value(out, "kvmserver_path_lookup_seconds_total", "", double(path_lookup_ns) * 1e-9);
+
+	header(out, "kvmserver_resident_memory_bytes", "gauge", "Resident set size of the server");
+	value(out, "kvmserver_resident_memory_bytes", "", double(process_rss()));
+	if (!m_config.snapshot_filename.empty()) {
+		const auto now = std::chrono::steady_clock::now();
+		if (m_snapshot_sampled == std::chrono::steady_clock::time_point{}
+			|| now - m_snapshot_sampled >= settings::SNAPSHOT_MEMORY_INTERVAL) {
+			m_snapshot_memory = mapped_file_memory(m_config.snapshot_filename);
+			m_snapshot_sampled = now;
+		}
+		const MappedFileMemory& snapshot = m_snapshot_memory;
+		header(out, "kvmserver_snapshot_resident_bytes", "gauge", "Resident pages of the snapshot file mapping");
+		value(out, "kvmserver_snapshot_resident_bytes", "", double(snapshot.rss));
+		header(out, "kvmserver_snapshot_shared_bytes", "gauge", "Resident pages of the snapshot also mapped by other processes");
+		value(out, "kvmserver_snapshot_shared_bytes", "", double(snapshot.shared));
+		header(out, "kvmserver_snapshot_proportional_bytes", "gauge", "Snapshot pages divided by the processes sharing them (PSS)");
+		value(out, "kvmserver_snapshot_proportional_bytes", "", double(snapshot.pss));
+	}
+	header(out, "kvmserver_open_fds", "gauge", "Open file descriptors of the server, including those of guests");
+	value(out, "kvmserver_open_fds", "", double(process_open_fds()));
+	if (m_pool != nullptr) {
+		header(out, "kvmserver_request_vms", "gauge", "Running request VMs");
+		value(out, "kvmserver_request_vms", "", double(m_pool->active()));
+	}
+	if (m_acceptor != nullptr) {
+		header(out, "kvmserver_idle_vms", "gauge", "Request VMs waiting for a connection");
+		value(out, "kvmserver_idle_vms", "", double(m_acceptor->idle_vms()));
+		header(out, "kvmserver_admission_queue_depth", "gauge", "Connections waiting for a request VM");
+		value(out, "kvmserver_admission_queue_depth", "", double(m_acceptor->queue_depth()));
+		header(out, "kvmserver_shed_connections_total", "counter", "Connections shed with a 503");
+		value(out, "kvmserver_shed_connections_total", "", double(m_acceptor->shed_connections()));
+	}
+	struct tcp_info tcp {};
+	socklen_t len = sizeof(tcp);
+	if (m_listener_fd >= 0 && getsockopt(m_listener_fd, IPPROTO_TCP, TCP_INFO, &tcp, &len) == 0) {
+		// For listening TCP sockets tcpi_unacked is the accept queue length
+		header(out, "kvmserver_accept_queue_depth", "gauge", "Connections in the accept queue of the listener");
+		value(out, "kvmserver_accept_queue_depth", "", double(tcp.tcpi_unacked));
+	}
+	return out;
+}
@@ -0,0 +1,151 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include "config.hpp"
+struct Acceptor;
+struct Profiler;
+struct RequestPool;
+
+// Histogram with power-of-two bucket bounds, starting at the first bound.
+// Recording is a relaxed increment, so it can be done on every request.
+struct Histogram
+{
+	static constexpr size_t BUCKETS = 20; // Plus one for +Inf
+
+	void record(uint64_t value) noexcept;
+	// Add the counts of another histogram with the same bounds
+	void add(const Histogram& other) noexcept;
+	// Append the Prometheus buckets, sum and count of this histogram.
+	// Values are multiplied by scale, eg. to convert from microseconds.
+	void render(std::string& out, const char* name, const std::string& labels, double scale) const;
+
+	explicit Histogram(uint64_t first_bound) : m_first_bound(first_bound) {}
+
+private:
+	const uint64_t m_first_bound;
+	std::array<std::atomic<uint64_t>, BUCKETS + 1> m_counts {};
+	std::atomic<uint64_t> m_sum = 0;
+};
+
+// Host-side handling time of the system calls of one request VM. A
+// slot is assigned on the first call of each system call number by the
+// VM thread, the only writer, and published to readers by m_used.
+struct SyscallStats
+{
+	static constexpr unsigned SLOTS = 64;
+	static constexpr unsigned MAX_SYSCALL = 512; // Direct lookup below this
+	static constexpr uint32_t OTHER = UINT32_MAX; // When out of slots
+
+	void record(uint32_t number, std::chrono::nanoseconds time) noexcept;
+	void record_path_lookup(std::chrono::nanoseconds time) noexcept {
+		path_lookups.fetch_add(1, std::memory_order_relaxed);
+		path_lookup_ns.fetch_add(time.count(), std::memory_order_relaxed);
+	}
+	template <typename Func>
+	void for_each(Func&& func) const
+	{
+		const unsigned used = m_used.load(std::memory_order_acquire);
+		for (unsigned i = 0; i < used; i++)
+			func(m_slots[i].number, m_slots[i].time);
+	}
+
+	// Time in lookup_allowed_path(), also part of the system call time
+	std::atomic<uint64_t> path_lookups = 0;
+	std::atomic<uint64_t> path_lookup_ns = 0;
+
+private:
+	struct Slot {
+		uint32_t number = 0;
+		Histogram time {256}; // Nanoseconds
+	};
+	unsigned slot_for(uint32_t number) noexcept;
+
+	std::array<uint8_t, MAX_SYSCALL> m_index {}; // Slot + 1, or 0
+	std::array<Slot, SLOTS> m_slots;
+	std::atomic<unsigned> m_used = 0;
+};
+
+// Statistics of one request VM. Padded to a cache line, as every
+// request VM thread updates its own counters.
+struct alignas(64) VMStats
+{
+	std::atomic<uint64_t> requests = 0;
+	std::atomic<uint64_t> timeouts = 0;
+	std::atomic<uint64_t> failures = 0;
+	std::atomic<uint64_t> resets = 0;
+	std::atomic<uint64_t> reset_pages = 0;
+	std::atomic<uint64_t> vmresume_ns = 0;
+	Histogram request_time {16};   // Microseconds in vmresume per request
+	Histogram reset_time {4};      // Microseconds per reset
+	Histogram reset_page_count {1}; // Dirty pages per reset
+	SyscallStats syscalls;
+
+	void record_resume(std::chrono::nanoseconds time) noexcept {
+		vmresume_ns.fetch_add(time.count(), std::memory_order_relaxed);
+	}
+	void record_request(std::chrono::nanoseconds time) noexcept {
+		requests.fetch_add(1, std::memory_order_relaxed);
+		request_time.record(time.count() / 1000);
+	}
+	void record_reset(std::chrono::nanoseconds time, uint64_t pages) noexcept {
+		resets.fetch_add(1, std::memory_order_relaxed);
+		reset_pages.fetch_add(pages, std::memory_order_relaxed);
+		reset_time.record(time.count() / 1000);
+		reset_page_count.record(pages);
+	}
+};
+
+// Memory of the mappings of a file in this process (/proc/self/smaps)
+struct MappedFileMemory {
+	uint64_t rss = 0;
+	uint64_t pss = 0; // Each shared page divided by the processes mapping it
+	uint64_t shared = 0; // Pages also mapped by other processes
+	uint64_t private_dirty = 0; // Dirty pages no other process maps, eg. copied on write
+};
+MappedFileMemory mapped_file_memory(const std::string& filename);
+
+// Prometheus text format statistics (--metrics), served on a unix
+// socket or a TCP port separate from the program's own listener.
+struct Metrics
+{
+	VMStats& vm(unsigned reqid) { return m_vms[reqid]; }
+	void set_acceptor(const Acceptor* acceptor) noexcept { m_acceptor = acceptor; }
+	void set_pool(const RequestPool* pool) noexcept { m_pool = pool; }
+	// Serve the folded stacks of the profiler on /profile
+	void set_profiler(Profiler* profiler) noexcept { m_profiler = profiler; }
+	// The listener of the master VM, for its accept queue depth
+	void set_listener(int fd) noexcept { m_listener_fd = fd; }
+
+	std::string render() const;
+	void start();
+
+	Metrics(const Configuration&, unsigned max_vms);
+	~Metrics();
+
+private:
+	void server_thread();
+
+	const Configuration& m_config;
+	const unsigned m_max_vms;
+	std::unique_ptr<VMStats[]> m_vms;
+	const Acceptor* m_acceptor = nullptr;
+	const RequestPool* m_pool = nullptr;
+	Profiler* m_profiler = nullptr;
+	int m_listener_fd = -1;
+	int m_server_fd = -1;
+	int m_stop_fd = -1; // Stops the metrics thread when written
+	std::thread m_thread;
+	// Reading smaps walks the page tables of every mapping, so the
+	// snapshot memory is sampled at most every SNAPSHOT_MEMORY_INTERVAL
+	mutable MappedFileMemory m_snapshot_memory;
+	mutable std::chrono::steady_clock::time_point m_snapshot_sampled {};
+};
+
+// Resident set size of this process in bytes, or 0 if unknown
+uint64_t process_rss();
+
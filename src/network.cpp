@@ -0,0 +1,122 @@
+#include "network.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <stdexcept>
+
+NetworkAllowList::key_t NetworkAllowList::key_of(const void* addr, unsigned size) noexcept
+{
+	const auto* bytes = static_cast<const uint8_t*>(addr);
+	key_t key = 0;
+	for (unsigned i = 0; i < size; i++)
+		key = (key << 8) | bytes[i];
+	return key << (128 - 8 * size);
+}
+
+void NetworkAllowList::add(int family, const void* addr, unsigned prefix_len, PortRange ports)
+{
+	if (family == AF_INET && prefix_len <= 32)
+		m_ipv4.add(key_of(addr, 4), prefix_len, ports);
+	else if (family == AF_INET6 && prefix_len <= 128)
+		m_ipv6.add(key_of(addr, 16), prefix_len, ports);
+	else
+		throw std::runtime_error("Invalid network address prefix");
+}
+
+void NetworkAllowList::add_any(PortRange ports)
+{
+	m_ipv4.add(0, 0, ports);
+	m_ipv6.add(0, 0, ports);
+}
+
+void NetworkAllowList::clear()
+{
+	m_ipv4.exact.clear();
+	m_ipv4.trie.clear();
+	m_ipv6.exact.clear();
+	m_ipv6.trie.clear();
+}
+
+void NetworkAllowList::insert(Ports& ports, PortRange range)
+{
+	ports.push_back(range);
+	std::sort(ports.begin(), ports.end(),
+		[](const PortRange& a, const PortRange& b) { return a.first < b.first; });
+	// Merge overlapping and adjacent ranges
+	size_t out = 0;
+	for (size_t i = 1; i < ports.size(); i++) {
+		if (uint32_t(ports[i].first) <= uint32_t(ports[out].last) + 1)
+			ports[out].last = std::max(ports[out].last, ports[i].last);
+		else
+			ports[++out] = ports[i];
+	}
+	ports.resize(out + 1);
+}
+
+bool NetworkAllowList::contains(const Ports& ports, uint16_t port) noexcept
+{
+	// The last range that starts at or below the port
+	auto it = std::upper_bound(ports.begin(), ports.end(), port,
+		[](uint16_t port, const PortRange& range) { return port < range.first; });
+	return it != ports.begin() && port <= (it - 1)->last;
+}
+
+void NetworkAllowList::Table::add(key_t key, unsigned prefix_len, PortRange ports)
+{
+	if (prefix_len == bits) {
+		insert(exact[key], ports);
+		return;
+	}
+	if (trie.empty())
+		trie.emplace_back();
+	uint32_t node = 0;
+	for (unsigned i = 0; i < prefix_len; i++) {
+		const unsigned bit = (key >> (127 - i)) & 1;
+		if (trie[node].child[bit] == 0) {
+			trie[node].child[bit] = trie.size();
+			trie.emplace_back();
+		}
+		node = trie[node].child[bit];
+	}
+	insert(trie[node].ports, ports);
+}
+
+bool NetworkAllowList::Table::allows(key_t key, uint16_t port) const noexcept
+{
+	if (!exact.empty()) {
+		auto it = exact.find(key);
+		if (it != exact.end() && contains(it->second, port))
+			return true;
+	}
+	// Every prefix of the address on the way down may allow the port
+	uint32_t node = 0;
+	for (unsigned i = 0; i < bits && !trie.empty(); i++) {
+		if (contains(trie[node].ports, port))
+			return true;
+		node = trie[node].child[(key >> (127 - i)) & 1];
+		if (node == 0)
+			return false;
+	}
+	return false;
+}
+
+bool NetworkAllowList::allows(const struct sockaddr_storage& addr) const
+{
+	if (addr.ss_family == AF_INET)
+	{
+		const auto* addr_ipv4 = reinterpret_cast<const struct sockaddr_in*>(&addr);
+		return m_ipv4.allows(key_of(&addr_ipv4->sin_addr, 4),
+			ntohs(addr_ipv4->sin_port));
+	}
+	if (addr.ss_family == AF_INET6 || addr.ss_family == AF_UNSPEC)
+	{
+		const auto* addr_ipv6 = reinterpret_cast<const struct sockaddr_in6*>(&addr);
+		return m_ipv6.allows(key_of(&addr_ipv6->sin6_addr, 16),
+			ntohs(addr_ipv6->sin6_port));
+	}
+	// Unknown address family
+	fprintf(stderr, "Unknown address family: %d\n", addr.ss_family);
+	return false;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+#include <unordered_map>
+#include <vector>
+
+// Network addresses that guests may connect to or listen on: exact
+// addresses, CIDR prefixes and port ranges (--allow-connect and
+// --allow-listen). Exact addresses are kept in a hash table and shorter
+// prefixes in a binary trie, so a check is one hash lookup and a walk
+// of at most 32 or 128 bits, however long the list is.
+struct NetworkAllowList
+{
+	struct PortRange {
+		uint16_t first;
+		uint16_t last;
+	};
+	static constexpr PortRange ANY_PORT { 0, UINT16_MAX };
+
+	// Allow a prefix of an IPv4 (AF_INET, 4 bytes) or IPv6 (AF_INET6,
+	// 16 bytes) address in network byte order
+	void add(int family, const void* addr, unsigned prefix_len, PortRange ports);
+	// Every address and port of both families
+	void add_any(PortRange ports);
+	void clear();
+	bool empty() const noexcept { return m_ipv4.empty() && m_ipv6.empty(); }
+
+	// AF_UNSPEC is checked as IPv6, as some runtimes (eg. bun) use it
+	// for IPv4-mapped IPv6 addresses
+	bool allows(const struct sockaddr_storage&) const;
+
+private:
+	using key_t = unsigned __int128; // Address bits from the top
+	static key_t key_of(const void* addr, unsigned size) noexcept;
+	struct KeyHash {
+		size_t operator()(key_t key) const noexcept {
+			const uint64_t mixed = uint64_t(key >> 64) * 0x9E3779B97F4A7C15ULL ^ uint64_t(key);
+			return mixed ^ (mixed >> 29);
+		}
+	};
+	// Sorted and merged
+	using Ports = std::vector<PortRange>;
+	static void insert(Ports&, PortRange);
+	static bool contains(const Ports&, uint16_t port) noexcept;
+
+	struct Table {
+		struct Node {
+			uint32_t child[2] {}; // 0 when none, as the root is nobody's child
+			Ports ports;
+		};
+		unsigned bits;
+		std::unordered_map<key_t, Ports, KeyHash> exact;
+		std::vector<Node> trie;
+
+		void add(key_t, unsigned prefix_len, PortRange);
+		bool allows(key_t, uint16_t port) const noexcept;
+		bool empty() const noexcept { return exact.empty() && trie.empty(); }
+	};
+	Table m_ipv4 { .bits = 32 };
+	Table m_ipv6 { .bits = 128 };
+};
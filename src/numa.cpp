@@ -0,0 +1,170 @@
+#include "numa.hpp"
+
+#include "vm.hpp"
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+// Parse a sysfs CPU or node list, eg. "0-15,32-47"
+static std::vector<unsigned> parse_list(const std::string& list)
+{
+	std::vector<unsigned> result;
+	size_t pos = 0;
+	while (pos < list.size())
+	{
+		size_t end = list.find(',', pos);
+		if (end == std::string::npos)
+			end = list.size();
+		const std::string range = list.substr(pos, end - pos);
+		const size_t dash = range.find('-');
+		if (!range.empty() && range[0] >= '0' && range[0] <= '9') {
+			const unsigned first = std::stoul(range);
+			const unsigned last = (dash != std::string::npos) ? std::stoul(range.substr(dash + 1)) : first;
+			for (unsigned i = first; i <= last; i++)
+				result.push_back(i);
+		}
+		pos = end + 1;
+	}
+	return result;
+}
+
+static std::string read_line(const std::string& path)
+{
+	std::ifstream file(path);
+	std::string line;
+	std::getline(file, line);
+	return line;
+}
+
+NumaTopology::NumaTopology()
+{
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		throw std::runtime_error("sched_getaffinity() failed: " + std::string(strerror(errno)));
+	}
+	const std::string online = read_line("/sys/devices/system/node/online");
+	for (const unsigned id : parse_list(online))
+	{
+		Node node { .id = id, .cpus = {} };
+		const std::string cpulist =
+			read_line("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+		for (const unsigned cpu : parse_list(cpulist)) {
+			if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+				node.cpus.push_back(cpu);
+		}
+		// Memory-only nodes and nodes outside our affinity mask
+		// cannot run request VMs
+		if (!node.cpus.empty())
+			m_nodes.push_back(std::move(node));
+	}
+	if (m_nodes.empty()) {
+		// No sysfs node information: treat the host as one node
+		Node node { .id = 0, .cpus = {} };
+		for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &allowed))
+				node.cpus.push_back(cpu);
+		}
+		m_nodes.push_back(std::move(node));
+	}
+}
+
+void NumaTopology::pin_thread(unsigned index) const
+{
+	const Node& node = m_nodes.at(index);
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (const unsigned cpu : node.cpus)
+		CPU_SET(cpu, &set);
+	const int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (res != 0) {
+		fprintf(stderr, "Warning: Failed to pin thread to NUMA node %u: %s\n",
+			node.id, strerror(res));
+	}
+}
+
+void NumaTopology::prefer_memory(unsigned index) const
+{
+	const Node& node = m_nodes.at(index);
+	constexpr unsigned BITS = 8 * sizeof(unsigned long);
+	std::vector<unsigned long> mask(node.id / BITS + 1, 0UL);
+	mask[node.id / BITS] |= 1UL << (node.id % BITS);
+	// Preferred rather than bound: under memory pressure a fork falls
+	// back to remote memory instead of failing
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(), mask.size() * BITS + 1) < 0) {
+		fprintf(stderr, "Warning: Failed to set memory policy for NUMA node %u: %s\n",
+			node.id, strerror(errno));
+	}
+}
+
+void NumaTopology::default_memory()
+{
+	syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+}
+
+std::vector<std::unique_ptr<VirtualMachine>> NumaTopology::boot_replicas(
+	const VirtualMachine& master, std::string_view binary, on_replica_t on_replica) const
+{
+	std::vector<std::unique_ptr<VirtualMachine>> replicas(m_nodes.size());
+	std::vector<std::exception_ptr> errors(m_nodes.size());
+	std::vector<std::thread> threads;
+	for (unsigned index = 1; index < m_nodes.size(); index++)
+	{
+		// Boot on the node, so that the replica memory is node-local
+		threads.emplace_back([&, index] {
+			try {
+				this->pin_thread(index);
+				this->prefer_memory(index);
+				auto replica = std::make_unique<VirtualMachine>(binary, master.config());
+				replica->set_numa_replica(true);
+				if (on_replica)
+					on_replica(*replica);
+				replica->initialize(std::bind(&VirtualMachine::warmup, replica.get()), false);
+				if (!replica->is_waiting_for_requests() || replica->poll_method() != master.poll_method()) {
+					throw std::runtime_error("NUMA replica for node " + std::to_string(m_nodes[index].id)
+						+ " did not wait for requests like the master");
+				}
+				replica->share_listener(master);
+				replicas[index] = std::move(replica);
+			} catch (...) {
+				errors[index] = std::current_exception();
+			}
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	for (auto& error : errors) {
+		if (error)
+			std::rethrow_exception(error);
+	}
+	return replicas;
+}
+
+void VirtualMachine::share_listener(const VirtualMachine& master)
+{
+	// Replace the private listener of the replica with the master's
+	// listening socket, keeping the host fd the fd table refers to
+	const int fd = this->m_tracked_client_fd;
+	if (dup2(master.m_tracked_client_fd, fd) < 0) {
+		throw std::runtime_error("dup2() failed: " + std::string(strerror(errno)));
+	}
+	// Closing the private listener removed it from every epoll set
+	for (auto& [vfd, epoll_entry] : machine().fds().get_epoll_entries())
+	{
+		auto it = epoll_entry->epoll_fds.find(this->m_tracked_client_vfd);
+		if (it == epoll_entry->epoll_fds.end())
+			continue;
+		const int epoll_fd = machine().fds().translate(vfd);
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &it->second) < 0) {
+			throw std::runtime_error("epoll_ctl() failed: " + std::string(strerror(errno)));
+		}
+	}
+	this->m_numa_replica = false;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <vector>
+struct VirtualMachine;
+
+// NUMA nodes of the host (read from sysfs) that have CPUs this
+// process is allowed to run on. With --numa every node gets its own
+// replica of the master VM, and request VMs are forked from the
+// replica on the node their thread is pinned to.
+struct NumaTopology
+{
+	struct Node {
+		unsigned id;
+		std::vector<unsigned> cpus;
+	};
+	const std::vector<Node>& nodes() const noexcept { return m_nodes; }
+	size_t size() const noexcept { return m_nodes.size(); }
+	bool is_numa() const noexcept { return m_nodes.size() > 1; }
+	// Request VM threads are spread round-robin over the nodes
+	unsigned node_index_for(unsigned reqid) const noexcept { return reqid % m_nodes.size(); }
+
+	// Pin the calling thread to the CPUs of a node
+	void pin_thread(unsigned index) const;
+	// Allocate memory the calling thread faults in from a node
+	void prefer_memory(unsigned index) const;
+	// Restore the default memory policy of the calling thread
+	static void default_memory();
+
+	// Boot one replica of the master per node, except node 0 which
+	// uses the master itself. The callback runs before initialization.
+	using on_replica_t = std::function<void(VirtualMachine&)>;
+	std::vector<std::unique_ptr<VirtualMachine>> boot_replicas(
+		const VirtualMachine& master, std::string_view binary, on_replica_t on_replica) const;
+
+	NumaTopology();
+
+private:
+	std::vector<Node> m_nodes;
+};
@@ -0,0 +1,180 @@
+#include "paths.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+
+// Append a path to a normalized absolute path without a trailing
+// separator, resolving "." and ".." like lexically_normal()
+static void append_normal_path(std::string& out, std::string_view path)
+{
+	size_t pos = 0;
+	while (pos < path.size()) {
+		size_t end = path.find('/', pos);
+		if (end == std::string_view::npos)
+			end = path.size();
+		const std::string_view segment = path.substr(pos, end - pos);
+		pos = end + 1;
+		if (segment.empty() || segment == ".")
+			continue;
+		if (segment == "..") {
+			// Never above the root
+			if (!out.empty())
+				out.resize(out.rfind('/'));
+			continue;
+		}
+		out += '/';
+		out += segment;
+	}
+}
+
+AllowedPaths::AllowedPaths(const map_t& allowed_paths)
+{
+	// Build a tree of the path segments, then lay it out breadth-first
+	struct TreeNode {
+		std::map<std::string, TreeNode> children;
+		int32_t value = -1;
+	};
+	TreeNode root;
+	for (const auto& [key, vpath] : allowed_paths)
+	{
+		TreeNode* node = &root;
+		std::string normal;
+		append_normal_path(normal, key.native());
+		size_t pos = 0;
+		while (pos < normal.size()) {
+			const size_t end = std::min(normal.find('/', pos + 1), normal.size());
+			node = &node->children[normal.substr(pos + 1, end - pos - 1)];
+			pos = end;
+		}
+		node->value = m_values.size();
+		m_values.push_back(vpath);
+	}
+
+	std::deque<std::pair<const TreeNode*, uint32_t>> queue { { &root, 0 } };
+	m_nodes.push_back(Node { .value = root.value });
+	while (!queue.empty())
+	{
+		auto [tree_node, index] = queue.front();
+		queue.pop_front();
+		m_nodes[index].first_child = m_nodes.size();
+		m_nodes[index].children = tree_node->children.size();
+		for (const auto& [segment, child] : tree_node->children) {
+			queue.emplace_back(&child, m_nodes.size());
+			m_nodes.push_back(Node {
+				.segment_offset = uint32_t(m_segments.size()),
+				.segment_size = uint32_t(segment.size()),
+				.value = child.value,
+			});
+			m_segments += segment;
+		}
+	}
+}
+
+const AllowedPaths::Node* AllowedPaths::child(const Node& node, std::string_view segment) const noexcept
+{
+	const Node* first = &m_nodes[node.first_child];
+	const Node* last = first + node.children;
+	auto name = [this](const Node& n) {
+		return std::string_view(m_segments).substr(n.segment_offset, n.segment_size);
+	};
+	const Node* it = std::lower_bound(first, last, segment,
+		[&](const Node& n, std::string_view segment) { return name(n) < segment; });
+	return (it != last && name(*it) == segment) ? it : nullptr;
+}
+
+const AllowedPaths::VirtualPath* AllowedPaths::resolve(std::string& path, const std::string& cwd, Access access) const
+{
+	auto allows = [access](const VirtualPath& vpath) {
+		return access == Any || (access == Readable ? vpath.readable : vpath.writable);
+	};
+	// Reused by every lookup on this thread, so that once it has grown
+	// to the longest path, lookups do not allocate
+	static thread_local std::string scratch;
+	scratch.clear();
+	if (path.empty() || path[0] != '/') {
+		append_normal_path(scratch, cwd);
+	}
+	append_normal_path(scratch, path);
+
+	// Walk down the trie, remembering the longest prefix that allows the access
+	const Node* node = &m_nodes[0];
+	const VirtualPath* found = (node->value >= 0 && allows(m_values[node->value])) ? &m_values[node->value] : nullptr;
+	size_t found_size = 0;
+	size_t pos = 0;
+	while (pos < scratch.size() && node->children > 0) {
+		const size_t end = std::min(scratch.find('/', pos + 1), scratch.size());
+		node = this->child(*node, std::string_view(scratch).substr(pos + 1, end - pos - 1));
+		if (node == nullptr)
+			break;
+		pos = end;
+		if (node->value >= 0 && allows(m_values[node->value])) {
+			found = &m_values[node->value];
+			found_size = pos;
+		}
+	}
+	if (found == nullptr)
+		return nullptr;
+	// The real_path plus the remainder of path
+	const std::string_view remainder = std::string_view(scratch).substr(std::min(found_size + 1, scratch.size()));
+	path = found->real_path.native();
+	if (!remainder.empty()) {
+		if (path.empty() || path.back() != '/')
+			path += '/';
+		path += remainder;
+	}
+	return found;
+}
+
+const AllowedPaths::VirtualPath* PathCache::resolve(const AllowedPaths& paths,
+	std::string& path, const std::string& cwd, AllowedPaths::Access access)
+{
+	const bool relative = path.empty() || path[0] != '/';
+	const size_t cwd_size = (relative) ? cwd.size() : 0;
+	const size_t key_size = cwd_size + path.size();
+	if (key_size > MAX_PATH) {
+		m_misses++;
+		return paths.resolve(path, cwd, access);
+	}
+	// FNV-1a over the access, the working directory and the path
+	uint64_t hash = 14695981039346656037ULL ^ access;
+	auto mix = [&hash](std::string_view data) {
+		for (const char c : data)
+			hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+	};
+	if (relative) {
+		mix(cwd);
+		hash = (hash ^ '/') * 1099511628211ULL; // "/a" + "b" is not "/" + "ab"
+	}
+	mix(path);
+	Entry& entry = m_entries[(hash ^ (hash >> 32)) & (ENTRIES - 1)];
+
+	if (entry.access == access && entry.relative == relative
+		&& entry.cwd_size == cwd_size && entry.key_size == key_size
+		&& std::memcmp(entry.key, cwd.data(), cwd_size) == 0
+		&& std::memcmp(entry.key + cwd_size, path.data(), path.size()) == 0)
+	{
+		m_hits++;
+		if (entry.vpath != nullptr)
+			path.assign(entry.result, entry.result_size);
+		return entry.vpath;
+	}
+	m_misses++;
+
+	// Keep the key, as resolving rewrites the path
+	char key[MAX_PATH];
+	std::memcpy(key, cwd.data(), cwd_size);
+	std::memcpy(key + cwd_size, path.data(), path.size());
+	const AllowedPaths::VirtualPath* vpath = paths.resolve(path, cwd, access);
+	if (vpath != nullptr && path.size() > MAX_PATH)
+		return vpath;
+	entry.vpath = vpath;
+	entry.access = access;
+	entry.relative = relative;
+	entry.cwd_size = cwd_size;
+	entry.key_size = key_size;
+	std::memcpy(entry.key, key, key_size);
+	entry.result_size = (vpath != nullptr) ? path.size() : 0;
+	std::memcpy(entry.result, path.data(), entry.result_size);
+	return vpath;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "config.hpp"
+
+// The allowed paths of a configuration compiled into a segment trie,
+// for the open, stat and symlink callbacks of VMs. It is immutable, so
+// a master VM shares it with its forks.
+struct AllowedPaths
+{
+	using VirtualPath = Configuration::VirtualPath;
+	using map_t = std::map<std::filesystem::path, VirtualPath, Configuration::ComparePathSegments>;
+	enum Access : uint8_t {
+		Readable,
+		Writable,
+		Any, // The longest prefix, whatever it allows
+	};
+
+	// Rewrite a guest path into the real path under the longest allowed
+	// prefix with the access, and return that prefix. Returns nullptr
+	// and leaves the path alone when no prefix allows the access.
+	const VirtualPath* resolve(std::string& path, const std::string& cwd, Access) const;
+
+	AllowedPaths(const map_t& allowed_paths);
+
+private:
+	struct Node {
+		uint32_t first_child = 0; // Children are adjacent in m_nodes, sorted by segment
+		uint32_t children = 0;
+		uint32_t segment_offset = 0; // The segment leading to this node, in m_segments
+		uint32_t segment_size = 0;
+		int32_t value = -1; // Index in m_values
+	};
+	const Node* child(const Node&, std::string_view segment) const noexcept;
+
+	std::vector<Node> m_nodes; // The root is first
+	std::string m_segments;
+	std::vector<VirtualPath> m_values;
+};
+
+// Recent path lookups of a VM. Decisions depend only on the path, the
+// working directory and the allowed paths, so entries stay valid across
+// resets. Only the VM's own thread uses it, so it needs no locks.
+struct PathCache
+{
+	const AllowedPaths::VirtualPath* resolve(const AllowedPaths&,
+		std::string& path, const std::string& cwd, AllowedPaths::Access);
+
+	uint64_t hits() const noexcept { return m_hits; }
+	uint64_t misses() const noexcept { return m_misses; }
+
+private:
+	static constexpr size_t ENTRIES = 64; // Direct-mapped
+	static constexpr size_t MAX_PATH = 160; // Longer keys and results are not cached
+	struct Entry {
+		const AllowedPaths::VirtualPath* vpath = nullptr; // nullptr when denied
+		uint16_t cwd_size = 0; // Relative paths are keyed by the working directory too
+		uint16_t key_size = 0;
+		uint16_t result_size = 0;
+		uint8_t access = UINT8_MAX; // UINT8_MAX when unused
+		bool relative = false;
+		char key[MAX_PATH];
+		char result[MAX_PATH];
+	};
+
+	std::array<Entry, ENTRIES> m_entries {};
+	uint64_t m_hits = 0;
+	uint64_t m_misses = 0;
+};
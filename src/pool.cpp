@@ -0,0 +1,161 @@
+#include "pool.hpp"
+
+#include "acceptor.hpp"
+#include "settings.hpp"
+#include "vm.hpp"
+#include <algorithm>
+
+RequestPool::RequestPool(const Configuration& config, Acceptor* acceptor, thread_main_t thread_main)
+	: m_config(config),
+	  m_acceptor(acceptor),
+	  m_thread_main(std::move(thread_main)),
+	  m_min(config.concurrency),
+	  m_max(std::max<unsigned>(config.concurrency, config.max_concurrency))
+{
+	if (is_elastic() && m_acceptor == nullptr) {
+		throw std::runtime_error("An elastic request VM pool requires an acceptor");
+	}
+	// Thread references must stay valid while the pool grows
+	m_threads.reserve(m_max);
+	m_wakeup.resize(m_max, false);
+}
+RequestPool::~RequestPool()
+{
+	if (m_manager.joinable()) {
+		{
+			std::scoped_lock lock(m_mutex);
+			m_stop = true;
+		}
+		m_manager_cond.notify_one();
+		m_manager.join();
+	}
+	for (auto& thread : m_threads) {
+		if (thread.joinable()) {
+			thread.detach();
+		}
+	}
+}
+
+void RequestPool::start()
+{
+	std::scoped_lock lock(m_mutex);
+	this->grow(m_min);
+	if (is_elastic()) {
+		m_acceptor->set_on_starved([this] (unsigned pending) {
+			this->request_growth(pending);
+		}, std::chrono::microseconds(uint64_t(m_config.pool_grow_wait * 1000.0f)));
+		m_last_busy = std::chrono::steady_clock::now();
+		m_manager = std::thread(&RequestPool::manager_thread, this);
+	}
+}
+
+void RequestPool::join()
+{
+	for (size_t i = 0; ; i++) {
+		std::unique_lock lock(m_mutex);
+		if (i >= m_threads.size())
+			break;
+		std::thread& thread = m_threads[i];
+		lock.unlock();
+		thread.join();
+	}
+}
+
+void RequestPool::grow(unsigned count)
+{
+	while (count > 0 && m_active < m_max)
+	{
+		if (!m_parked.empty()) {
+			// Waking a parked thread reuses its fork
+			const unsigned reqid = m_parked.back();
+			m_parked.pop_back();
+			m_wakeup.at(reqid) = true;
+			m_park_cond.notify_all();
+		} else if (!m_retiring.empty()) {
+			// A retired thread that has not parked yet: it parks and
+			// wakes up again at once, without a new thread
+			const unsigned reqid = m_retiring.back();
+			m_retiring.pop_back();
+			m_wakeup.at(reqid) = true;
+		} else if (m_threads.size() < m_max) {
+			const unsigned reqid = m_threads.size();
+			m_threads.emplace_back(m_thread_main, reqid);
+		} else {
+			// Every request id is taken, which should not happen
+			break;
+		}
+		m_active++;
+		count--;
+		if (m_config.verbose && is_elastic()) {
+			fprintf(stderr, "Request VM pool grew to %u VMs\n", m_active.load());
+		}
+	}
+}
+
+void RequestPool::shrink()
+{
+	if (m_active <= m_min)
+		return;
+	// Only a VM taken out of the idle queue can be retired safely
+	VirtualMachine* vm = m_acceptor->take_idle();
+	if (vm == nullptr)
+		return;
+	// Until the thread parks, growing must wake it instead of starting
+	// another thread (called with m_mutex held)
+	m_retiring.push_back(vm->reqid());
+	vm->retire();
+	m_active--;
+	if (m_config.verbose) {
+		fprintf(stderr, "Request VM pool shrank to %u VMs\n", m_active.load());
+	}
+}
+
+void RequestPool::park(unsigned reqid)
+{
+	std::unique_lock lock(m_mutex);
+	std::erase(m_retiring, reqid);
+	// Unless the pool grew again while the thread was retiring
+	if (m_wakeup.at(reqid) == 0) {
+		m_parked.push_back(reqid);
+	}
+	m_park_cond.wait(lock, [this, reqid] { return m_wakeup.at(reqid) != 0; });
+	m_wakeup.at(reqid) = false;
+}
+
+void RequestPool::request_growth(unsigned pending)
+{
+	{
+		std::scoped_lock lock(m_mutex);
+		m_grow_requested = std::max(m_grow_requested, pending);
+	}
+	m_manager_cond.notify_one();
+}
+
+void RequestPool::manager_thread()
+{
+	const auto cooldown = std::chrono::milliseconds(uint64_t(m_config.pool_cooldown * 1000.0f));
+	std::unique_lock lock(m_mutex);
+	while (true)
+	{
+		m_manager_cond.wait_for(lock, settings::POOL_MANAGER_INTERVAL,
+			[this] { return m_grow_requested > 0 || m_stop; });
+		if (m_stop)
+			return;
+		const auto now = std::chrono::steady_clock::now();
+		if (m_grow_requested > 0) {
+			this->grow(m_grow_requested);
+			m_grow_requested = 0;
+			m_last_busy = now;
+			continue;
+		}
+		if (m_acceptor->idle_vms() == 0) {
+			m_last_busy = now;
+			continue;
+		}
+		// Retire one fork per cool-down period while VMs stay idle
+		if (now - m_last_busy >= cooldown) {
+			this->shrink();
+			m_last_busy = now;
+		}
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "config.hpp"
+struct Acceptor;
+
+// The request VM threads. A fixed pool starts config.concurrency threads.
+// An elastic pool (--max-threads) starts more threads while connections
+// wait for an idle VM, and parks idle threads again after a cool-down.
+// Parked threads keep their fork, so growing again is only a wakeup.
+struct RequestPool
+{
+	using thread_main_t = std::function<void(unsigned reqid)>;
+
+	void start();
+	void join();
+	// Called by a request thread after its VM was retired. Returns
+	// when the pool needs the thread again.
+	void park(unsigned reqid);
+	// Called by the acceptor when connections wait for an idle VM
+	void request_growth(unsigned pending);
+
+	bool is_elastic() const noexcept { return m_max > m_min; }
+	unsigned max_size() const noexcept { return m_max; }
+	unsigned active() const noexcept { return m_active.load(std::memory_order_relaxed); }
+
+	RequestPool(const Configuration&, Acceptor*, thread_main_t);
+	~RequestPool();
+
+private:
+	void manager_thread();
+	void grow(unsigned count);
+	void shrink();
+
+	const Configuration& m_config;
+	Acceptor* m_acceptor;
+	thread_main_t m_thread_main;
+	const unsigned m_min;
+	const unsigned m_max;
+	std::atomic<unsigned> m_active = 0;
+	std::vector<std::thread> m_threads;
+	std::vector<unsigned> m_parked;
+	// Retired by shrink(), but not parked yet
+	std::vector<unsigned> m_retiring;
+	std::vector<char> m_wakeup;
+	std::mutex m_mutex;
+	std::condition_variable m_park_cond;
+	std::condition_variable m_manager_cond;
+	unsigned m_grow_requested = 0;
+	bool m_stop = false;
+	std::chrono::steady_clock::time_point m_last_busy;
+	std::thread m_manager;
+};
@@ -0,0 +1,25 @@
+#pragma once
+// USDT static tracepoints, eg. for bpftrace:
+//   bpftrace -e 'usdt:./kvmserver:kvmserver:reset_end { @[arg0] = count(); }'
+// A disabled probe is a single nop in the instruction stream, so they
+// stay compiled in. Without <sys/sdt.h> (systemtap-sdt-dev) they vanish.
+#if __has_include(<sys/sdt.h>)
+// Each probe has a semaphore, which counts the attached tracers
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define KVMSERVER_PROBE(name, ...) STAP_PROBEV(kvmserver, name, ##__VA_ARGS__)
+// Guards arguments that are expensive to compute
+#define KVMSERVER_PROBE_ENABLED(name) __builtin_expect(kvmserver_##name##_semaphore != 0, 0)
+#define KVMSERVER_PROBE_SEMAPHORE(name) extern "C" volatile unsigned short kvmserver_##name##_semaphore;
+#else
+#define KVMSERVER_PROBE(name, ...) do {} while (0)
+#define KVMSERVER_PROBE_ENABLED(name) false
+#define KVMSERVER_PROBE_SEMAPHORE(name)
+#endif
+
+// Every probe, as their semaphores are defined in vm.cpp
+#define KVMSERVER_PROBES(X) \
+	X(fork_created) X(accept) X(close) X(reset_start) X(reset_end) \
+	X(restart_poll) X(remote_resume_entry) X(remote_resume_exit) \
+	X(warmup_start) X(warmup_guest_done) X(warmup_end)
+KVMSERVER_PROBES(KVMSERVER_PROBE_SEMAPHORE)
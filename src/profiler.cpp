@@ -0,0 +1,106 @@
+#include "profiler.hpp"
+
+#include "vm.hpp"
+#include <cstring>
+#include <map>
+
+void StackProfile::record(const uint64_t* frames, unsigned depth) noexcept
+{
+	// FNV-1a over the frames, never zero
+	uint64_t key = 14695981039346656037ULL;
+	for (unsigned i = 0; i < depth; i++) {
+		key = (key ^ frames[i]) * 1099511628211ULL;
+	}
+	key |= 1;
+	for (unsigned probe = 0; probe < MAX_PROBES; probe++)
+	{
+		Slot& slot = m_slots[(key + probe) & (SLOTS - 1)];
+		const uint64_t slot_key = slot.key.load(std::memory_order_relaxed);
+		if (slot_key == 0) {
+			std::memcpy(slot.frames, frames, depth * sizeof(uint64_t));
+			slot.depth = depth;
+			slot.count.store(1, std::memory_order_relaxed);
+			slot.key.store(key, std::memory_order_release);
+			return;
+		}
+		if (slot_key == key && slot.depth == depth
+			&& std::memcmp(slot.frames, frames, depth * sizeof(uint64_t)) == 0) {
+			slot.count.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+	m_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+Profiler::Profiler(const VirtualMachine& master, unsigned max_vms, unsigned hz)
+	: m_master(master),
+	  m_max_vms(max_vms),
+	  m_interval(1.0f / hz),
+	  m_profiles(std::make_unique<StackProfile[]>(max_vms))
+{
+}
+
+void Profiler::sample(unsigned reqid, tinykvm::Machine& machine) noexcept
+{
+	if (reqid >= m_max_vms)
+		return;
+	uint64_t frames[StackProfile::MAX_FRAMES];
+	const auto& regs = machine.registers();
+	frames[0] = regs.rip;
+	unsigned depth = 1;
+	// Follow the frame pointer chain: [rbp] is the caller's rbp,
+	// and [rbp + 8] the return address
+	uint64_t rbp = regs.rbp;
+	try {
+		while (depth < StackProfile::MAX_FRAMES && rbp != 0 && (rbp & 7) == 0)
+		{
+			uint64_t frame[2];
+			machine.copy_from_guest(frame, rbp, sizeof(frame));
+			if (frame[1] == 0)
+				break;
+			frames[depth++] = frame[1];
+			// The stack grows down, so callers have higher frame pointers
+			if (frame[0] <= rbp)
+				break;
+			rbp = frame[0];
+		}
+	} catch (...) {
+		// A frame outside of guest memory ends the stack
+	}
+	m_profiles[reqid].record(frames, depth);
+}
+
+std::string Profiler::folded()
+{
+	std::scoped_lock lock(m_symbols_mutex);
+	if (m_symbols == nullptr) {
+		m_symbols = std::make_unique<GuestSymbols>(m_master.load_guest_symbols());
+	}
+	std::map<std::string, uint64_t> stacks;
+	uint64_t dropped = 0;
+	for (unsigned i = 0; i < m_max_vms; i++)
+	{
+		m_profiles[i].for_each([&](const uint64_t* frames, unsigned depth, uint64_t count) {
+			std::string stack;
+			for (unsigned f = depth; f-- > 0; ) {
+				// Return addresses point after the call instruction
+				stack += m_symbols->frame_name((f > 0) ? frames[f] - 1 : frames[f]);
+				if (f > 0)
+					stack += ';';
+			}
+			stacks[stack] += count;
+		});
+		dropped += m_profiles[i].dropped();
+	}
+	if (dropped > 0) {
+		stacks["[dropped]"] += dropped;
+	}
+	std::string out;
+	for (const auto& [stack, count] : stacks) {
+		out += stack;
+		out += ' ';
+		out += std::to_string(count);
+		out += '\n';
+	}
+	return out;
+}
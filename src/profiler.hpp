@@ -0,0 +1,69 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "symbols.hpp"
+namespace tinykvm { struct Machine; }
+struct VirtualMachine;
+
+// Guest call stacks of one request VM and how often they were sampled.
+// Open addressing, insert-only: the VM thread is the only writer, and
+// a reader sees a slot once its key is published.
+struct StackProfile
+{
+	static constexpr unsigned MAX_FRAMES = 32;
+	static constexpr size_t SLOTS = 1024; // Power of two
+	static constexpr unsigned MAX_PROBES = 16;
+
+	void record(const uint64_t* frames, unsigned depth) noexcept;
+	template <typename Func>
+	void for_each(Func&& func) const
+	{
+		for (size_t i = 0; i < SLOTS; i++) {
+			const Slot& slot = m_slots[i];
+			if (slot.key.load(std::memory_order_acquire) == 0)
+				continue;
+			func(slot.frames, slot.depth, slot.count.load(std::memory_order_relaxed));
+		}
+	}
+	uint64_t dropped() const noexcept { return m_dropped.load(std::memory_order_relaxed); }
+
+	StackProfile() : m_slots(std::make_unique<Slot[]>(SLOTS)) {}
+
+private:
+	struct Slot {
+		std::atomic<uint64_t> key = 0;
+		std::atomic<uint64_t> count = 0;
+		unsigned depth = 0;
+		uint64_t frames[MAX_FRAMES];
+	};
+	std::unique_ptr<Slot[]> m_slots;
+	std::atomic<uint64_t> m_dropped = 0;
+};
+
+// Low-rate sampling profiler for request VMs (--profile-hz). A running
+// guest is interrupted by the vmresume() timeout every interval, and
+// its stack is unwound through the frame pointer chain. The profile is
+// served as folded stacks for flamegraph.pl (see Metrics).
+struct Profiler
+{
+	// Seconds the guest runs between samples
+	float interval() const noexcept { return m_interval; }
+	// Called by the VM thread after its vCPU timed out
+	void sample(unsigned reqid, tinykvm::Machine&) noexcept;
+	// "frame;frame;frame count" lines, root first, of every request VM
+	std::string folded();
+
+	Profiler(const VirtualMachine& master, unsigned max_vms, unsigned hz);
+
+private:
+	const VirtualMachine& m_master;
+	const unsigned m_max_vms;
+	const float m_interval;
+	std::unique_ptr<StackProfile[]> m_profiles;
+	// Loaded on the first request for the profile
+	std::unique_ptr<GuestSymbols> m_symbols;
+	std::mutex m_symbols_mutex;
+};
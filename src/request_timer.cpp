@@ -0,0 +1,120 @@
+#include "request_timer.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <tinykvm/machine.hpp>
+
+// The machine whose request is running on this thread. The kick handler
+// stops it so that the vCPU returns to the host after KVM_RUN is interrupted.
+static thread_local tinykvm::Machine* kick_machine = nullptr;
+
+static void kick_handler(int)
+{
+	if (kick_machine != nullptr) {
+		kick_machine->stop();
+	}
+}
+
+RequestTimer::RequestTimer()
+{
+	// No SA_RESTART: blocking host syscalls made on behalf
+	// of the guest must also be interrupted
+	struct sigaction sa {};
+	sa.sa_handler = kick_handler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(KICK_SIGNAL, &sa, nullptr) < 0) {
+		throw std::runtime_error("sigaction() failed: " + std::string(strerror(errno)));
+	}
+	m_thread = std::thread(&RequestTimer::timer_thread, this);
+}
+RequestTimer::~RequestTimer()
+{
+	m_stop = true;
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+void RequestTimer::link(Entry*& head, Entry& entry)
+{
+	entry.prev = nullptr;
+	entry.next = head;
+	if (head != nullptr)
+		head->prev = &entry;
+	head = &entry;
+}
+void RequestTimer::unlink(Entry*& head, Entry& entry)
+{
+	if (entry.prev != nullptr)
+		entry.prev->next = entry.next;
+	else
+		head = entry.next;
+	if (entry.next != nullptr)
+		entry.next->prev = entry.prev;
+	entry.prev = nullptr;
+	entry.next = nullptr;
+}
+
+void RequestTimer::arm(Entry& entry, tinykvm::Machine& machine, float seconds)
+{
+	const uint64_t ticks = std::max<uint64_t>(1,
+		std::ceil(seconds * 1000.0f / TICK.count()));
+	kick_machine = &machine;
+
+	std::scoped_lock lock(m_mutex);
+	if (entry.armed) {
+		unlink(entry.slot < SLOTS ? m_slots[entry.slot] : m_expired, entry);
+	}
+	entry.slot = (m_current + ticks) % SLOTS;
+	entry.rounds = (ticks - 1) / SLOTS;
+	entry.thread = pthread_self();
+	entry.machine = &machine;
+	entry.expired.store(false, std::memory_order_relaxed);
+	entry.armed = true;
+	link(m_slots[entry.slot], entry);
+}
+
+void RequestTimer::disarm(Entry& entry)
+{
+	kick_machine = nullptr;
+
+	std::scoped_lock lock(m_mutex);
+	if (entry.armed) {
+		unlink(entry.slot < SLOTS ? m_slots[entry.slot] : m_expired, entry);
+		entry.armed = false;
+	}
+	entry.expired.store(false, std::memory_order_relaxed);
+}
+
+void RequestTimer::timer_thread()
+{
+	auto next_tick = std::chrono::steady_clock::now();
+	while (!m_stop)
+	{
+		next_tick += TICK;
+		std::this_thread::sleep_until(next_tick);
+
+		std::scoped_lock lock(m_mutex);
+		m_current = (m_current + 1) % SLOTS;
+		Entry* entry = m_slots[m_current];
+		while (entry != nullptr) {
+			Entry* next = entry->next;
+			if (entry->rounds > 0) {
+				entry->rounds--;
+			} else {
+				unlink(m_slots[m_current], *entry);
+				entry->slot = SLOTS;
+				link(m_expired, *entry);
+				entry->expired.store(true, std::memory_order_release);
+				m_timeouts.fetch_add(1, std::memory_order_relaxed);
+			}
+			entry = next;
+		}
+		// Keep kicking until the VM thread has noticed and disarmed,
+		// in case the first signal arrived outside of KVM_RUN
+		for (Entry* e = m_expired; e != nullptr; e = e->next) {
+			pthread_kill(e->thread, KICK_SIGNAL);
+		}
+	}
+}
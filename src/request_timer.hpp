@@ -0,0 +1,55 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+namespace tinykvm { struct Machine; }
+
+// One host thread enforcing request deadlines for every request VM.
+// Deadlines live in a hashed timing wheel, so arming and disarming is
+// O(1) regardless of the number of VMs. An expired request is kicked
+// out of the guest by signalling the thread running its vCPU.
+struct RequestTimer
+{
+	static constexpr auto TICK = std::chrono::milliseconds(10);
+	static constexpr unsigned SLOTS = 256;
+	static constexpr int KICK_SIGNAL = SIGUSR1;
+
+	struct Entry {
+		Entry* prev = nullptr;
+		Entry* next = nullptr;
+		uint64_t rounds = 0;
+		unsigned slot = 0;
+		bool armed = false;
+		pthread_t thread {};
+		tinykvm::Machine* machine = nullptr;
+		std::atomic<bool> expired = false;
+	};
+
+	// Must be called from the thread that runs the VM
+	void arm(Entry&, tinykvm::Machine&, float seconds);
+	// Also the thread that runs the VM, which is no longer kicked
+	void disarm(Entry&);
+
+	uint64_t timeouts() const noexcept { return m_timeouts.load(std::memory_order_relaxed); }
+
+	RequestTimer();
+	~RequestTimer();
+
+private:
+	void timer_thread();
+	static void link(Entry*& head, Entry& entry);
+	static void unlink(Entry*& head, Entry& entry);
+
+	std::array<Entry*, SLOTS> m_slots {};
+	Entry* m_expired = nullptr; // Kicked on every tick until disarmed
+	unsigned m_current = 0;
+	std::mutex m_mutex;
+	std::atomic<bool> m_stop = false;
+	std::atomic<uint64_t> m_timeouts = 0;
+	std::thread m_thread;
+};
@@ -1,8 +1,17 @@
 #pragma once
+#include <chrono>
 #include <cstdint>
 
 namespace settings
 {
     static constexpr uint64_t MAIN_STACK_SIZE = 4UL << 20; /* 4MB */
+    static constexpr uint32_t RETIRED_WORK_MEM = 64UL << 10; /* 64KB kept by retired forks */
+    static constexpr auto POOL_MANAGER_INTERVAL = std::chrono::milliseconds(100);
+    static constexpr size_t FRONTEND_MAX_HEADER = 64UL << 10; /* 64KB request or response header */
+    static constexpr uint64_t FRONTEND_MAX_BODY = 64UL << 20; /* 64MB request body */
+    static constexpr size_t FRONTEND_MAX_BUFFERED = 1UL << 20; /* 1MB buffered per direction */
+    static constexpr auto TRACE_DRAIN_INTERVAL = std::chrono::milliseconds(50);
+    static constexpr auto SNAPSHOT_HOT_PAGES_DELAY = std::chrono::seconds(30); /* Serving before recording hot pages */
+    static constexpr auto SNAPSHOT_MEMORY_INTERVAL = std::chrono::seconds(10); /* Between smaps reads for --metrics */
 
 }
\ No newline at end of file
@@ -0,0 +1,201 @@
+#include "snapshot_pages.hpp"
+
+#include "settings.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+static constexpr uint64_t PAGE_SIZE = 4096;
+// readahead() reads at most the device's readahead window per call
+static constexpr uint64_t PREFETCH_CHUNK_PAGES = 32;
+
+SnapshotHotPages::SnapshotHotPages(std::string snapshot_filename, std::string list_filename)
+	: m_snapshot_filename(std::move(snapshot_filename)),
+	  m_list_filename(std::move(list_filename))
+{
+	struct stat st;
+	if (stat(m_snapshot_filename.c_str(), &st) < 0) {
+		throw std::runtime_error("Failed to stat snapshot file: " + m_snapshot_filename);
+	}
+	m_snapshot_size = st.st_size;
+	m_snapshot_mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+	m_snapshot_dev = st.st_dev;
+	m_snapshot_ino = st.st_ino;
+
+	if (this->load()) {
+		m_mode = Mode::Prefetch;
+		m_thread = std::thread(&SnapshotHotPages::prefetch, this);
+		return;
+	}
+	m_thread = std::thread(&SnapshotHotPages::record, this);
+}
+
+SnapshotHotPages::~SnapshotHotPages()
+{
+	{
+		std::scoped_lock lock(m_mutex);
+		m_stop = true;
+	}
+	m_stop_cond.notify_all();
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+bool SnapshotHotPages::load()
+{
+	FILE* fp = fopen(m_list_filename.c_str(), "r");
+	if (fp == nullptr) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "Failed to read hot page list '%s': %s\n",
+				m_list_filename.c_str(), strerror(errno));
+		}
+		return false;
+	}
+	// A list is only valid for the snapshot it was recorded from
+	unsigned long size = 0;
+	long mtime = 0;
+	char line[256];
+	if (fgets(line, sizeof(line), fp) == nullptr || line[0] != '#'
+		|| fscanf(fp, "size %lu mtime %ld\n", &size, &mtime) != 2) {
+		fprintf(stderr, "Ignoring malformed hot page list '%s'\n", m_list_filename.c_str());
+		fclose(fp);
+		return false;
+	}
+	if (size != m_snapshot_size || mtime != m_snapshot_mtime) {
+		fprintf(stderr, "Hot page list '%s' is for another snapshot, recording a new one\n",
+			m_list_filename.c_str());
+		fclose(fp);
+		return false;
+	}
+	Range range;
+	while (fscanf(fp, "%lu %lu\n", &range.first_page, &range.pages) == 2) {
+		if (range.first_page + range.pages > (m_snapshot_size + PAGE_SIZE - 1) / PAGE_SIZE)
+			continue;
+		m_ranges.push_back(range);
+		m_pages += range.pages;
+	}
+	fclose(fp);
+	return true;
+}
+
+void SnapshotHotPages::prefetch()
+{
+	const int fd = open(m_snapshot_filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open snapshot file '%s' for prefetching: %s\n",
+			m_snapshot_filename.c_str(), strerror(errno));
+		return;
+	}
+	for (const Range& range : m_ranges) {
+		for (uint64_t page = 0; page < range.pages; page += PREFETCH_CHUNK_PAGES) {
+			if (m_stop)
+				break;
+			const uint64_t pages = std::min(PREFETCH_CHUNK_PAGES, range.pages - page);
+			readahead(fd, (range.first_page + page) * PAGE_SIZE, pages * PAGE_SIZE);
+		}
+	}
+	close(fd);
+}
+
+void SnapshotHotPages::record()
+{
+	{
+		std::unique_lock lock(m_mutex);
+		if (m_stop_cond.wait_for(lock, settings::SNAPSHOT_HOT_PAGES_DELAY, [this] { return m_stop.load(); }))
+			return;
+	}
+	// The pages this process faulted in, through any of its mappings of
+	// the snapshot. Unlike the page cache (mincore), this leaves out pages
+	// read by other processes, so nothing needs to be evicted first.
+	const uint64_t total_pages = (m_snapshot_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	std::vector<bool> resident(total_pages);
+	if (!this->find_faulted_pages(resident)) {
+		fprintf(stderr, "Failed to record hot pages of '%s': %s\n",
+			m_snapshot_filename.c_str(), strerror(errno));
+		return;
+	}
+
+	std::vector<Range> ranges;
+	uint64_t pages = 0;
+	for (uint64_t page = 0; page < total_pages; page++) {
+		if (!resident[page])
+			continue;
+		if (!ranges.empty() && ranges.back().first_page + ranges.back().pages == page)
+			ranges.back().pages++;
+		else
+			ranges.push_back(Range { page, 1 });
+		pages++;
+	}
+	if (pages == 0) {
+		fprintf(stderr, "No pages of snapshot file '%s' were touched, not writing '%s'\n",
+			m_snapshot_filename.c_str(), m_list_filename.c_str());
+		return;
+	}
+
+	const std::string temp = m_list_filename + ".tmp";
+	FILE* fp = fopen(temp.c_str(), "w");
+	if (fp == nullptr) {
+		fprintf(stderr, "Failed to write hot page list '%s': %s\n",
+			temp.c_str(), strerror(errno));
+		return;
+	}
+	fprintf(fp, "# Hot pages: %lu of %lu in %zu ranges\n", pages, total_pages, ranges.size());
+	fprintf(fp, "size %lu mtime %ld\n", m_snapshot_size, m_snapshot_mtime);
+	for (const Range& range : ranges)
+		fprintf(fp, "%lu %lu\n", range.first_page, range.pages);
+	if (fclose(fp) != 0 || rename(temp.c_str(), m_list_filename.c_str()) < 0) {
+		fprintf(stderr, "Failed to write hot page list '%s': %s\n",
+			m_list_filename.c_str(), strerror(errno));
+		return;
+	}
+	printf("Recorded %lu hot snapshot pages (%lu MB) in %zu ranges to %s\n",
+		pages, (pages * PAGE_SIZE) >> 20, ranges.size(), m_list_filename.c_str());
+}
+
+bool SnapshotHotPages::find_faulted_pages(std::vector<bool>& resident) const
+{
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (maps == nullptr)
+		return false;
+	const int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	if (pagemap < 0) {
+		fclose(maps);
+		return false;
+	}
+	char line[4096];
+	while (fgets(line, sizeof(line), maps) != nullptr) {
+		uint64_t start, end, offset, inode;
+		unsigned dev_major, dev_minor;
+		if (sscanf(line, "%lx-%lx %*s %lx %x:%x %lu", &start, &end, &offset, &dev_major, &dev_minor, &inode) != 6)
+			continue;
+		if (inode != m_snapshot_ino || makedev(dev_major, dev_minor) != m_snapshot_dev)
+			continue;
+		// One 64-bit entry per page, bit 63 is set when present.
+		// Copied-on-write pages are present too.
+		std::vector<uint64_t> entries((end - start) / PAGE_SIZE);
+		const ssize_t len = pread(pagemap, entries.data(), entries.size() * sizeof(uint64_t),
+			(start / PAGE_SIZE) * sizeof(uint64_t));
+		if (len < 0) {
+			const int err = errno;
+			close(pagemap);
+			fclose(maps);
+			errno = err;
+			return false;
+		}
+		const size_t count = len / sizeof(uint64_t);
+		for (size_t i = 0; i < count; i++) {
+			const uint64_t page = offset / PAGE_SIZE + i;
+			if ((entries[i] >> 63) != 0 && page < resident.size())
+				resident[page] = true;
+		}
+	}
+	close(pagemap);
+	fclose(maps);
+	return true;
+}
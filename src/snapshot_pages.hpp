@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+// The pages of a snapshot file (--snapshot-file) that a restored program
+// touches (--snapshot-hot-pages). tinykvm maps the snapshot file, so only
+// the pages the guest touches are ever read, but on a cold page cache each
+// of them is a blocking read during the first requests. The first start
+// records which pages it has faulted in after a while, and later starts
+// read those pages into the page cache in the background while booting.
+struct SnapshotHotPages
+{
+	enum class Mode {
+		Prefetch, // The list matches the snapshot
+		Record,   // No list, or one recorded for another snapshot
+	};
+	struct Range {
+		uint64_t first_page;
+		uint64_t pages;
+	};
+
+	Mode mode() const noexcept { return m_mode; }
+	// Pages in the list, when prefetching
+	uint64_t pages() const noexcept { return m_pages; }
+
+	// Call before the snapshot is mapped, so that prefetching overlaps it
+	SnapshotHotPages(std::string snapshot_filename, std::string list_filename);
+	~SnapshotHotPages();
+
+private:
+	bool load();
+	void prefetch();
+	void record();
+	// Set the pages of the snapshot present in this process' page tables
+	bool find_faulted_pages(std::vector<bool>& resident) const;
+
+	const std::string m_snapshot_filename;
+	const std::string m_list_filename;
+	Mode m_mode = Mode::Record;
+	uint64_t m_snapshot_size = 0;
+	int64_t m_snapshot_mtime = 0; /* Nanoseconds */
+	dev_t m_snapshot_dev = 0;
+	ino_t m_snapshot_ino = 0;
+	std::vector<Range> m_ranges;
+	uint64_t m_pages = 0;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_stop_cond;
+	std::atomic<bool> m_stop = false;
+};
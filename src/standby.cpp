@@ -0,0 +1,67 @@
+#include "standby.hpp"
+
+#include <cstdio>
+
+StandbyForks::StandbyForks(const VirtualMachine& master,
+	std::unique_ptr<VirtualMachine> active, std::unique_ptr<VirtualMachine> standby)
+	: m_master(master),
+	  m_active(std::move(active)),
+	  m_standby(std::move(standby))
+{
+	m_active->set_deferred_reset(true);
+	m_standby->set_deferred_reset(true);
+	m_worker = std::thread(&StandbyForks::reset_worker, this);
+}
+StandbyForks::~StandbyForks()
+{
+	{
+		std::scoped_lock lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	if (m_worker.joinable()) {
+		m_worker.join();
+	}
+}
+
+VirtualMachine& StandbyForks::swap()
+{
+	std::unique_lock lock(m_mutex);
+	// Only wait when requests arrive faster than the reset completes
+	m_cond.wait(lock, [this] { return !m_standby_dirty; });
+	// A keep-alive connection continues on the clean fork
+	const int parked = m_active->take_parked_connection();
+	std::swap(m_active, m_standby);
+	if (parked >= 0) {
+		m_active->park_connection(parked);
+	}
+	m_standby_dirty = true;
+	lock.unlock();
+	m_cond.notify_all();
+	return *m_active;
+}
+
+void StandbyForks::reset_worker()
+{
+	while (true)
+	{
+		std::unique_lock lock(m_mutex);
+		m_cond.wait(lock, [this] { return m_standby_dirty || m_stop; });
+		if (m_stop)
+			return;
+		lock.unlock();
+
+		// The standby fork is owned by this thread until it is marked clean
+		try {
+			m_standby->reset_to(m_master);
+		} catch (const std::exception& e) {
+			fprintf(stderr, "*** Standby VM %u failed to reset: %s\n",
+				m_standby->reqid(), e.what());
+		}
+
+		lock.lock();
+		m_standby_dirty = false;
+		lock.unlock();
+		m_cond.notify_all();
+	}
+}
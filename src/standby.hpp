@@ -0,0 +1,33 @@
+#pragma once
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "vm.hpp"
+
+// A pair of ephemeral request VMs belonging to one request thread.
+// The active fork serves connections while the standby fork is reset
+// on a background thread, taking the reset out of the accept path.
+struct StandbyForks
+{
+	VirtualMachine& active() noexcept { return *m_active; }
+	// Hand the active fork to the reset worker and make the standby fork
+	// active, waiting for its reset to complete if it is still running.
+	VirtualMachine& swap();
+
+	StandbyForks(const VirtualMachine& master,
+		std::unique_ptr<VirtualMachine> active, std::unique_ptr<VirtualMachine> standby);
+	~StandbyForks();
+
+private:
+	void reset_worker();
+
+	const VirtualMachine& m_master;
+	std::unique_ptr<VirtualMachine> m_active;
+	std::unique_ptr<VirtualMachine> m_standby;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_standby_dirty = false;
+	bool m_stop = false;
+	std::thread m_worker;
+};
@@ -0,0 +1,302 @@
+#include "symbols.hpp"
+
+#include "mmap_file.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cxxabi.h>
+#include <elf.h>
+#include <link.h>
+#include <memory>
+#include <tinykvm/machine.hpp>
+
+static std::string demangle(const char* name)
+{
+	int status = 0;
+	std::unique_ptr<char, decltype(&free)> demangled(
+		abi::__cxa_demangle(name, nullptr, nullptr, &status), &free);
+	if (status == 0 && demangled != nullptr)
+		return demangled.get();
+	return name;
+}
+
+template <typename T>
+static const T* elf_at(std::string_view elf, uint64_t offset, uint64_t count = 1)
+{
+	if (offset > elf.size() || count > (elf.size() - offset) / sizeof(T))
+		return nullptr;
+	return reinterpret_cast<const T*>(elf.data() + offset);
+}
+
+static const Elf64_Ehdr* elf_header(std::string_view elf)
+{
+	auto* ehdr = elf_at<Elf64_Ehdr>(elf, 0);
+	if (ehdr == nullptr || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+		|| ehdr->e_ident[EI_CLASS] != ELFCLASS64)
+		return nullptr;
+	return ehdr;
+}
+
+// Value of a symbol in .dynsym, eg. _r_debug in the dynamic linker
+static uint64_t find_dynamic_symbol(std::string_view elf, std::string_view wanted)
+{
+	auto* ehdr = elf_header(elf);
+	if (ehdr == nullptr)
+		return 0;
+	auto* shdrs = elf_at<Elf64_Shdr>(elf, ehdr->e_shoff, ehdr->e_shnum);
+	if (shdrs == nullptr)
+		return 0;
+	for (unsigned i = 0; i < ehdr->e_shnum; i++)
+	{
+		if (shdrs[i].sh_type != SHT_DYNSYM || shdrs[i].sh_link >= ehdr->e_shnum)
+			continue;
+		const Elf64_Shdr& strtab = shdrs[shdrs[i].sh_link];
+		auto* syms = elf_at<Elf64_Sym>(elf, shdrs[i].sh_offset, shdrs[i].sh_size / sizeof(Elf64_Sym));
+		if (syms == nullptr || strtab.sh_offset > elf.size())
+			return 0;
+		const std::string_view strings = elf.substr(strtab.sh_offset, strtab.sh_size);
+		for (size_t s = 0; s < shdrs[i].sh_size / sizeof(Elf64_Sym); s++) {
+			if (syms[s].st_name >= strings.size() || syms[s].st_shndx == SHN_UNDEF)
+				continue;
+			const std::string_view name = strings.substr(syms[s].st_name);
+			if (name.substr(0, name.find('\0')) == wanted)
+				return syms[s].st_value;
+		}
+	}
+	return 0;
+}
+
+void GuestSymbols::add_elf(std::string_view elf, uint64_t bias, const std::string& name)
+{
+	auto* ehdr = elf_header(elf);
+	if (ehdr == nullptr)
+		return;
+	// The object spans its loadable segments
+	auto* phdrs = elf_at<Elf64_Phdr>(elf, ehdr->e_phoff, ehdr->e_phnum);
+	if (phdrs != nullptr) {
+		uint64_t start = UINT64_MAX;
+		uint64_t end = 0;
+		for (unsigned i = 0; i < ehdr->e_phnum; i++) {
+			if (phdrs[i].p_type != PT_LOAD)
+				continue;
+			start = std::min(start, phdrs[i].p_vaddr);
+			end = std::max(end, phdrs[i].p_vaddr + phdrs[i].p_memsz);
+		}
+		if (start < end) {
+			const size_t slash = name.rfind('/');
+			m_objects.push_back(Object {
+				.start = bias + start,
+				.end = bias + end,
+				.name = (slash != std::string::npos) ? name.substr(slash + 1) : name,
+			});
+		}
+	}
+	// Prefer the full symbol table, stripped objects still have .dynsym
+	auto* shdrs = elf_at<Elf64_Shdr>(elf, ehdr->e_shoff, ehdr->e_shnum);
+	if (shdrs == nullptr)
+		return;
+	const Elf64_Shdr* symtab = nullptr;
+	for (unsigned i = 0; i < ehdr->e_shnum; i++) {
+		if (shdrs[i].sh_type == SHT_SYMTAB) {
+			symtab = &shdrs[i];
+			break;
+		}
+		if (shdrs[i].sh_type == SHT_DYNSYM && symtab == nullptr)
+			symtab = &shdrs[i];
+	}
+	if (symtab == nullptr || symtab->sh_link >= ehdr->e_shnum)
+		return;
+	const Elf64_Shdr& strtab = shdrs[symtab->sh_link];
+	const size_t count = symtab->sh_size / sizeof(Elf64_Sym);
+	auto* syms = elf_at<Elf64_Sym>(elf, symtab->sh_offset, count);
+	if (syms == nullptr || strtab.sh_offset > elf.size())
+		return;
+	const std::string_view strings = elf.substr(strtab.sh_offset, strtab.sh_size);
+	for (size_t i = 0; i < count; i++)
+	{
+		const Elf64_Sym& sym = syms[i];
+		const unsigned type = ELF64_ST_TYPE(sym.st_info);
+		const bool is_function = (type == STT_FUNC || type == STT_GNU_IFUNC);
+		const bool is_variable = (type == STT_OBJECT && sym.st_size > 0);
+		if ((!is_function && !is_variable) || sym.st_shndx == SHN_UNDEF
+			|| sym.st_value == 0 || sym.st_name >= strings.size())
+			continue;
+		const std::string_view raw = strings.substr(sym.st_name);
+		const std::string symbol_name(raw.substr(0, raw.find('\0')));
+		auto& table = (is_function) ? m_symbols : m_variables;
+		table.push_back(Symbol {
+			.addr = bias + sym.st_value,
+			.size = sym.st_size,
+			.name = demangle(symbol_name.c_str()),
+		});
+	}
+	this->sort();
+}
+
+// Position-independent images are loaded with a bias
+static uint64_t load_bias(const tinykvm::Machine& machine, const Elf64_Ehdr& ehdr)
+{
+	return (ehdr.e_type == ET_DYN) ? machine.start_address() - ehdr.e_entry : 0;
+}
+
+std::vector<GuestSymbols::LoadedObject> GuestSymbols::loaded_objects(
+	const tinykvm::Machine& machine, std::string_view loaded_binary)
+{
+	std::vector<LoadedObject> objects;
+	auto* ehdr = elf_header(loaded_binary);
+	if (ehdr == nullptr)
+		return objects;
+	// The dynamic linker keeps the list of loaded objects in _r_debug
+	const uint64_t r_debug_offset = find_dynamic_symbol(loaded_binary, "_r_debug");
+	struct r_debug rd {};
+	if (r_debug_offset != 0) {
+		try {
+			machine.copy_from_guest(&rd, load_bias(machine, *ehdr) + r_debug_offset, sizeof(rd));
+		} catch (const std::exception& e) {
+			rd.r_map = nullptr;
+		}
+	}
+	uint64_t lm_addr = (uint64_t)rd.r_map;
+	for (unsigned n = 0; lm_addr != 0 && n < 4096; n++)
+	{
+		struct link_map lm {};
+		std::string name;
+		try {
+			machine.copy_from_guest(&lm, lm_addr, sizeof(lm));
+			char buffer[256];
+			uint64_t addr = (uint64_t)lm.l_name;
+			while (addr != 0 && name.size() < 4096) {
+				// Stay within the page, as the next one might not be mapped
+				const size_t len = std::min<uint64_t>(sizeof(buffer), 4096 - (addr & 4095));
+				machine.copy_from_guest(buffer, addr, len);
+				const size_t end = strnlen(buffer, len);
+				name.append(buffer, end);
+				if (end < len)
+					break;
+				addr += len;
+			}
+		} catch (const std::exception& e) {
+			fprintf(stderr, "Warning: Invalid link_map entry at 0x%lx: %s\n", lm_addr, e.what());
+			break;
+		}
+		lm_addr = (uint64_t)lm.l_next;
+		objects.push_back(LoadedObject { std::move(name), lm.l_addr });
+	}
+	return objects;
+}
+
+void GuestSymbols::load(const tinykvm::Machine& machine, std::string_view loaded_binary,
+	std::string_view program, const std::string& program_name, resolve_path_t resolve_path)
+{
+	auto* ehdr = elf_header(loaded_binary);
+	if (ehdr == nullptr)
+		return;
+	if (loaded_binary.data() == program.data()) {
+		// A static program, there is no link_map
+		this->add_elf(program, load_bias(machine, *ehdr), program_name);
+		return;
+	}
+
+	const auto objects = loaded_objects(machine, loaded_binary);
+	for (const auto& object : objects)
+	{
+		if (object.name.empty()) {
+			// The program itself
+			this->add_elf(program, object.bias, program_name);
+			continue;
+		}
+		const std::string host_path = resolve_path(object.name);
+		if (host_path.empty())
+			continue;
+		try {
+			MmapFile file(host_path);
+			this->add_elf(file.view(), object.bias, object.name);
+		} catch (const std::exception& e) {
+			// Eg. linux-vdso.so.1 does not exist as a file
+		}
+	}
+	if (objects.empty()) {
+		// Nothing loaded yet, but the dynamic linker itself
+		this->add_elf(loaded_binary, load_bias(machine, *ehdr), "ld-linux-x86-64.so.2");
+	}
+}
+
+void GuestSymbols::sort()
+{
+	for (auto* table : { &m_symbols, &m_variables }) {
+		std::sort(table->begin(), table->end(),
+			[](const Symbol& a, const Symbol& b) {
+				return a.addr < b.addr || (a.addr == b.addr && a.size > b.size);
+			});
+		// Keep one of each set of aliases
+		table->erase(std::unique(table->begin(), table->end(),
+			[](const Symbol& a, const Symbol& b) { return a.addr == b.addr; }), table->end());
+	}
+	std::sort(m_objects.begin(), m_objects.end(),
+		[](const Object& a, const Object& b) { return a.start < b.start; });
+}
+
+const GuestSymbols::Symbol* GuestSymbols::lookup(uint64_t addr) const
+{
+	auto it = std::upper_bound(m_symbols.begin(), m_symbols.end(), addr,
+		[](uint64_t addr, const Symbol& sym) { return addr < sym.addr; });
+	if (it == m_symbols.begin())
+		return nullptr;
+	--it;
+	// Symbols without a size cover everything up to the next symbol
+	if (it->size != 0 && addr >= it->addr + it->size)
+		return nullptr;
+	const Object* obj = this->object_of(addr);
+	if (obj == nullptr || it->addr < obj->start)
+		return nullptr;
+	return &*it;
+}
+
+const GuestSymbols::Symbol* GuestSymbols::variable_in(uint64_t start, uint64_t end) const
+{
+	auto it = std::upper_bound(m_variables.begin(), m_variables.end(), start,
+		[](uint64_t addr, const Symbol& sym) { return addr < sym.addr; });
+	// The variable covering the start, otherwise the first one inside
+	if (it != m_variables.begin() && start < std::prev(it)->addr + std::prev(it)->size)
+		return &*std::prev(it);
+	if (it != m_variables.end() && it->addr < end)
+		return &*it;
+	return nullptr;
+}
+
+const GuestSymbols::Object* GuestSymbols::object_of(uint64_t addr) const
+{
+	auto it = std::upper_bound(m_objects.begin(), m_objects.end(), addr,
+		[](uint64_t addr, const Object& obj) { return addr < obj.start; });
+	if (it == m_objects.begin())
+		return nullptr;
+	--it;
+	return (addr < it->end) ? &*it : nullptr;
+}
+
+std::string GuestSymbols::frame_name(uint64_t addr) const
+{
+	if (const Symbol* sym = this->lookup(addr))
+		return sym->name;
+	if (const Object* obj = this->object_of(addr))
+		return "[" + obj->name + "]";
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "0x%lx", addr);
+	return buffer;
+}
+
+std::string GuestSymbols::describe(uint64_t addr) const
+{
+	char buffer[64];
+	const Object* obj = this->object_of(addr);
+	if (const Symbol* sym = this->lookup(addr)) {
+		snprintf(buffer, sizeof(buffer), "+0x%lx (", addr - sym->addr);
+		return sym->name + buffer + obj->name + ")";
+	}
+	if (obj != nullptr) {
+		snprintf(buffer, sizeof(buffer), "+0x%lx", addr - obj->start);
+		return "[" + obj->name + "]" + buffer;
+	}
+	snprintf(buffer, sizeof(buffer), "0x%lx", addr);
+	return buffer;
+}
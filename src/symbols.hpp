@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+namespace tinykvm { struct Machine; }
+
+// Function and data symbols of a guest address space: the program,
+// and for dynamic programs every object in the dynamic linker's link_map.
+// Symbol tables are read from the ELF files on the host.
+struct GuestSymbols
+{
+	struct Symbol {
+		uint64_t addr;
+		uint64_t size;
+		std::string name;
+	};
+	struct Object {
+		uint64_t start;
+		uint64_t end;
+		std::string name;
+	};
+	// Translate a guest path into a readable host path, or return an
+	// empty string to skip the object
+	using resolve_path_t = std::function<std::string(const std::string& guest_path)>;
+
+	// The loaded binary is what the machine was created from, ie. the
+	// dynamic linker for dynamic programs, otherwise the program itself
+	void load(const tinykvm::Machine&, std::string_view loaded_binary,
+		std::string_view program, const std::string& program_name, resolve_path_t);
+	// The objects in the dynamic linker's link_map, in load order. The
+	// program itself has an empty name.
+	struct LoadedObject {
+		std::string name;
+		uint64_t bias;
+	};
+	static std::vector<LoadedObject> loaded_objects(const tinykvm::Machine&, std::string_view loaded_binary);
+	// Add the function and data symbols of an ELF image loaded with a load bias
+	void add_elf(std::string_view elf, uint64_t bias, const std::string& name);
+
+	const Symbol* lookup(uint64_t addr) const;
+	const Object* object_of(uint64_t addr) const;
+	// The data symbol covering, or otherwise first inside, [start, end)
+	const Symbol* variable_in(uint64_t start, uint64_t end) const;
+	// Symbol name, "[object]" or the hex address, for folded stacks
+	std::string frame_name(uint64_t addr) const;
+	// "symbol+0x10 (object)" for diagnostics
+	std::string describe(uint64_t addr) const;
+	size_t size() const noexcept { return m_symbols.size(); }
+	const std::vector<Object>& objects() const noexcept { return m_objects; }
+
+private:
+	void sort();
+
+	std::vector<Symbol> m_symbols;
+	std::vector<Symbol> m_variables;
+	std::vector<Object> m_objects;
+};
@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Guest of kvmserver_bench. It listens, and then serves connections by
+   closing them. The bench_ functions are called with vmcall. */
+
+static char dirty_area[2 << 20] __attribute__((aligned(4096)));
+
+__attribute__((used, noinline))
+void bench_nop(void)
+{
+}
+
+__attribute__((used, noinline))
+void bench_syscall(unsigned long count)
+{
+	for (unsigned long i = 0; i < count; i++)
+		syscall(SYS_getpid);
+}
+
+/* Write to one byte of each page */
+__attribute__((used, noinline))
+void bench_dirty(unsigned long bytes)
+{
+	for (unsigned long i = 0; i < bytes && i < sizeof(dirty_area); i += 4096)
+		dirty_area[i]++;
+}
+
+/* Each open is checked against the allowed paths by the host */
+__attribute__((used, noinline))
+void bench_open(unsigned long count)
+{
+	for (unsigned long i = 0; i < count; i++) {
+		const int fd = open("/dev/null", O_RDONLY);
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+int main(void)
+{
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+		return 1;
+	while (1) {
+		/* A zero timeout, so that a restarted poll never blocks the host */
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll(&pfd, 1, 0) <= 0)
+			continue;
+		const int client = accept4(fd, NULL, NULL, 0);
+		if (client >= 0)
+			close(client);
+	}
+}
@@ -0,0 +1,520 @@
+// Micro-benchmarks of the request VM life cycle, with an embedded static
+// guest (see benchguest). Prints ns/op distributions as JSON, so that
+// results can be diffed across commits. Fails when the steady-state
+// request cycle allocates in kvmserver code (see AllocationCounter).
+//
+//   kvmserver_bench [-n iterations] [kvmserver options] > bench.json
+#include "../acceptor.hpp"
+#include "../metrics.hpp"
+#include "../paths.hpp"
+#include "../request_timer.hpp"
+#include "../symbols.hpp"
+#include "../trace.hpp"
+#include "../vm.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <execinfo.h>
+#include <link.h>
+#include <netinet/in.h>
+#include <new>
+#include <numeric>
+#include <sys/socket.h>
+#include <unistd.h>
+extern const char _binary_benchguest_start, _binary_benchguest_end;
+extern std::vector<uint8_t> file_loader(const std::string& filename);
+
+static constexpr unsigned SYSCALLS_PER_CALL = 1000;
+static constexpr unsigned OPENS_PER_REQUEST = 4;
+// Cycles before counting, for buffers that grow on first use
+static constexpr unsigned WARMUP_REQUESTS = 16;
+
+// Counts heap allocations while enabled, by whose code made them: the
+// innermost caller in this executable outside of the standard library.
+// glibc allows replacing malloc and its aligned variants, and operator
+// new allocates with them, except aligned new, which is replaced too.
+// Needs the symbol table, so it does not work on stripped builds.
+struct AllocationCounter
+{
+	enum Owner { Kvmserver, Tinykvm, Unknown, OWNERS };
+
+	[[gnu::always_inline]] inline void record()
+	{
+		if (!m_enabled || m_in_record)
+			return;
+		// backtrace() and symbol lookups may allocate too
+		m_in_record = true;
+		void* frames[32];
+		const int depth = backtrace(frames, std::size(frames));
+		Owner owner = Unknown;
+		// The first frame is malloc itself
+		for (int i = 1; i < depth && owner == Unknown; i++) {
+			// Return addresses point after the call instruction
+			const auto* sym = m_symbols.lookup(uint64_t(frames[i]) - 1);
+			if (sym == nullptr)
+				continue; // Shared libraries
+			owner = owner_of(sym->name);
+			if (owner == Kvmserver && m_first_kvmserver == nullptr)
+				m_first_kvmserver = sym;
+		}
+		m_counts[owner]++;
+		m_in_record = false;
+	}
+
+	void enable(bool enabled) noexcept { m_enabled = enabled; }
+	uint64_t count(Owner owner) const noexcept { return m_counts[owner]; }
+	// The first function in kvmserver that allocated, or nullptr
+	const GuestSymbols::Symbol* first_kvmserver() const noexcept { return m_first_kvmserver; }
+	bool has_symbols() const noexcept { return m_symbols.size() > 0; }
+
+	void load_symbols()
+	{
+		// Position-independent executables are loaded with a bias
+		uint64_t bias = 0;
+		dl_iterate_phdr([](struct dl_phdr_info* info, size_t, void* data) {
+			*static_cast<uint64_t*>(data) = info->dlpi_addr;
+			return 1; // The executable comes first
+		}, &bias);
+		const std::vector<uint8_t> exe = file_loader("/proc/self/exe");
+		m_symbols.add_elf(std::string_view((const char*)exe.data(), exe.size()), bias, "kvmserver_bench");
+		// Load the unwinder before counting
+		void* frame;
+		backtrace(&frame, 1);
+	}
+
+private:
+	static Owner owner_of(std::string_view name)
+	{
+		if (name.starts_with("operator new") || name.starts_with("operator delete"))
+			return Unknown;
+		// Skip the return type of templates, eg. "void std::vector<..>::.."
+		int depth = 0;
+		size_t start = 0;
+		for (size_t i = 0; i < name.size(); i++) {
+			if (name[i] == '<')
+				depth++;
+			else if (name[i] == '>')
+				depth--;
+			else if (name[i] == '(' && depth == 0)
+				break;
+			else if (name[i] == ' ' && depth == 0)
+				start = i + 1;
+		}
+		name = name.substr(start);
+		if (name.starts_with("std::") || name.starts_with("__gnu_cxx::"))
+			return Unknown; // Look at the caller
+		if (name.starts_with("tinykvm::"))
+			return Tinykvm;
+		return Kvmserver;
+	}
+
+	GuestSymbols m_symbols;
+	bool m_enabled = false; // The benchmark is single-threaded
+	bool m_in_record = false;
+	uint64_t m_counts[OWNERS] {};
+	const GuestSymbols::Symbol* m_first_kvmserver = nullptr;
+};
+static AllocationCounter allocation_counter;
+
+// AddressSanitizer replaces malloc itself (SANITIZE=ON)
+#if defined(__SANITIZE_ADDRESS__)
+#define COUNT_ALLOCATIONS 0
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define COUNT_ALLOCATIONS 0
+#endif
+#endif
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS 1
+#endif
+
+#if COUNT_ALLOCATIONS
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void* malloc(size_t size)
+{
+	allocation_counter.record();
+	return __libc_malloc(size);
+}
+extern "C" void* calloc(size_t count, size_t size)
+{
+	allocation_counter.record();
+	return __libc_calloc(count, size);
+}
+extern "C" void* realloc(void* ptr, size_t size)
+{
+	allocation_counter.record();
+	return __libc_realloc(ptr, size);
+}
+extern "C" void* __libc_memalign(size_t, size_t);
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+	allocation_counter.record();
+	return __libc_memalign(alignment, size);
+}
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+	allocation_counter.record();
+	return __libc_memalign(alignment, size);
+}
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+	allocation_counter.record();
+	if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+	void* p = __libc_memalign(alignment, size);
+	if (p == nullptr)
+		return ENOMEM;
+	*ptr = p;
+	return 0;
+}
+// libstdc++ may implement aligned new without the functions above.
+// Aligned delete frees with free(), as for the others.
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	allocation_counter.record();
+	void* p = __libc_memalign(size_t(alignment), size ? size : 1);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	allocation_counter.record();
+	return __libc_memalign(size_t(alignment), size ? size : 1);
+}
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return operator new(size, alignment, std::nothrow);
+}
+#endif
+
+struct Result {
+	const char* name;
+	std::vector<double> samples; // Nanoseconds per operation
+};
+
+template <typename Func>
+static Result measure(const char* name, unsigned iterations, Func&& func)
+{
+	Result result { name, {} };
+	result.samples.reserve(iterations);
+	for (unsigned i = 0; i < iterations; i++)
+		result.samples.push_back(func());
+	return result;
+}
+
+// Time an operation, and return nanoseconds per operation
+template <typename Func>
+static double time_ns(Func&& func, unsigned operations = 1)
+{
+	const auto start = std::chrono::steady_clock::now();
+	func();
+	const auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count() / operations;
+}
+
+// Allowed paths and guest paths like those of a Python program
+// importing its modules, for the path lookup benchmarks
+static const char* const BENCH_ALLOWED_PATHS[] = {
+	"/app", "/usr/lib/python3.12", "/usr/lib/python3/dist-packages", "/tmp",
+	"/etc/ssl/certs", "/usr/share/zoneinfo", "/dev/urandom", "/dev/null",
+};
+static const char* const BENCH_GUEST_PATHS[] = {
+	"/usr/lib/python3.12/encodings/__init__.py", "/usr/lib/python3.12/json/decoder.py",
+	"/usr/lib/python3/dist-packages/requests/adapters.py", "main.py", "./static/index.html",
+	"/app/../etc/passwd", "/usr/local/lib/python3.12/site.py", "/etc/ssl/certs/ca-certificates.crt",
+};
+
+// The lookup before AllowedPaths, for comparison
+static bool map_lookup(std::string& pathinout, const std::string& cwd, const AllowedPaths::map_t& allowed_paths)
+{
+	std::filesystem::path path(pathinout);
+	if (path.is_relative())
+		path = std::filesystem::path(cwd) / path;
+	path = (path / "").lexically_normal().parent_path();
+	auto it = allowed_paths.upper_bound(path);
+	size_t failsafe = allowed_paths.size();
+	while (it != allowed_paths.begin() && failsafe-- > 0) {
+		--it;
+		auto [first_it, path_it] = std::mismatch(it->first.begin(), it->first.end(), path.begin(), path.end());
+		if (first_it == it->first.end()) {
+			if (it->second.readable) {
+				pathinout = std::accumulate(path_it, path.end(), it->second.real_path, std::divides{});
+				return true;
+			}
+			--path_it;
+		}
+		it = allowed_paths.upper_bound(std::accumulate(path.begin(), path_it, std::filesystem::path("/"), std::divides{}));
+	}
+	return false;
+}
+
+// The network check before NetworkAllowList, for comparison: a scan
+// of the allowed IPv4 addresses, where 0 is any address or port
+static bool linear_network_check(const struct sockaddr_in& addr, const std::vector<struct sockaddr_in>& allowed)
+{
+	for (const auto& entry : allowed) {
+		if ((entry.sin_addr.s_addr == addr.sin_addr.s_addr || entry.sin_addr.s_addr == 0)
+			&& (entry.sin_port == addr.sin_port || entry.sin_port == 0))
+			return true;
+	}
+	return false;
+}
+
+static void print_json(const std::vector<Result>& results, unsigned iterations)
+{
+	auto per_request = [&](AllocationCounter::Owner owner) {
+		return double(allocation_counter.count(owner)) / iterations;
+	};
+	printf("{\n\t\"iterations\": %u,\n", iterations);
+	printf("\t\"allocations_per_request\": { \"kvmserver\": %.2f, \"tinykvm\": %.2f, \"unknown\": %.2f },\n",
+		per_request(AllocationCounter::Kvmserver), per_request(AllocationCounter::Tinykvm),
+		per_request(AllocationCounter::Unknown));
+	printf("\t\"benchmarks\": {");
+	for (size_t r = 0; r < results.size(); r++)
+	{
+		std::vector<double> samples = results[r].samples;
+		std::sort(samples.begin(), samples.end());
+		double sum = 0.0;
+		for (const double sample : samples)
+			sum += sample;
+		auto percentile = [&](double p) {
+			return samples[std::min<size_t>(samples.size() * p, samples.size() - 1)];
+		};
+		printf("%s\n\t\t\"%s\": { \"min_ns\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f,"
+			" \"p99_ns\": %.1f, \"max_ns\": %.1f, \"mean_ns\": %.1f }",
+			(r > 0) ? "," : "", results[r].name,
+			samples.front(), percentile(0.50), percentile(0.90),
+			percentile(0.99), samples.back(), sum / samples.size());
+	}
+	printf("\n\t}\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned iterations = 1000;
+	int first_option = 1;
+	if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+		iterations = std::max(1, atoi(argv[2]));
+		first_option = 3;
+	}
+	// Other options are passed on to the configuration. The program path
+	// must exist, but only names the guest, which is embedded.
+	std::vector<std::string> args { argv[0], "--ephemeral", "--allow-all", "--max-request-time", "60" };
+	args.insert(args.end(), argv + first_option, argv + argc);
+	args.insert(args.end(), { "run", "/proc/self/exe" });
+	std::vector<char*> arg_pointers;
+	for (auto& arg : args)
+		arg_pointers.push_back(arg.data());
+
+	try {
+		const Configuration config = Configuration::FromArgs(arg_pointers.size(), arg_pointers.data());
+		VirtualMachine::init_kvm();
+
+		const std::string_view guest(&_binary_benchguest_start,
+			&_binary_benchguest_end - &_binary_benchguest_start);
+		VirtualMachine master(guest, config);
+		master.initialize(nullptr, false);
+		if (!master.is_waiting_for_requests() || master.poll_method() != VirtualMachine::PollMethod::Poll) {
+			fprintf(stderr, "The benchmark guest did not wait for requests in poll()\n");
+			return 1;
+		}
+		const uint64_t bench_nop = master.machine().address_of("bench_nop");
+		const uint64_t bench_syscall = master.machine().address_of("bench_syscall");
+		const uint64_t bench_dirty = master.machine().address_of("bench_dirty");
+
+		std::vector<Result> results;
+		results.push_back(measure("fork", iterations, [&] {
+			std::unique_ptr<VirtualMachine> fork;
+			return time_ns([&] { fork = std::make_unique<VirtualMachine>(master, 0, false); });
+		}));
+
+		VirtualMachine fork(master, 0, false);
+		const struct { const char* name; uint64_t bytes; } resets[] = {
+			{ "reset_0KB", 0 },
+			{ "reset_64KB", 64UL << 10 },
+			{ "reset_2MB", 2UL << 20 },
+		};
+		for (const auto& reset : resets) {
+			results.push_back(measure(reset.name, iterations, [&] {
+				if (reset.bytes > 0)
+					fork.machine().vmcall(bench_dirty, reset.bytes);
+				return time_ns([&] { fork.reset_to(master); });
+			}));
+		}
+
+		// The vmcalls clobber the registers of the paused guest
+		results.push_back(measure("vmresume_empty", iterations, [&] {
+			return time_ns([&] { fork.machine().vmcall(bench_nop); });
+		}));
+		results.push_back(measure("syscall_null", iterations, [&] {
+			return time_ns([&] { fork.machine().vmcall(bench_syscall, SYSCALLS_PER_CALL); },
+				SYSCALLS_PER_CALL);
+		}));
+		fork.reset_to(master);
+
+		// Per path lookup, as in the open callbacks, and a guest open()
+		AllowedPaths::map_t allowed_map;
+		for (const char* path : BENCH_ALLOWED_PATHS)
+			allowed_map.emplace(path, Configuration::VirtualPath { .real_path = path, .readable = true });
+		const AllowedPaths allowed_paths(allowed_map);
+		PathCache path_cache;
+		const std::string cwd = "/app";
+		auto lookups = [&](auto&& lookup) {
+			return time_ns([&] {
+				for (const char* guest_path : BENCH_GUEST_PATHS) {
+					std::string path = guest_path;
+					lookup(path);
+				}
+			}, std::size(BENCH_GUEST_PATHS));
+		};
+		results.push_back(measure("path_lookup_map", iterations, [&] {
+			return lookups([&](std::string& path) { map_lookup(path, cwd, allowed_map); });
+		}));
+		results.push_back(measure("path_lookup_trie", iterations, [&] {
+			return lookups([&](std::string& path) { allowed_paths.resolve(path, cwd, AllowedPaths::Readable); });
+		}));
+		results.push_back(measure("path_lookup_cached", iterations, [&] {
+			return lookups([&](std::string& path) { path_cache.resolve(allowed_paths, path, cwd, AllowedPaths::Readable); });
+		}));
+		// A connect() check against a list of exact upstream backends
+		// and a few CIDR ranges. The probes are denied, the worst case.
+		static constexpr unsigned BACKENDS = 4096;
+		static constexpr unsigned PROBES = 64;
+		std::vector<struct sockaddr_in> backends;
+		NetworkAllowList allow_list;
+		for (unsigned i = 0; i < BACKENDS; i++) {
+			struct sockaddr_in backend {};
+			backend.sin_family = AF_INET;
+			backend.sin_addr.s_addr = htonl(0x0A000000 | i); // 10.0.x.x
+			backend.sin_port = htons(8080);
+			backends.push_back(backend);
+			allow_list.add(AF_INET, &backend.sin_addr, 32, { 8080, 8080 });
+		}
+		for (unsigned i = 0; i < 16; i++) {
+			const in_addr_t range = htonl(0xAC100000 | (i << 8)); // 172.16.i.0/24
+			allow_list.add(AF_INET, &range, 24, { 443, 443 });
+		}
+		std::vector<struct sockaddr_storage> probes(PROBES);
+		for (unsigned i = 0; i < PROBES; i++) {
+			auto* probe = reinterpret_cast<struct sockaddr_in*>(&probes[i]);
+			probe->sin_family = AF_INET;
+			probe->sin_addr.s_addr = htonl(0xC0A80000 | i); // 192.168.0.i
+			probe->sin_port = htons(8080);
+		}
+		unsigned allowed_probes = 0;
+		results.push_back(measure("network_check_linear", iterations, [&] {
+			return time_ns([&] {
+				for (const auto& probe : probes)
+					allowed_probes += linear_network_check(reinterpret_cast<const struct sockaddr_in&>(probe), backends);
+			}, PROBES);
+		}));
+		results.push_back(measure("network_check_table", iterations, [&] {
+			return time_ns([&] {
+				for (const auto& probe : probes)
+					allowed_probes += allow_list.allows(probe);
+			}, PROBES);
+		}));
+		if (allowed_probes > 0)
+			throw std::runtime_error("A network check allowed a probe");
+
+		const uint64_t bench_open = master.machine().address_of("bench_open");
+		results.push_back(measure("open_syscall", iterations, [&] {
+			return time_ns([&] { fork.machine().vmcall(bench_open, OPENS_PER_REQUEST); },
+				OPENS_PER_REQUEST);
+		}));
+		fork.reset_to(master);
+
+		// The guest polls with a zero timeout, so this does not block
+		results.push_back(measure("restart_poll_syscall", iterations, [&] {
+			return time_ns([&] { fork.restart_poll_syscall(); });
+		}));
+		fork.reset_to(master);
+
+		// Hand a connection to the paused guest, which accepts and closes
+		// it, ending the request. Then reset for the next one.
+		results.push_back(measure("accept_inject_close", iterations, [&] {
+			int fds[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+				throw std::runtime_error("socketpair() failed: " + std::string(strerror(errno)));
+			const double ns = time_ns([&] {
+				fork.inject_connection(fds[0]);
+				fork.machine().vmresume();
+				if (!fork.is_reset_needed())
+					throw std::runtime_error("The benchmark guest did not close the connection");
+				fork.reset_to(master);
+			});
+			close(fds[1]);
+			return ns;
+		}));
+
+		// The request loop of a request VM as main() runs it: resume_fork()
+		// takes each connection from the acceptor, with the request timer,
+		// trace and statistics on. The guest also opens files. Once warm,
+		// the cycle must not allocate in kvmserver code.
+		Acceptor acceptor(master, 0, 1);
+		master.set_acceptor(&acceptor);
+		std::unique_ptr<RequestTimer> request_timer;
+		if (config.max_req_time > 0.0f) {
+			request_timer = std::make_unique<RequestTimer>();
+			master.set_request_timer(request_timer.get());
+		}
+		VirtualMachine::install_syscall_stats();
+		VMStats stats;
+		auto trace_ring = std::make_unique<TraceRing>(0);
+		std::vector<TraceRecord> trace_records;
+		trace_records.reserve(TraceRing::CAPACITY);
+		VirtualMachine request_vm(master, 1, false);
+		// Return to the bench after each request, as with --standby-fork
+		request_vm.set_deferred_reset(true);
+		request_vm.set_stats(&stats);
+		request_vm.set_trace(trace_ring.get());
+		auto request_cycle = [&] {
+			int fds[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+				throw std::runtime_error("socketpair() failed: " + std::string(strerror(errno)));
+			// Delivered ahead, so that resume_fork() does not block
+			request_vm.deliver_connection(fds[0]);
+			request_vm.resume_fork();
+			// The idle entry of the VM waiting for its connection
+			if (acceptor.take_idle() != &request_vm)
+				throw std::runtime_error("The request VM did not wait on the acceptor");
+			if (!request_vm.is_reset_needed())
+				throw std::runtime_error("The benchmark guest did not close the connection");
+			request_vm.reset_to(master);
+			request_vm.machine().vmcall(bench_open, OPENS_PER_REQUEST);
+			request_vm.reset_to(master);
+			close(fds[1]);
+			trace_records.clear();
+			trace_ring->drain(trace_records, request_vm.reqid());
+		};
+		allocation_counter.load_symbols();
+		for (unsigned i = 0; i < WARMUP_REQUESTS; i++)
+			request_cycle();
+		allocation_counter.enable(true);
+		for (unsigned i = 0; i < iterations; i++)
+			request_cycle();
+		allocation_counter.enable(false);
+
+		print_json(results, iterations);
+		if (!COUNT_ALLOCATIONS) {
+			fprintf(stderr, "Warning: built with AddressSanitizer, allocations were not counted\n");
+		} else if (!allocation_counter.has_symbols()) {
+			fprintf(stderr, "Warning: no symbols, allocations were not attributed\n");
+		} else if (const auto* sym = allocation_counter.first_kvmserver(); sym != nullptr) {
+			fprintf(stderr, "Error: %lu allocations in kvmserver code over %u requests, the first in %s\n",
+				allocation_counter.count(AllocationCounter::Kvmserver), iterations, sym->name.c_str());
+			return 1;
+		}
+	} catch (const std::exception& e) {
+		fprintf(stderr, "Error: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
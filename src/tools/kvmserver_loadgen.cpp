@@ -0,0 +1,569 @@
+// Open-loop HTTP load generator. Requests are sent at a fixed arrival
+// rate, and latency is measured from when each request was due, so a
+// slow server is not hidden by the load generator waiting for it
+// (coordinated omission). Prints a row of the README's latency tables.
+//
+//   kvmserver_loadgen --rate 10000 --duration 10 127.0.0.1:8000
+//   kvmserver_loadgen --rate 2000 --keep-alive ./bench.sock
+#include <CLI/CLI.hpp>
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Log-linear latency histogram in the style of HdrHistogram: values
+// below 256ns are exact, larger ones are kept to 128 sub-buckets per
+// power of two, which is better than 1% precision.
+struct LatencyHistogram
+{
+	static constexpr unsigned SUB_BITS = 7;
+	static constexpr unsigned SUB_BUCKETS = 1U << SUB_BITS;
+	static constexpr size_t EXACT = 2 * SUB_BUCKETS;
+	static constexpr size_t SIZE = EXACT + (64 - SUB_BITS) * SUB_BUCKETS;
+
+	void record(uint64_t value) noexcept
+	{
+		m_counts[index_of(value)]++;
+		m_count++;
+		m_sum += value;
+		m_max = std::max(m_max, value);
+	}
+	void add(const LatencyHistogram& other) noexcept
+	{
+		for (size_t i = 0; i < SIZE; i++)
+			m_counts[i] += other.m_counts[i];
+		m_count += other.m_count;
+		m_sum += other.m_sum;
+		m_max = std::max(m_max, other.m_max);
+	}
+	// The value below which a fraction of the recorded values are
+	uint64_t percentile(double fraction) const noexcept
+	{
+		if (m_count == 0)
+			return 0;
+		const uint64_t wanted = std::max<uint64_t>(1, m_count * fraction + 0.5);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < SIZE; i++) {
+			seen += m_counts[i];
+			if (seen >= wanted)
+				return std::min(value_of(i), m_max);
+		}
+		return m_max;
+	}
+	uint64_t count() const noexcept { return m_count; }
+	uint64_t max() const noexcept { return m_max; }
+	double mean() const noexcept { return (m_count > 0) ? double(m_sum) / m_count : 0.0; }
+
+private:
+	static size_t index_of(uint64_t value) noexcept
+	{
+		if (value < EXACT)
+			return value;
+		const unsigned shift = std::bit_width(value) - SUB_BITS - 1;
+		return EXACT + (shift - 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+	}
+	// The middle of the bucket
+	static uint64_t value_of(size_t index) noexcept
+	{
+		if (index < EXACT)
+			return index;
+		const unsigned shift = (index - EXACT) / SUB_BUCKETS + 1;
+		const uint64_t lower = ((index - EXACT) % SUB_BUCKETS + SUB_BUCKETS) << shift;
+		return lower + ((1ULL << shift) >> 1);
+	}
+
+	std::vector<uint64_t> m_counts = std::vector<uint64_t>(SIZE);
+	uint64_t m_count = 0;
+	uint64_t m_sum = 0;
+	uint64_t m_max = 0;
+};
+
+struct Options
+{
+	std::string address;
+	std::string path = "/";
+	std::string host = "localhost";
+	std::string name;
+	double rate = 1000.0; /* Requests per second */
+	double duration = 10.0; /* Seconds */
+	double warmup = 0.0; /* Seconds, not recorded */
+	double drain = 5.0; /* Seconds to wait for responses after the last request */
+	unsigned connections = 64;
+	unsigned threads = 1;
+	bool keep_alive = false;
+};
+
+// A unix socket path, or [host:]port where an IPv6 host is in brackets
+static std::vector<uint8_t> resolve(const std::string& address, socklen_t& addrlen)
+{
+	std::vector<uint8_t> storage(sizeof(struct sockaddr_storage));
+	if (address.find('/') != std::string::npos) {
+		struct sockaddr_un addr {};
+		addr.sun_family = AF_UNIX;
+		if (address.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("Socket path too long: " + address);
+		memcpy(addr.sun_path, address.c_str(), address.size());
+		memcpy(storage.data(), &addr, sizeof(addr));
+		addrlen = sizeof(addr);
+		return storage;
+	}
+	std::string host = "127.0.0.1";
+	std::string port = address;
+	const size_t colon = port.rfind(':');
+	if (colon != std::string::npos) {
+		host = port.substr(0, colon);
+		port = port.substr(colon + 1);
+		if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.size() - 2);
+	}
+	struct addrinfo hints {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* result = nullptr;
+	const int res = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+	if (res != 0)
+		throw std::runtime_error("Invalid address '" + address + "': " + gai_strerror(res));
+	memcpy(storage.data(), result->ai_addr, result->ai_addrlen);
+	addrlen = result->ai_addrlen;
+	freeaddrinfo(result);
+	return storage;
+}
+
+// Status code of the response at the start of the buffer, or 0
+static unsigned response_status(std::string_view buffer)
+{
+	// "HTTP/1.1 200"
+	if (buffer.size() < 12 || !buffer.starts_with("HTTP/"))
+		return 0;
+	return strtoul(std::string(buffer.substr(9, 3)).c_str(), nullptr, 10);
+}
+
+// Length of the complete response at the start of the buffer, or 0. A
+// response without a length is complete when the server closes.
+static size_t response_length(std::string_view buffer, bool& until_close)
+{
+	const size_t header_end = buffer.find("\r\n\r\n");
+	if (header_end == std::string_view::npos)
+		return 0;
+	const size_t body = header_end + 4;
+	// These never have a body, whatever their headers say
+	const unsigned status = response_status(buffer);
+	if (status / 100 == 1 || status == 204 || status == 304)
+		return body;
+	std::string headers(buffer.substr(0, header_end + 2));
+	std::transform(headers.begin(), headers.end(), headers.begin(),
+		[](unsigned char c) { return std::tolower(c); });
+	if (const size_t cl = headers.find("\r\ncontent-length:"); cl != std::string::npos) {
+		const size_t length = strtoull(headers.c_str() + cl + 17, nullptr, 10);
+		return (buffer.size() >= body + length) ? body + length : 0;
+	}
+	if (headers.find("\r\ntransfer-encoding: chunked") != std::string::npos) {
+		size_t pos = body;
+		while (true) {
+			const size_t line_end = buffer.find("\r\n", pos);
+			if (line_end == std::string_view::npos)
+				return 0;
+			const size_t chunk = strtoull(std::string(buffer.substr(pos, line_end - pos)).c_str(), nullptr, 16);
+			pos = line_end + 2 + chunk + 2;
+			if (chunk == 0) // Without trailers
+				return (buffer.size() >= pos) ? pos : 0;
+		}
+	}
+	until_close = true;
+	return 0;
+}
+
+struct Worker
+{
+	struct Connection {
+		int fd = -1;
+		bool connected = false;
+		bool idle = false;
+		uint64_t due = 0; // When the request in flight was due, or 0
+		size_t written = 0;
+		std::string response;
+	};
+
+	void run(uint64_t start);
+
+	Worker(const Options& options, unsigned index)
+		: m_options(options),
+		  m_connections(options.connections / options.threads + (index < options.connections % options.threads)),
+		  m_interval(1e9 * options.threads / options.rate),
+		  // Stagger the workers across one interval
+		  m_offset(1e9 / options.rate * index)
+	{
+		m_address = resolve(options.address, m_addrlen);
+		m_request = "GET " + options.path + " HTTP/1.1\r\nHost: " + options.host + "\r\n"
+			+ (options.keep_alive ? "" : "Connection: close\r\n") + "\r\n";
+	}
+
+	LatencyHistogram histogram;
+	uint64_t sent = 0;
+	uint64_t errors = 0;
+	uint64_t bad_status = 0;
+	uint64_t unfinished = 0;
+
+private:
+	bool open(Connection&);
+	void close_connection(Connection&);
+	void make_idle(Connection&);
+	void send_request(Connection&, uint64_t due);
+	bool write_request(Connection&);
+	void on_event(Connection&, uint32_t events);
+	void complete(Connection&, size_t length);
+
+	const Options& m_options;
+	const unsigned m_connections;
+	const double m_interval;
+	const double m_offset;
+	std::vector<uint8_t> m_address;
+	socklen_t m_addrlen = 0;
+	std::string m_request;
+	int m_epoll_fd = -1;
+	uint64_t m_record_after = 0;
+	std::vector<Connection> m_conns;
+	std::vector<Connection*> m_idle;
+	std::deque<uint64_t> m_pending; // Due times of requests waiting for a connection
+};
+
+bool Worker::open(Connection& conn)
+{
+	const int domain = reinterpret_cast<const struct sockaddr*>(m_address.data())->sa_family;
+	conn.fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (conn.fd < 0)
+		return false;
+	if (domain != AF_UNIX) {
+		const int one = 1;
+		setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	if (connect(conn.fd, reinterpret_cast<const struct sockaddr*>(m_address.data()), m_addrlen) < 0
+		&& errno != EINPROGRESS)
+	{
+		::close(conn.fd);
+		conn.fd = -1;
+		return false;
+	}
+	// Edge-triggered, as sockets stay writable
+	struct epoll_event ev {};
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = &conn;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, conn.fd, &ev);
+	conn.connected = false;
+	conn.due = 0;
+	conn.written = 0;
+	conn.response.clear();
+	return true;
+}
+
+void Worker::close_connection(Connection& conn)
+{
+	if (conn.fd >= 0) {
+		::close(conn.fd);
+		conn.fd = -1;
+	}
+	conn.due = 0;
+	// Reopened when it is used again
+	this->make_idle(conn);
+}
+
+void Worker::make_idle(Connection& conn)
+{
+	if (!conn.idle) {
+		conn.idle = true;
+		m_idle.push_back(&conn);
+	}
+}
+
+void Worker::send_request(Connection& conn, uint64_t due)
+{
+	conn.idle = false;
+	conn.due = due;
+	conn.written = 0;
+	conn.response.clear();
+	sent++;
+	if (!conn.connected)
+		return; // Written once connected
+	this->write_request(conn);
+}
+
+// A connection the server has closed fails the request, instead of
+// raising SIGPIPE
+bool Worker::write_request(Connection& conn)
+{
+	const ssize_t len = send(conn.fd, m_request.data() + conn.written,
+		m_request.size() - conn.written, MSG_NOSIGNAL);
+	if (len > 0) {
+		conn.written += len;
+	} else if (len < 0 && errno != EAGAIN && errno != EINTR) {
+		errors++;
+		this->close_connection(conn);
+		return false;
+	}
+	return true;
+}
+
+void Worker::complete(Connection& conn, size_t length)
+{
+	const uint64_t now = now_ns();
+	const std::string_view response(conn.response.data(), length);
+	if (response_status(response) / 100 != 2)
+		bad_status++;
+	else if (conn.due >= m_record_after)
+		histogram.record(now - conn.due);
+	conn.response.erase(0, length);
+	conn.due = 0;
+	if (m_options.keep_alive) {
+		this->make_idle(conn);
+	} else {
+		this->close_connection(conn);
+	}
+}
+
+void Worker::on_event(Connection& conn, uint32_t events)
+{
+	if (events & EPOLLOUT) {
+		if (!conn.connected) {
+			int error = 0;
+			socklen_t len = sizeof(error);
+			getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+			if (error != 0) {
+				if (conn.due != 0)
+					errors++;
+				this->close_connection(conn);
+				return;
+			}
+			conn.connected = true;
+			if (conn.due == 0)
+				this->make_idle(conn);
+		}
+		if (conn.due != 0 && conn.written < m_request.size() && !this->write_request(conn))
+			return;
+	}
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		char buffer[16384];
+		bool closed = (events & (EPOLLHUP | EPOLLERR)) != 0;
+		while (true) {
+			const ssize_t len = read(conn.fd, buffer, sizeof(buffer));
+			if (len > 0) {
+				conn.response.append(buffer, len);
+				continue;
+			}
+			if (len == 0 || (errno != EAGAIN && errno != EINTR))
+				closed = true;
+			break;
+		}
+		bool until_close = false;
+		if (conn.due != 0) {
+			size_t length = response_length(conn.response, until_close);
+			// Interim 1xx responses come before the response to the request
+			while (length > 0 && response_status(conn.response) / 100 == 1) {
+				conn.response.erase(0, length);
+				length = response_length(conn.response, until_close);
+			}
+			if (length > 0) {
+				this->complete(conn, length);
+				if (!closed)
+					return;
+			} else if (closed && until_close) {
+				this->complete(conn, conn.response.size());
+			}
+		}
+		if (closed) {
+			if (conn.due != 0)
+				errors++;
+			if (conn.fd >= 0)
+				this->close_connection(conn);
+		}
+	}
+}
+
+void Worker::run(uint64_t start)
+{
+	m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	const int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	struct epoll_event ev {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+	m_conns.resize(m_connections);
+	m_record_after = start + uint64_t(m_options.warmup * 1e9);
+	const uint64_t end = m_record_after + uint64_t(m_options.duration * 1e9);
+	for (auto& conn : m_conns) {
+		if (m_options.keep_alive) {
+			if (!this->open(conn))
+				throw std::runtime_error("Failed to connect to " + m_options.address + ": " + strerror(errno));
+		} else {
+			this->make_idle(conn);
+		}
+	}
+
+	uint64_t scheduled = 0;
+	uint64_t drain_until = 0;
+	struct epoll_event events[256];
+	while (true)
+	{
+		const uint64_t now = now_ns();
+		// Every request that is due, whether or not a connection is free
+		while (true) {
+			const uint64_t due = start + uint64_t(m_offset + scheduled * m_interval);
+			if (due > now || due >= end)
+				break;
+			m_pending.push_back(due);
+			scheduled++;
+		}
+		while (!m_pending.empty() && !m_idle.empty()) {
+			Connection& conn = *m_idle.back();
+			if (conn.fd < 0 && !this->open(conn)) {
+				errors++;
+				m_pending.pop_front();
+				continue;
+			}
+			m_idle.pop_back();
+			this->send_request(conn, m_pending.front());
+			m_pending.pop_front();
+		}
+		const uint64_t next = start + uint64_t(m_offset + scheduled * m_interval);
+		if (next >= end) {
+			const bool busy = !m_pending.empty() || std::any_of(m_conns.begin(), m_conns.end(),
+				[](const Connection& conn) { return conn.due != 0; });
+			if (drain_until == 0)
+				drain_until = now + uint64_t(m_options.drain * 1e9);
+			if (!busy || now >= drain_until)
+				break;
+		}
+		// Wake up for the next request, or to give up draining
+		struct itimerspec its {};
+		const uint64_t wakeup = (next < end) ? next : drain_until;
+		its.it_value.tv_sec = wakeup / 1000000000ULL;
+		its.it_value.tv_nsec = wakeup % 1000000000ULL;
+		timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+
+		const int count = epoll_wait(m_epoll_fd, events, std::size(events), -1);
+		for (int i = 0; i < count; i++) {
+			if (events[i].data.ptr == nullptr) {
+				uint64_t expirations;
+				[[maybe_unused]] ssize_t len = read(timer_fd, &expirations, sizeof(expirations));
+				continue;
+			}
+			this->on_event(*static_cast<Connection*>(events[i].data.ptr), events[i].events);
+		}
+	}
+	unfinished = m_pending.size();
+	for (auto& conn : m_conns) {
+		if (conn.due != 0)
+			unfinished++;
+		if (conn.fd >= 0)
+			::close(conn.fd);
+	}
+	::close(timer_fd);
+	::close(m_epoll_fd);
+}
+
+static std::string micros(uint64_t ns)
+{
+	return std::to_string((ns + 500) / 1000) + " µs";
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	CLI::App app{"kvmserver_loadgen"};
+	app.add_option("address", options.address, "Unix socket path or [host:]port")->required();
+	app.add_option("-r,--rate", options.rate, "Requests per second")->capture_default_str();
+	app.add_option("-d,--duration", options.duration, "Seconds of recorded requests")->capture_default_str();
+	app.add_option("-w,--warmup", options.warmup, "Seconds of requests before recording")->capture_default_str();
+	app.add_option("-c,--connections", options.connections, "Maximum concurrent connections")->capture_default_str();
+	app.add_option("-t,--threads", options.threads, "Event loop threads")->capture_default_str();
+	app.add_flag("-k,--keep-alive", options.keep_alive, "Reuse connections instead of one connection per request");
+	app.add_option("--path", options.path, "Request path")->capture_default_str();
+	app.add_option("--host", options.host, "Host header")->capture_default_str();
+	app.add_option("--drain", options.drain, "Seconds to wait for responses after the last request")->capture_default_str();
+	app.add_option("-n,--name", options.name, "Name of the table row");
+	try {
+		app.parse(argc, argv);
+		if (options.rate <= 0.0 || options.threads == 0 || options.connections < options.threads)
+			throw CLI::ValidationError("--rate must be positive, and --connections at least --threads");
+	} catch (const CLI::ParseError& e) {
+		return app.exit(e);
+	}
+	if (options.name.empty())
+		options.name = options.address + (options.keep_alive ? " keep-alive" : "");
+
+	try {
+		std::vector<std::unique_ptr<Worker>> workers;
+		for (unsigned i = 0; i < options.threads; i++)
+			workers.push_back(std::make_unique<Worker>(options, i));
+		// Leave time to open the keep-alive connections
+		const uint64_t start = now_ns() + 100000000ULL;
+		std::vector<std::thread> threads;
+		std::vector<std::exception_ptr> failures(workers.size());
+		for (size_t i = 0; i < workers.size(); i++) {
+			threads.emplace_back([&, i] {
+				try {
+					workers[i]->run(start);
+				} catch (...) {
+					failures[i] = std::current_exception();
+				}
+			});
+		}
+		for (auto& thread : threads)
+			thread.join();
+		for (auto& failure : failures) {
+			if (failure)
+				std::rethrow_exception(failure);
+		}
+
+		LatencyHistogram total;
+		uint64_t sent = 0, errors = 0, bad_status = 0, unfinished = 0;
+		for (const auto& worker : workers) {
+			total.add(worker->histogram);
+			sent += worker->sent;
+			errors += worker->errors;
+			bad_status += worker->bad_status;
+			unfinished += worker->unfinished;
+		}
+		fprintf(stderr, "%lu requests sent, %lu recorded (%.0f/s), %lu errors, %lu non-2xx, %lu unfinished\n",
+			sent, total.count(), total.count() / options.duration, errors, bad_status, unfinished);
+		fprintf(stderr, "p99.9 %s, max %s\n",
+			micros(total.percentile(0.999)).c_str(), micros(total.max()).c_str());
+
+		const std::string header[] = { "name", "average", "p50", "p90", "p99" };
+		const std::string row[] = { options.name, micros(total.mean()),
+			micros(total.percentile(0.50)), micros(total.percentile(0.90)), micros(total.percentile(0.99)) };
+		std::string lines[3];
+		for (size_t i = 0; i < std::size(header); i++) {
+			// "µ" is two bytes, but one column
+			auto columns = [](const std::string& s) { return s.size() - (s.find("µ") != std::string::npos); };
+			const size_t width = std::max(columns(header[i]), columns(row[i]));
+			lines[0] += "| " + header[i] + std::string(width - columns(header[i]), ' ') + " ";
+			lines[1] += "| " + std::string(width, '-') + " ";
+			lines[2] += "| " + row[i] + std::string(width - columns(row[i]), ' ') + " ";
+		}
+		for (const auto& line : lines)
+			printf("%s|\n", line.c_str());
+		return (errors > 0 || unfinished > 0) ? 1 : 0;
+	} catch (const std::exception& e) {
+		fprintf(stderr, "Error: %s\n", e.what());
+		return 1;
+	}
+}
@@ -0,0 +1,146 @@
+// Convert a kvmserver --trace file to Chrome trace JSON, which can be
+// opened in chrome://tracing or https://ui.perfetto.dev
+//
+//   kvmserver_trace trace.bin > trace.json
+#include "../trace.hpp"
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+struct RingState {
+	uint32_t reqid = 0;
+	uint64_t request_start = 0;
+	uint64_t request_vfd = 0;
+	uint64_t reset_start = 0;
+	uint64_t reset_pages = 0;
+	bool in_request = false;
+	bool in_reset = false;
+};
+
+static uint64_t s_first_timestamp = 0;
+static bool s_first_event = true;
+
+static void begin_event()
+{
+	printf(s_first_event ? "\n" : ",\n");
+	s_first_event = false;
+}
+static double micros(uint64_t timestamp)
+{
+	return double(timestamp - s_first_timestamp) / 1000.0;
+}
+static void complete(const TraceRecord& rec, const char* name, uint64_t start, const char* arg_name, uint64_t arg)
+{
+	begin_event();
+	printf("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%lu}}",
+		name, rec.ring, micros(start), double(rec.timestamp - start) / 1000.0, arg_name, arg);
+}
+static void instant(const TraceRecord& rec, const char* name, const char* arg_name)
+{
+	begin_event();
+	printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+		name, rec.ring, micros(rec.timestamp));
+	if (arg_name != nullptr)
+		printf(",\"args\":{\"%s\":%lu}", arg_name, rec.arg);
+	printf("}");
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+		return 1;
+	}
+	FILE* fp = fopen(argv[1], "rb");
+	if (fp == nullptr) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	TraceFileHeader header;
+	if (fread(&header, sizeof(header), 1, fp) != 1
+		|| memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+	{
+		fprintf(stderr, "%s is not a kvmserver trace\n", argv[1]);
+		return 1;
+	}
+	if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+		fprintf(stderr, "%s has unsupported trace version %u\n", argv[1], header.version);
+		return 1;
+	}
+	std::vector<TraceRecord> records;
+	TraceRecord record;
+	while (fread(&record, sizeof(record), 1, fp) == 1) {
+		records.push_back(record);
+	}
+	fclose(fp);
+	// The drainer writes the rings one after another
+	std::stable_sort(records.begin(), records.end(),
+		[](const TraceRecord& a, const TraceRecord& b) { return a.timestamp < b.timestamp; });
+	if (!records.empty())
+		s_first_timestamp = records.front().timestamp;
+
+	std::map<uint16_t, RingState> rings;
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (const TraceRecord& rec : records)
+	{
+		RingState& ring = rings[rec.ring];
+		ring.reqid = rec.reqid;
+		auto end_request = [&] {
+			if (ring.in_request) {
+				complete(rec, "request", ring.request_start, "vfd", ring.request_vfd);
+				ring.in_request = false;
+			}
+		};
+		switch (rec.event)
+		{
+		case TraceEvent::Inject:
+			instant(rec, "inject", "fd");
+			break;
+		case TraceEvent::Accept:
+			end_request();
+			ring.in_request = true;
+			ring.request_start = rec.timestamp;
+			ring.request_vfd = rec.arg;
+			break;
+		case TraceEvent::Close:
+			end_request();
+			instant(rec, "close", "vfd");
+			break;
+		case TraceEvent::RequestDone:
+			end_request();
+			instant(rec, "request done", "vfd");
+			break;
+		case TraceEvent::Timeout:
+			end_request();
+			instant(rec, "timeout", nullptr);
+			break;
+		case TraceEvent::Failure:
+			end_request();
+			instant(rec, "failure", nullptr);
+			break;
+		case TraceEvent::ResetStart:
+			end_request();
+			ring.in_reset = true;
+			ring.reset_start = rec.timestamp;
+			ring.reset_pages = rec.arg;
+			break;
+		case TraceEvent::ResetEnd:
+			if (ring.in_reset) {
+				complete(rec, "reset", ring.reset_start, "dirty_pages", ring.reset_pages);
+				ring.in_reset = false;
+			}
+			break;
+		case TraceEvent::Dropped:
+			instant(rec, "dropped", "records");
+			break;
+		}
+	}
+	// Name the timeline of every ring after its request VM
+	for (const auto& [index, ring] : rings) {
+		begin_event();
+		printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"VM %u (%u)\"}}",
+			index, ring.reqid, index);
+	}
+	printf("\n]}\n");
+	return 0;
+}
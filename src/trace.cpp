@@ -0,0 +1,99 @@
+#include "trace.hpp"
+
+#include "settings.hpp"
+#include <cstring>
+#include <stdexcept>
+
+void TraceRing::drain(std::vector<TraceRecord>& out, uint32_t reqid)
+{
+	const size_t tail = m_tail.load(std::memory_order_relaxed);
+	const size_t head = m_head.load(std::memory_order_acquire);
+	for (size_t i = tail; i != head; i++) {
+		out.push_back(m_records[i & (CAPACITY - 1)]);
+	}
+	m_tail.store(head, std::memory_order_release);
+
+	const uint64_t dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+	if (dropped > 0) {
+		TraceRecord rec {};
+		rec.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+		rec.arg = dropped;
+		rec.reqid = reqid;
+		rec.event = TraceEvent::Dropped;
+		rec.ring = m_index;
+		out.push_back(rec);
+	}
+}
+
+Tracer::Tracer(const std::string& filename)
+{
+	this->m_file = fopen(filename.c_str(), "wb");
+	if (this->m_file == nullptr) {
+		throw std::runtime_error("Tracer: failed to open '" + filename + "': " + strerror(errno));
+	}
+	TraceFileHeader header {};
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(TraceRecord);
+	if (fwrite(&header, sizeof(header), 1, this->m_file) != 1) {
+		fclose(this->m_file);
+		throw std::runtime_error("Tracer: failed to write '" + filename + "'");
+	}
+	fflush(this->m_file);
+}
+Tracer::~Tracer()
+{
+	{
+		std::scoped_lock lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	this->drain_all();
+	fclose(this->m_file);
+}
+
+TraceRing* Tracer::create_ring(unsigned reqid)
+{
+	std::scoped_lock lock(m_mutex);
+	m_rings.emplace_back(reqid, std::make_unique<TraceRing>(m_rings.size()));
+	return m_rings.back().second.get();
+}
+
+void Tracer::start()
+{
+	this->m_thread = std::thread(&Tracer::drain_thread, this);
+}
+
+void Tracer::drain_thread()
+{
+	std::unique_lock lock(m_mutex);
+	while (!m_stop)
+	{
+		m_cond.wait_for(lock, settings::TRACE_DRAIN_INTERVAL, [this] { return m_stop; });
+		lock.unlock();
+		this->drain_all();
+		lock.lock();
+	}
+}
+
+void Tracer::drain_all()
+{
+	m_buffer.clear();
+	{
+		// Rings are only ever added, and never removed
+		std::scoped_lock lock(m_mutex);
+		for (auto& [reqid, ring] : m_rings) {
+			ring->drain(m_buffer, reqid);
+		}
+	}
+	if (m_buffer.empty())
+		return;
+	if (fwrite(m_buffer.data(), sizeof(TraceRecord), m_buffer.size(), this->m_file) != m_buffer.size()) {
+		fprintf(stderr, "Tracer: failed to write trace records: %s\n", strerror(errno));
+	}
+	fflush(this->m_file);
+}
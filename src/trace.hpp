@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class TraceEvent : uint16_t {
+	Inject = 1,      // The host handed a connection to the VM (fd)
+	Accept,          // The guest accepted its connection (vfd)
+	Close,           // The guest closed its connection (vfd)
+	RequestDone,     // The guest finished a keep-alive request (vfd)
+	Timeout,         // The request timer kicked the guest out
+	Failure,         // The guest threw an exception
+	ResetStart,      // Dirty pages at the start of a reset
+	ResetEnd,
+	Dropped,         // Records lost because a ring was full (count)
+};
+
+// Fixed-size record, written as-is to the trace file
+struct TraceRecord {
+	uint64_t timestamp; // Nanoseconds, steady clock
+	uint64_t arg;
+	uint32_t reqid;
+	TraceEvent event;
+	uint16_t ring; // Standby forks share a reqid, but not a ring
+};
+static_assert(sizeof(TraceRecord) == 24);
+
+struct TraceFileHeader {
+	char magic[8]; // "KVMTRACE"
+	uint32_t version;
+	uint32_t record_size;
+};
+static constexpr char TRACE_MAGIC[8] = {'K', 'V', 'M', 'T', 'R', 'A', 'C', 'E'};
+static constexpr uint32_t TRACE_VERSION = 1;
+
+// Single-producer single-consumer ring of trace records. The producer
+// is the thread running the VM, the consumer is the Tracer's drainer.
+// A full ring drops new records instead of blocking the VM.
+struct TraceRing
+{
+	static constexpr size_t CAPACITY = 4096; // Power of two
+
+	void record(TraceEvent event, uint32_t reqid, uint64_t arg = 0) noexcept
+	{
+		const size_t head = m_head.load(std::memory_order_relaxed);
+		if (head - m_tail.load(std::memory_order_acquire) >= CAPACITY) {
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		TraceRecord& rec = m_records[head & (CAPACITY - 1)];
+		rec.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+		rec.arg = arg;
+		rec.reqid = reqid;
+		rec.event = event;
+		rec.ring = m_index;
+		m_head.store(head + 1, std::memory_order_release);
+	}
+	// Called by the drainer: append every available record
+	void drain(std::vector<TraceRecord>& out, uint32_t reqid);
+
+	TraceRing(uint16_t index) : m_index(index) {}
+
+private:
+	const uint16_t m_index;
+	alignas(64) std::atomic<size_t> m_head = 0;
+	alignas(64) std::atomic<size_t> m_tail = 0;
+	std::atomic<uint64_t> m_dropped = 0;
+	TraceRecord m_records[CAPACITY];
+};
+
+// Binary event tracer (--trace). Each request VM writes into its own
+// ring, and one background thread drains the rings into the trace file.
+// Use kvmserver_trace to convert the file to Chrome trace JSON.
+struct Tracer
+{
+	// A new ring for a VM, owned by the tracer
+	TraceRing* create_ring(unsigned reqid);
+
+	void start();
+
+	Tracer(const std::string& filename);
+	~Tracer();
+
+private:
+	void drain_thread();
+	void drain_all();
+
+	FILE* m_file = nullptr;
+	std::vector<std::pair<unsigned, std::unique_ptr<TraceRing>>> m_rings;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_stop = false;
+	std::vector<TraceRecord> m_buffer;
+	std::thread m_thread;
+};
@@ -1,12 +1,15 @@
 #include "vm.hpp"
 
+#include "dirty_report.hpp"
+#include "probes.hpp"
+#include "profiler.hpp"
 #include "settings.hpp"
+#include <algorithm>
 #include <cstring>
 #include <elf.h>
 #include <fcntl.h>
 #include <filesystem>
 #include <netinet/in.h>
-#include <numeric>
 #include <optional>
 #include <stdexcept>
 #include <sys/poll.h>
@@ -14,8 +17,16 @@
 #include <sys/syscall.h>
 #include <sys/un.h>
 #include <tinykvm/linux/threads.hpp>
+#include <unistd.h>
+#include <unordered_map>
 extern std::vector<uint8_t> file_loader(const std::string& filename);
 static std::vector<uint8_t> ld_linux_x86_64_so;
+#if __has_include(<sys/sdt.h>)
+// In .probes, where tracers expect to find the semaphores
+#define KVMSERVER_PROBE_SEMAPHORE_DEFINITION(name) \
+	volatile unsigned short kvmserver_##name##_semaphore __attribute__((section(".probes"))) = 0;
+KVMSERVER_PROBES(KVMSERVER_PROBE_SEMAPHORE_DEFINITION)
+#endif
 
 static bool is_interpreted_binary(std::string_view binary)
 {
@@ -62,96 +73,42 @@ static uint64_t dylink_address(const Configuration& config, bool storage)
 	return config.dylink_address_hint;
 }
 
-static bool lookup_allowed_path(
-	std::string& pathinout, const std::string& cwd,
-	const std::map<std::filesystem::path, Configuration::VirtualPath, Configuration::ComparePathSegments>& allowed_paths,
-	std::function<bool(const Configuration::VirtualPath&)> extract
-) {
-	std::filesystem::path path(pathinout);
-	if (path.is_relative()) {
-		path = std::filesystem::path(cwd) / path;
-	}
-	path = (path / "").lexically_normal().parent_path();
-	// Find first key strictly greater than path, e.g.
-	// { /foo: true, /foo/bar: true, /qux: true }.upper_bound(/foo/baz) -> /qux
-	auto it = allowed_paths.upper_bound(path);
-	size_t failsafe = allowed_paths.size();
-	while (it != allowed_paths.begin()) {
-		--it; // Previous key is either the path or shares a common prefix, e.g. /foo/bar.
-		auto [first_it, path_it] = std::mismatch(it->first.begin(), it->first.end(), path.begin(), path.end());
-		if (first_it == it->first.end()) {
-			if (extract(it->second)) {
-				// If that key is itself a prefix return the real_path plus the remainder of path
-				pathinout = std::accumulate(path_it, path.end(), it->second.real_path, std::divides{});
-				return true;
-			}
-			--path_it;
-		}
-		// otherwise lookup the common prefix
-		it = allowed_paths.upper_bound(std::accumulate(path.begin(), path_it, std::filesystem::path("/"), std::divides{}));
-		if (--failsafe == 0) {
-			if (getenv("VERBOSE") != nullptr)
-				fprintf(stderr, "lookup_allowed_path: failsafe triggered for path %s\n", pathinout.c_str());
-			break;
-		}
+// Record the host time of a system call, or of a path lookup, into
+// the statistics of a request VM (see SyscallStats)
+struct SyscallTimer
+{
+	SyscallTimer(VMStats* stats, uint32_t number)
+		: m_stats(stats), m_number(number)
+	{
+		if (m_stats != nullptr)
+			m_start = std::chrono::steady_clock::now();
 	}
-	return false; // no prefix found
-}
-
-static bool validate_network_access(
-	const struct sockaddr_storage& addr,
-	const std::vector<struct sockaddr_storage>& allowed_ipv4,
-	const std::vector<struct sockaddr_storage>& allowed_ipv6
-) {
-	// IPv4
-	if (addr.ss_family == AF_INET)
+	~SyscallTimer()
 	{
-		// Compare the socket address with the allowed address
-		const struct sockaddr_in* addr_ipv4 =
-			reinterpret_cast<const struct sockaddr_in*>(&addr);
-		for (auto& allowed : allowed_ipv4) {
-			const struct sockaddr_in* addr_allowed =
-				reinterpret_cast<const struct sockaddr_in*>(&allowed);
-			if (addr_ipv4->sin_addr.s_addr == addr_allowed->sin_addr.s_addr ||
-					addr_allowed->sin_addr.s_addr == 0) {
-				// The socket address is allowed
-				if (addr_ipv4->sin_port == addr_allowed->sin_port ||
-					addr_allowed->sin_port == 0) {
-					// The socket port is allowed
-					return true;
-				}
-			} // in_addr
-		}
-		// No match found
-		return false;
+		if (m_stats != nullptr)
+			m_stats->syscalls.record(m_number, std::chrono::steady_clock::now() - m_start);
 	}
-	// IPv6 or unspecified (we are guessing IPv4-mapped IPv6)
-	// XXX: is AF_UNSPEC a liability here? we should probably not allow
-	//      it but some (e.g. bun uses it to mean IPv4-mapped IPv6)
-	if (addr.ss_family == AF_INET6 || addr.ss_family == AF_UNSPEC)
+private:
+	VMStats* m_stats;
+	uint32_t m_number;
+	std::chrono::steady_clock::time_point m_start;
+};
+struct PathLookupTimer
+{
+	PathLookupTimer(VMStats* stats) : m_stats(stats)
 	{
-		const struct sockaddr_in6* addr_ipv6 =
-			reinterpret_cast<const struct sockaddr_in6*>(&addr);
-		for (auto& allowed : allowed_ipv6) {
-			const struct sockaddr_in6* addr_allowed =
-				reinterpret_cast<const struct sockaddr_in6*>(&allowed);
-			if (memcmp(&addr_allowed->sin6_addr, &in6addr_any, sizeof(struct in6_addr)) == 0 ||
-					memcmp(&addr_allowed->sin6_addr, &addr_ipv6->sin6_addr, sizeof(struct in6_addr)) == 0) {
-				// The socket address is allowed
-				if (addr_allowed->sin6_port == 0 ||
-					addr_ipv6->sin6_port == addr_allowed->sin6_port) {
-					// The socket port is allowed
-					return true;
-				}
-			} // in6_addr
-		}
-		// No match found
-		return false;
+		if (m_stats != nullptr)
+			m_start = std::chrono::steady_clock::now();
 	}
-	// Unknown address family
-	fprintf(stderr, "Unknown address family: %d\n", addr.ss_family);
-	return false;
-}
+	~PathLookupTimer()
+	{
+		if (m_stats != nullptr)
+			m_stats->syscalls.record_path_lookup(std::chrono::steady_clock::now() - m_start);
+	}
+private:
+	VMStats* m_stats;
+	std::chrono::steady_clock::time_point m_start;
+};
 
 VirtualMachine::VirtualMachine(std::string_view binary, const Configuration& config, bool storage)
 	: m_machine(select_main_binary(binary), tinykvm::MachineOptions{
@@ -173,12 +130,14 @@ VirtualMachine::VirtualMachine(std::string_view binary, const Configuration& con
 	m_config(config),
 	m_original_binary(binary),
 	m_ephemeral(config.ephemeral),
-	m_is_storage(storage)
+	m_is_storage(storage),
+	m_allowed_paths(std::make_shared<const AllowedPaths>(config.allowed_paths))
 {
 	machine().set_userdata<VirtualMachine> (this);
 	machine().install_unhandled_syscall_handler(
 		[] (tinykvm::vCPU& cpu, unsigned syscall_number) {
 			auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+			const SyscallTimer timer(vm.stats(), syscall_number);
 			switch (syscall_number) {
 			case 67339: // sys_remote_resume
 			case 0x10001:
@@ -186,6 +145,7 @@ VirtualMachine::VirtualMachine(std::string_view binary, const Configuration& con
 					// Remember buffer address and length values
 					const uint64_t src = cpu.registers().rdi;
 					const uint64_t len = cpu.registers().rsi;
+					KVMSERVER_PROBE(remote_resume_entry, vm.reqid(), src, len);
 
 					if (vm.config().storage_ipre_permanent)  {
 						tinykvm::Machine& m = cpu.machine().remote();
@@ -195,6 +155,7 @@ VirtualMachine::VirtualMachine(std::string_view binary, const Configuration& con
 						m.set_registers(regs);
 
 						m.ipre_permanent_remote_resume_now();
+						KVMSERVER_PROBE(remote_resume_exit, vm.reqid());
 						return;
 					}
 
@@ -203,9 +164,18 @@ VirtualMachine::VirtualMachine(std::string_view binary, const Configuration& con
 						m.remote().copy_to_guest(m.registers().rdi, &src, sizeof(src));
 						m.registers().rax = len;
 					});
+					KVMSERVER_PROBE(remote_resume_exit, vm.reqid());
 					return;
 				}
 				throw std::runtime_error("sys_remote_resume should *NOT* be called from storage VM");
+			case 0x10003: // sys_request_done
+				if (!vm.is_storage()) {
+					auto& regs = cpu.registers();
+					regs.rax = vm.request_done();
+					cpu.set_registers(regs);
+					return;
+				}
+				throw std::runtime_error("sys_request_done should *NOT* be called from storage VM");
 			case 0x10002: // sys_wait_for_storage_task_paused
 				if (vm.is_storage()) {
 					vm.set_waiting_for_requests(true);
@@ -214,34 +184,31 @@ VirtualMachine::VirtualMachine(std::string_view binary, const Configuration& con
 				}
 				throw std::runtime_error("sys_wait_for_storage_task_paused should *ONLY* be called from storage VM");
 			}
-			std::string info;
 			if (vm.is_storage())
-				info = " (storage)";
+				fprintf(stderr, "Unhandled syscall %d in VM %s (storage)\n",
+					syscall_number, vm.name().c_str());
 			else
-				info = " (request " + std::to_string(vm.reqid()) + ")";
-			fprintf(stderr, "Unhandled syscall %d in VM %s%s\n",
-				syscall_number, vm.name().c_str(), info.c_str());
+				fprintf(stderr, "Unhandled syscall %d in VM %s (request %u)\n",
+					syscall_number, vm.name().c_str(), vm.reqid());
 		});
 	machine().set_verbose_system_calls(
 		config.verbose_syscalls);
 	machine().set_verbose_mmap_syscalls(
-		config.verbose_syscalls);
+		config.verbose_mmap_syscalls);
 	machine().set_verbose_thread_syscalls(
-		config.verbose_syscalls);
+		config.verbose_thread_syscalls);
 	machine().fds().set_verbose(config.verbose);
 	machine().fds().set_preempt_epoll_wait(true);
 	// Set the current working directory
 	machine().fds().set_current_working_directory(
 		config.current_working_directory);
 	machine().fds().set_open_writable_callback(
-	[&] (std::string& path) -> bool {
-		return lookup_allowed_path(path, machine().fds().current_working_directory(),
-			config.allowed_paths, [](const Configuration::VirtualPath& vpath) { return vpath.writable; });
+	[this] (std::string& path) -> bool {
+		return this->resolve_path(path, AllowedPaths::Writable) != nullptr;
 	});
 	machine().fds().set_open_readable_callback(
-	[&] (std::string& path) -> bool {
-		return lookup_allowed_path(path, machine().fds().current_working_directory(),
-			config.allowed_paths, [](const Configuration::VirtualPath& vpath) { return vpath.readable; });
+	[this] (std::string& path) -> bool {
+		return this->resolve_path(path, AllowedPaths::Readable) != nullptr;
 	});
 	machine().fds().connect_socket_callback =
 	[this] (int fd, struct sockaddr_storage& addr) -> bool {
@@ -260,8 +227,7 @@ VirtualMachine::VirtualMachine(std::string_view binary, const Configuration& con
 		}
 
 		// Validate network addresses against allow-connect
-		return validate_network_access(
-			addr, m_config.allowed_connect_ipv4, m_config.allowed_connect_ipv6);
+		return m_config.allowed_connect.allows(addr);
 	};
 	machine().fds().bind_socket_callback =
 	[this] (int fd, struct sockaddr_storage& addr) -> bool {
@@ -280,8 +246,16 @@ VirtualMachine::VirtualMachine(std::string_view binary, const Configuration& con
 		}
 
 		// Validate network addresses against allow-listen
-		return validate_network_access(
-			addr, m_config.allowed_listen_ipv4, m_config.allowed_listen_ipv6);
+		if (!m_config.allowed_listen.allows(addr))
+			return false;
+		if (this->m_numa_replica) {
+			// The master already listens on this port (see share_listener)
+			if (addr.ss_family == AF_INET)
+				reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port = 0;
+			else if (addr.ss_family == AF_INET6)
+				reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_port = 0;
+		}
+		return true;
 	};
 	machine().fds().listening_socket_callback =
 	[this] (int vfd, int fd) -> bool {
@@ -289,15 +263,9 @@ VirtualMachine::VirtualMachine(std::string_view binary, const Configuration& con
 	};
 
 	machine().fds().set_resolve_symlink_callback(
-	[&] (std::string& path) -> bool {
-		bool symlink = false;
-		lookup_allowed_path(path, machine().fds().current_working_directory(),
-			config.allowed_paths, [&](const Configuration::VirtualPath& vpath) {
-				symlink = vpath.symlink;
-				// stop iteration here
-				return true;
-		});
-		return symlink;
+	[this] (std::string& path) -> bool {
+		const auto* vpath = this->resolve_path(path, AllowedPaths::Any);
+		return vpath != nullptr && vpath->symlink;
 	});
 }
 VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool is_storage)
@@ -314,13 +282,22 @@ VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool
 	  m_ephemeral(other.m_ephemeral),
 	  m_is_storage(is_storage),
 	  m_master_instance(&other),
-	  m_poll_method(other.m_poll_method)
+	  m_reset_options(reset_options(other)),
+	  m_poll_method(other.m_poll_method),
+	  m_allowed_paths(other.m_allowed_paths),
+	  m_path_cache(std::make_unique<PathCache>())
 {
+	// The machine has been forked from the master
+	KVMSERVER_PROBE(fork_created, reqid, is_storage);
 	machine().set_userdata<VirtualMachine> (this);
+	this->m_request_timer = other.m_request_timer;
+	this->m_acceptor = other.m_acceptor;
+	this->m_listener_vfd = other.m_tracked_client_vfd;
+	this->m_listener_fd = other.m_tracked_client_fd;
 	machine().fds().set_verbose(config().verbose);
 	machine().set_verbose_system_calls(config().verbose_syscalls);
-	machine().set_verbose_mmap_syscalls(config().verbose_syscalls);
-	machine().set_verbose_thread_syscalls(config().verbose_syscalls);
+	machine().set_verbose_mmap_syscalls(config().verbose_mmap_syscalls);
+	machine().set_verbose_thread_syscalls(config().verbose_thread_syscalls);
 	// Set the current working directory
 	machine().fds().set_current_working_directory(config().current_working_directory);
 	// Disable epoll_wait() preemption when timeout=-1
@@ -331,14 +308,14 @@ VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool
 			return master->machine().fds().entry_for_vfd(vfd);
 		});
 	machine().fds().set_open_writable_callback(
-	[&] (std::string& path) -> bool {
-		return lookup_allowed_path(path, machine().fds().current_working_directory(),
-			config().allowed_paths, [](const Configuration::VirtualPath& vpath) { return vpath.writable; });
+	[this] (std::string& path) -> bool {
+		const PathLookupTimer timer(m_stats);
+		return this->resolve_path(path, AllowedPaths::Writable) != nullptr;
 	});
 	machine().fds().set_open_readable_callback(
-	[&] (std::string& path) -> bool {
-		return lookup_allowed_path(path, machine().fds().current_working_directory(),
-			config().allowed_paths, [](const Configuration::VirtualPath& vpath) { return vpath.readable; });
+	[this] (std::string& path) -> bool {
+		const PathLookupTimer timer(m_stats);
+		return this->resolve_path(path, AllowedPaths::Readable) != nullptr;
 	});
 	machine().fds().connect_socket_callback = other.machine().fds().connect_socket_callback;
 	machine().fds().bind_socket_callback = other.machine().fds().bind_socket_callback;
@@ -349,7 +326,12 @@ VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool
 	{
 		machine().fds().accept_callback =
 		[this](int vfd, int fd, int flags) {
-			if (this->m_blocking_connections) {
+			if (this->m_injected_fd >= 0 && vfd == this->m_listener_vfd) {
+				this->accept_injected_connection(flags);
+				return false; // Don't call accept4
+			}
+			// With an acceptor the listener belongs to the host
+			if (this->m_blocking_connections || this->m_acceptor != nullptr) {
 					if (UNLIKELY(config().verbose_syscalls)) {
 						fprintf(stderr, "accept4: fd %d (%d) is not accepting connections\n", vfd, fd);
 					}
@@ -369,16 +351,23 @@ VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool
 			}
 			this->m_tracked_client_fd = fd;
 			this->m_tracked_client_vfd = machine().fds().manage(fd, true, true);
+			this->trace(TraceEvent::Accept, this->m_tracked_client_vfd);
+			KVMSERVER_PROBE(accept, this->m_reqid, this->m_tracked_client_vfd, fd);
 			if (config().verbose) {
 				printf("Forked VM %u accepted connection on vfd %d (%d)\n",
 					this->m_reqid, this->m_tracked_client_vfd, fd);
 			}
 			this->m_blocking_connections = true;
+			if (this->m_request_timer != nullptr) {
+				this->m_request_timer->arm(this->m_request_deadline, machine(), config().max_req_time);
+			}
 			return this->m_tracked_client_vfd;
 		};
 		machine().fds().free_fd_callback =
 		[this](int vfd, tinykvm::FileDescriptors::Entry& entry) -> bool {
 			if (vfd == this->m_tracked_client_vfd) {
+				this->trace(TraceEvent::Close, vfd);
+				KVMSERVER_PROBE(close, this->m_reqid, vfd, this->m_tracked_client_fd);
 				if (config().verbose) {
 					printf("Forked VM %u closed connection on fd %d (%d). Resetting...\n",
 						this->m_reqid, this->m_tracked_client_vfd, this->m_tracked_client_fd);
@@ -389,22 +378,132 @@ VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool
 			}
 			return false; // Nothing happened
 		};
+		// A guest waiting on its client connection is between requests
+		machine().fds().epoll_wait_callback =
+		[this](int vfd, int epfd, int timeout) {
+			if (!this->waits_on_client(timeout))
+				return true; // Call epoll_wait
+			const auto& entry = machine().fds().get_epoll_entry_for_vfd(vfd);
+			if (entry.epoll_fds.find(this->m_tracked_client_vfd) == entry.epoll_fds.end())
+				return true; // Call epoll_wait
+			// The epoll fd is readable when any of its events are ready
+			struct pollfd pfd { epfd, POLLIN, 0 };
+			return this->wait_between_requests(&pfd, 1, timeout);
+		};
+		machine().fds().poll_callback =
+		[this](struct pollfd* fds, unsigned nfds, int timeout) {
+			struct pollfd host_fds[64];
+			if (!this->waits_on_client(timeout) || nfds > std::size(host_fds))
+				return true; // Call poll()
+			bool on_client = false;
+			for (unsigned i = 0; i < nfds; i++) {
+				host_fds[i].fd = (fds[i].fd >= 0) ? machine().fds().translate(fds[i].fd) : -1;
+				host_fds[i].events = fds[i].events;
+				host_fds[i].revents = 0;
+				on_client |= fds[i].fd == this->m_tracked_client_vfd;
+			}
+			if (!on_client)
+				return true; // Call poll()
+			return this->wait_between_requests(host_fds, nfds, timeout);
+		};
 	}
 }
 VirtualMachine::~VirtualMachine()
 {
+	if (this->m_accept_epoll_fd >= 0) {
+		close(this->m_accept_epoll_fd);
+	}
+	if (this->m_parked_fd >= 0) {
+		close(this->m_parked_fd);
+	}
 }
 
-void VirtualMachine::reset_to(const VirtualMachine& other)
+bool VirtualMachine::waits_on_client(int timeout) const noexcept
 {
-	m_machine.reset_to(other.m_machine, tinykvm::MachineOptions{
-		.max_mem = other.m_machine.max_address(),
-		.max_cow_mem = other.config().max_req_mem,
+	return timeout != 0 && this->m_tracked_client_vfd >= 0
+		&& this->m_request_timer != nullptr && this->m_request_deadline.armed;
+}
+bool VirtualMachine::wait_between_requests(struct pollfd* fds, unsigned nfds, int timeout)
+{
+	// The request timer stops while the guest waits for the next request
+	// on a keep-alive connection, and starts over once something is ready
+	this->disarm_request_timer();
+	const int res = poll(fds, nfds, timeout);
+	this->m_request_timer->arm(this->m_request_deadline, machine(), config().max_req_time);
+	if (res == 0) {
+		// Timed out, so the guest wait would return nothing too
+		auto& regs = machine().registers();
+		regs.rax = 0;
+		machine().set_registers(regs);
+		return false; // Don't wait again
+	}
+	return true; // Returns without blocking
+}
+
+long VirtualMachine::request_done()
+{
+	// Only ephemeral forks serving a connection can start over
+	if (!this->m_ephemeral || this->m_master_instance == nullptr || this->m_tracked_client_fd < 0) {
+		return -EINVAL;
+	}
+	// Keep the connection open across the reset
+	const int fd = fcntl(this->m_tracked_client_fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0) {
+		return -errno;
+	}
+	if (config().verbose) {
+		printf("Forked VM %u finished a request on fd %d (%d). Resetting...\n",
+			this->m_reqid, this->m_tracked_client_vfd, this->m_tracked_client_fd);
+	}
+	this->trace(TraceEvent::RequestDone, this->m_tracked_client_vfd);
+	this->m_parked_fd = fd;
+	this->m_reset_needed = true;
+	machine().stop();
+	return 0;
+}
+
+const AllowedPaths::VirtualPath* VirtualMachine::resolve_path(std::string& path, AllowedPaths::Access access)
+{
+	const std::string& cwd = machine().fds().current_working_directory();
+	if (m_path_cache == nullptr)
+		return m_allowed_paths->resolve(path, cwd, access);
+	return m_path_cache->resolve(*m_allowed_paths, path, cwd, access);
+}
+
+tinykvm::MachineOptions VirtualMachine::reset_options(const VirtualMachine& master)
+{
+	return tinykvm::MachineOptions {
+		.max_mem = master.m_machine.max_address(),
+		.max_cow_mem = master.config().max_req_mem,
 		.stack_size = settings::MAIN_STACK_SIZE,
-		.reset_free_work_mem = other.config().limit_req_mem,
+		.reset_free_work_mem = master.config().limit_req_mem,
 		.reset_copy_all_registers = true,
-		.reset_keep_all_work_memory = other.config().ephemeral_keep_working_memory,
-	});
+		.reset_keep_all_work_memory = master.config().ephemeral_keep_working_memory,
+	};
+}
+
+void VirtualMachine::reset_to(const VirtualMachine& other)
+{
+	// Built once per fork, as forks are reset to the VM they were forked from
+	const tinykvm::MachineOptions& options = (&other == m_master_instance) ?
+		m_reset_options : reset_options(other);
+	const auto start = std::chrono::steady_clock::now();
+	// Counting the dirty pages walks the page tables
+	const bool count_pages = this->m_stats != nullptr || this->m_trace != nullptr
+		|| this->m_dirty_report != nullptr || KVMSERVER_PROBE_ENABLED(reset_start);
+	const size_t dirty_pages = count_pages ? m_machine.banked_memory_pages() : 0;
+	if (this->m_dirty_report != nullptr) {
+		this->m_dirty_report->record(m_machine, dirty_pages);
+	}
+	this->trace(TraceEvent::ResetStart, dirty_pages);
+	KVMSERVER_PROBE(reset_start, this->m_reqid, dirty_pages, options.max_cow_mem,
+		options.reset_free_work_mem, options.reset_keep_all_work_memory);
+	m_machine.reset_to(other.m_machine, options);
+	this->trace(TraceEvent::ResetEnd);
+	KVMSERVER_PROBE(reset_end, this->m_reqid);
+	if (this->m_stats != nullptr) {
+		this->m_stats->record_reset(std::chrono::steady_clock::now() - start, dirty_pages);
+	}
 	if (this->m_on_reset_callback) {
 		this->m_on_reset_callback();
 	}
@@ -412,6 +511,26 @@ void VirtualMachine::reset_to(const VirtualMachine& other)
 	this->m_tracked_client_fd = -1;
 	this->m_tracked_client_vfd = -1;
 	this->m_blocking_connections = false;
+	this->m_reset_needed = false;
+	if (this->m_injected_fd >= 0) {
+		close(this->m_injected_fd);
+		this->m_injected_fd = -1;
+	}
+}
+
+void VirtualMachine::release_working_memory()
+{
+	// Cleared first, so that a failed reset still leaves a usable fork
+	this->m_retired = false;
+	const VirtualMachine& other = *this->m_master_instance;
+	m_machine.reset_to(other.m_machine, tinykvm::MachineOptions{
+		.max_mem = other.m_machine.max_address(),
+		.max_cow_mem = other.config().max_req_mem,
+		.stack_size = settings::MAIN_STACK_SIZE,
+		.reset_free_work_mem = settings::RETIRED_WORK_MEM,
+		.reset_copy_all_registers = true,
+		.reset_keep_all_work_memory = false,
+	});
 }
 
 VirtualMachine::InitResult VirtualMachine::initialize_from_file()
@@ -484,19 +603,18 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 				fprintf(stderr, "Invalid listening socket %d (%d)\n", vfd, fd);
 				return false;
 			}
-			this->m_tracked_client_vfd = vfd;
-			this->m_tracked_client_fd = fd;
+			// The first listener the guest waits on is tracked (see below)
+			this->m_listener_vfds.insert(vfd);
 			return true;
 		};
 		machine().fds().epoll_wait_callback =
 		[this](int vfd, int epfd, int timeout) {
-			if (this->m_tracked_client_vfd != -1) {
-				// Find the listening socket in the epoll set
-				const auto& entry = machine().fds().get_epoll_entry_for_vfd(vfd);
-				if (entry.epoll_fds.find(m_tracked_client_vfd) == entry.epoll_fds.end()) {
-					// The listening socket is not in the epoll set
-					return true; // Call epoll_wait
-				}
+			// Find a listening socket in the epoll set
+			const auto& entry = machine().fds().get_epoll_entry_for_vfd(vfd);
+			for (const int listener_vfd : this->m_listener_vfds) {
+				if (entry.epoll_fds.find(listener_vfd) == entry.epoll_fds.end()
+					|| !this->track_listener(listener_vfd))
+					continue;
 				// If the listening socket is found, we are now waiting for
 				// requests, so we can fork new VMs.
 				this->m_poll_method = PollMethod::Epoll;
@@ -508,10 +626,10 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 		};
 		machine().fds().poll_callback =
 		[this](struct pollfd* fds, unsigned nfds, int timeout) {
-			if (this->m_tracked_client_vfd != -1) {
-				// Find the listening socket in the poll set
+			if (!this->m_listener_vfds.empty()) {
+				// Find a listening socket in the poll set
 				for (unsigned i = 0; i < nfds; i++) {
-					if (fds[i].fd == this->m_tracked_client_vfd) {
+					if (this->track_listener(fds[i].fd)) {
 						this->m_poll_method = PollMethod::Poll;
 						this->set_waiting_for_requests(true);
 						this->machine().stop();
@@ -523,8 +641,8 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 		};
 		machine().fds().accept_callback =
 		[this](int vfd, int fd, int flags) {
-			if (this->m_tracked_client_vfd != -1 && this->m_poll_method == PollMethod::Undefined) {
-				if (vfd == this->m_tracked_client_vfd) {
+			if (this->m_poll_method == PollMethod::Undefined) {
+				if (this->track_listener(vfd)) {
 					// Check whether the listening socket has been set non-blocking.
 					int fdflags = fcntl(fd, F_GETFL);
 					assert(fdflags != -1);
@@ -549,27 +667,25 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 				// Run for a short time to allow the VM to initialize
 				try {
 					machine().run(first ? 0.29f : 0.1f);
+					break;
 				} catch (const tinykvm::MachineTimeoutException& tme) {
 					// Grab a RIP sample
-					auto& regs = machine().registers();
-					const uint64_t rip = regs.rip;
-					auto it = rip_samples.find(rip);
-					unsigned samples = 0;
-					if (it != rip_samples.end()) {
-						it->second++;
-						samples = it->second;
-					} else {
-						rip_samples.insert_or_assign(rip, 1);
-						samples = 1;
-					}
-					const std::string sym = machine().resolve(rip,
-						std::string_view((const char *)m_original_binary.data(), m_original_binary.size()));
-					printf("RIP: 0x%08lX %s (%u)\n", rip, sym.c_str(), samples);
+					rip_samples[machine().registers().rip]++;
 					// The VM is not initialized yet, so we can continue
 					first = false;
 					continue;
 				}
 			}
+			// Symbolize once every object has been loaded
+			const GuestSymbols symbols = this->load_guest_symbols();
+			std::unordered_map<std::string, uint64_t> symbol_samples;
+			for (const auto& [rip, samples] : rip_samples)
+				symbol_samples[symbols.frame_name(rip)] += samples;
+			std::vector<std::pair<std::string, uint64_t>> sorted(symbol_samples.begin(), symbol_samples.end());
+			std::sort(sorted.begin(), sorted.end(),
+				[](const auto& a, const auto& b) { return a.second > b.second; });
+			for (const auto& [name, samples] : sorted)
+				printf("%6lu %s\n", samples, name.c_str());
 		} else if (getenv("BENCH")) {
 			struct timespec ts;
 			clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -687,8 +803,18 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 	return result;
 }
 
+bool VirtualMachine::track_listener(int vfd)
+{
+	if (this->m_tracked_client_vfd == -1 && this->m_listener_vfds.count(vfd) != 0) {
+		this->m_tracked_client_vfd = vfd;
+		this->m_tracked_client_fd = machine().fds().translate(vfd);
+	}
+	return vfd != -1 && vfd == this->m_tracked_client_vfd;
+}
+
 void VirtualMachine::restart_poll_syscall()
 {
+	KVMSERVER_PROBE(restart_poll, this->m_reqid, int(this->m_poll_method));
 	switch (this->m_poll_method)
 	{
 	case PollMethod::Poll:
@@ -707,6 +833,24 @@ void VirtualMachine::restart_poll_syscall()
 	}
 }
 
+void VirtualMachine::run_guest()
+{
+	if (this->m_profiler == nullptr) {
+		machine().vmresume();
+		return;
+	}
+	// The vCPU times out once per sampling interval. Any other stop,
+	// including a kick by the request timer, returns normally.
+	while (true) {
+		try {
+			machine().vmresume(this->m_profiler->interval());
+			return;
+		} catch (const tinykvm::MachineTimeoutException&) {
+			this->m_profiler->sample(this->m_reqid, machine());
+		}
+	}
+}
+
 void VirtualMachine::resume_fork()
 {
 	if (this->m_ephemeral)
@@ -716,26 +860,99 @@ void VirtualMachine::resume_fork()
 		// resume the VM.
 		while (true)
 		{
-			this->restart_poll_syscall();
-			machine().vmresume();
+			if (this->m_parked_fd >= 0) {
+				// The keep-alive connection of the previous request
+				this->inject_connection(std::exchange(this->m_parked_fd, -1));
+			} else if (this->m_acceptor != nullptr) {
+				this->wait_for_connection();
+				if (this->m_retired)
+					return;
+			} else if (config().pre_accept) {
+				this->pre_accept_connection();
+			} else {
+				this->restart_poll_syscall();
+			}
+			const auto start = std::chrono::steady_clock::now();
+			try {
+				this->run_guest();
+			} catch (...) {
+				this->disarm_request_timer();
+				throw;
+			}
+			const auto elapsed = std::chrono::steady_clock::now() - start;
+			// Disarmed here on the VM thread, as with --standby-fork
+			// the reset runs on another thread
+			const bool timed_out = this->m_request_deadline.expired.load(std::memory_order_acquire);
+			this->disarm_request_timer();
 
+			if (UNLIKELY(timed_out))
+			{
+				// The request timer kicked us out, treat it like a closed connection
+				fprintf(stderr, "*** Forked VM %u exceeded the max request time of %.1fs (timeouts: %lu)\n",
+					this->m_reqid, config().max_req_time, this->m_request_timer->timeouts());
+				this->m_reset_needed = true;
+				this->trace(TraceEvent::Timeout);
+				if (this->m_stats != nullptr)
+					this->m_stats->timeouts.fetch_add(1, std::memory_order_relaxed);
+			}
+			if (this->m_stats != nullptr) {
+				this->m_stats->record_resume(elapsed);
+				if (this->m_reset_needed)
+					this->m_stats->record_request(elapsed);
+			}
 			if (this->m_reset_needed)
 			{
+				if (this->m_deferred_reset) {
+					// The caller swaps in a standby fork and resets this one
+					return;
+				}
 				// Reset the VM
 				this->reset_to(*this->m_master_instance);
-				this->m_reset_needed = false;
 				continue;
 			}
-			fprintf(stderr, "VM %s did not need reset\n", name().c_str());
+			if (config().verbose) {
+				fprintf(stderr, "VM %s did not need reset\n", name().c_str());
+			}
 			break;
 		}
 	}
 	else
 	{
-		machine().vmresume();
+		const auto start = std::chrono::steady_clock::now();
+		this->run_guest();
+		if (this->m_stats != nullptr) {
+			this->m_stats->record_resume(std::chrono::steady_clock::now() - start);
+		}
 	}
 }
 
+std::string_view VirtualMachine::loaded_binary() const
+{
+	return select_main_binary(m_original_binary);
+}
+
+std::string VirtualMachine::object_host_path(const std::string& guest_path) const
+{
+	// The dynamic linker is loaded from the host (see init_kvm)
+	static const std::string ld_linux_path = "/lib64/ld-linux-x86-64.so.2";
+	if (guest_path == ld_linux_path)
+		return ld_linux_path;
+	// Only read objects the guest is allowed to read
+	std::string path = guest_path;
+	// Not through the path cache, which belongs to the VM's thread
+	if (m_allowed_paths->resolve(path, machine().fds().current_working_directory(), AllowedPaths::Readable))
+		return path;
+	return "";
+}
+
+GuestSymbols VirtualMachine::load_guest_symbols() const
+{
+	GuestSymbols symbols;
+	symbols.load(machine(), this->loaded_binary(), m_original_binary, name(),
+		[this] (const std::string& guest_path) { return this->object_host_path(guest_path); });
+	return symbols;
+}
+
 std::string VirtualMachine::binary_type_string() const noexcept
 {
 	switch (m_binary_type) {
@@ -758,6 +975,29 @@ void VirtualMachine::init_kvm()
 	tinykvm::Machine::init();
 }
 
+// The handlers installed by tinykvm, called by timed_syscall_handler()
+static std::array<tinykvm::Machine::syscall_t, SyscallStats::MAX_SYSCALL> syscall_handlers;
+static void timed_syscall_handler(tinykvm::vCPU& cpu)
+{
+	// The system call number is in rax until the handler returns
+	const uint32_t number = cpu.registers().rax;
+	auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+	const SyscallTimer timer(vm.stats(), number);
+	syscall_handlers[number](cpu);
+}
+
+void VirtualMachine::install_syscall_stats()
+{
+	for (unsigned number = 0; number < SyscallStats::MAX_SYSCALL; number++)
+	{
+		const auto handler = tinykvm::Machine::get_syscall_handler(number);
+		if (handler == nullptr || handler == timed_syscall_handler)
+			continue;
+		syscall_handlers[number] = handler;
+		tinykvm::Machine::install_syscall_handler(number, timed_syscall_handler);
+	}
+}
+
 #include <tinykvm/rsp_client.hpp>
 void VirtualMachine::open_debugger()
 {
@@ -788,6 +1028,9 @@ void VirtualMachine::open_debugger()
 
 bool VirtualMachine::validate_listener(int fd)
 {
+	// The private port of a replica was validated at bind time
+	if (this->m_numa_replica)
+		return true;
 	struct sockaddr_storage addr;
 	socklen_t addrlen = sizeof(addr);
 	if (getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &addrlen) < 0)
@@ -809,6 +1052,5 @@ bool VirtualMachine::validate_listener(int fd)
 	}
 
 	// Validate network addresses against allow listen lists
-	return validate_network_access(
-		addr, m_config.allowed_listen_ipv4, m_config.allowed_listen_ipv6);
+	return m_config.allowed_listen.allows(addr);
 }
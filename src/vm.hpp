@@ -1,8 +1,19 @@
 #pragma once
 #include <sys/socket.h>
 #include <chrono>
+#include <memory>
+#include <set>
 #include <tinykvm/machine.hpp>
+#include <utility>
 #include "config.hpp"
+#include "acceptor.hpp"
+#include "metrics.hpp"
+#include "paths.hpp"
+#include "request_timer.hpp"
+#include "symbols.hpp"
+#include "trace.hpp"
+struct DirtyReport;
+struct Profiler;
 
 struct VirtualMachine
 {
@@ -26,6 +37,19 @@ struct VirtualMachine
 	void set_waiting_for_requests(bool waiting) noexcept { m_waiting_for_requests = waiting; }
 	void restart_poll_syscall();
 	void resume_fork();
+	// Hand an accepted connection to this (idle) VM
+	void deliver_connection(int fd);
+	// Retire this idle VM from an elastic pool (see RequestPool)
+	void retire();
+	bool is_retired() const noexcept { return m_retired; }
+	// Reset to the master while freeing most of the working memory
+	void release_working_memory();
+	// Complete the pending poll, epoll_wait or accept4 with a connection
+	void inject_connection(int fd);
+	// A keep-alive connection kept across a per-request reset, which
+	// the next resume_fork() hands to the (reset) guest
+	int take_parked_connection() noexcept { return std::exchange(m_parked_fd, -1); }
+	void park_connection(int fd) noexcept { m_parked_fd = fd; }
 
 	auto& machine() { return m_machine; }
 	const auto& machine() const { return m_machine; }
@@ -36,6 +60,36 @@ struct VirtualMachine
 	std::string binary_type_string() const noexcept;
 	void set_on_reset_callback(on_reset_t callback) noexcept { m_on_reset_callback = std::move(callback); }
 	void set_ephemeral(bool ephemeral) noexcept { m_ephemeral = ephemeral; }
+	// With deferred reset resume_fork() returns when the client closes,
+	// leaving the reset to the caller (see StandbyForks)
+	void set_deferred_reset(bool deferred) noexcept { m_deferred_reset = deferred; }
+	bool is_reset_needed() const noexcept { return m_reset_needed; }
+	// Enforce config().max_req_time on requests accepted by forks of this VM
+	void set_request_timer(RequestTimer* timer) noexcept { m_request_timer = timer; }
+	// Forks of this VM receive their connections from the acceptor
+	void set_acceptor(Acceptor* acceptor) noexcept { m_acceptor = acceptor; }
+	// Record requests, resets and time in the guest (see Metrics)
+	void set_stats(VMStats* stats) noexcept { m_stats = stats; }
+	VMStats* stats() const noexcept { return m_stats; }
+	// Record request events into a trace ring (see Tracer)
+	void set_trace(TraceRing* ring) noexcept { m_trace = ring; }
+	// Sample the guest stack while it runs (see Profiler)
+	void set_profiler(Profiler* profiler) noexcept { m_profiler = profiler; }
+	// Attribute the pages dirtied by each request (see DirtyReport)
+	void set_dirty_report(DirtyReport* report) noexcept { m_dirty_report = report; }
+	void trace(TraceEvent event, uint64_t arg = 0) noexcept {
+		if (m_trace != nullptr)
+			m_trace->record(event, m_reqid, arg);
+	}
+	// Only valid for the master VM, which tracks its listening socket
+	int listener_fd() const noexcept { return m_tracked_client_fd; }
+	// A NUMA replica listens on a private port during initialization
+	// and warmup, then takes over the master's listening socket
+	void set_numa_replica(bool replica) noexcept { m_numa_replica = replica; }
+	void share_listener(const VirtualMachine& master);
+	// Accept connections for this fork from its own listener (see ReuseportGroup),
+	// and drain what is left in the backlog of the shared listener
+	void use_listener(int fd, int drain_fd) noexcept { m_listener_fd = fd; m_drain_listener_fd = drain_fd; }
 	bool is_ephemeral() const noexcept { return m_ephemeral; }
 	bool is_storage() const noexcept { return m_is_storage; }
 	unsigned reqid() const noexcept { return m_reqid; }
@@ -43,6 +97,8 @@ struct VirtualMachine
 
 	void warmup();
 	void open_debugger();
+	// Symbols of the program and every loaded shared object
+	GuestSymbols load_guest_symbols() const;
 
 	VirtualMachine(std::string_view binary, const Configuration& config, bool storage = false);
 	VirtualMachine(const VirtualMachine& other, unsigned reqid, bool storage);
@@ -54,15 +110,42 @@ struct VirtualMachine
 	InitResult initialize(std::function<void()> warmup, bool just_one_vm);
 	void reset_to(const VirtualMachine&);
 	static void init_kvm();
+	// Time the system call handlers of VMs that have statistics
+	static void install_syscall_stats();
 
 private:
 	void begin_warmup_client();
 	void stop_warmup_client();
 	bool connect_and_send_requests(const sockaddr* serv_addr, socklen_t serv_addr_len);
 	bool validate_listener(int fd);
+	// Whether vfd is the tracked listener, which is the first listener
+	// the guest waits on for connections
+	bool track_listener(int vfd);
+	void wait_for_connection();
+	void run_guest();
+	void disarm_request_timer() {
+		if (m_request_timer != nullptr)
+			m_request_timer->disarm(m_request_deadline);
+	}
+	// Whether a guest wait may block on its own client connection
+	bool waits_on_client(int timeout) const noexcept;
+	bool wait_between_requests(struct pollfd* fds, unsigned nfds, int timeout);
+	long request_done();
+	void pre_accept_connection();
+	void accept_injected_connection(int flags);
 	InitResult initialize_from_file();
+	static tinykvm::MachineOptions reset_options(const VirtualMachine& master);
+	// Check a guest path against the allowed paths, and rewrite it
+	const AllowedPaths::VirtualPath* resolve_path(std::string& path, AllowedPaths::Access);
 	void save_state();
 	void load_state();
+	// Of the dynamic linker and the shared objects it has loaded
+	uint64_t loaded_objects_checksum() const;
+	// The binary the machine was created from: the dynamic linker for
+	// dynamic programs, otherwise the program
+	std::string_view loaded_binary() const;
+	// Host path of a loaded shared object, or empty if not readable
+	std::string object_host_path(const std::string& guest_path) const;
 
 	tinykvm::Machine m_machine;
 	const Configuration& m_config;
@@ -72,12 +155,43 @@ private:
 	bool m_ephemeral = false;
 	bool m_is_storage = false;
 	bool m_reset_needed = false;
+	bool m_deferred_reset = false;
 	bool m_waiting_for_requests = false;
 	bool m_blocking_connections = false;
+	bool m_numa_replica = false;
 	// The tracked client fd for ephemeral VMs
 	int m_tracked_client_fd = -1;
 	int m_tracked_client_vfd = -1;
+	// Every listening socket of the guest, so that snapshots can recreate them
+	std::set<int> m_listener_vfds;
 	PollMethod m_poll_method = Undefined;
 	on_reset_t m_on_reset_callback = nullptr;
 	const VirtualMachine* m_master_instance = nullptr;
+	// Options of reset_to() the master, built once per fork
+	tinykvm::MachineOptions m_reset_options;
+	RequestTimer* m_request_timer = nullptr;
+	RequestTimer::Entry m_request_deadline;
+	Acceptor* m_acceptor = nullptr;
+	VMStats* m_stats = nullptr;
+	TraceRing* m_trace = nullptr;
+	Profiler* m_profiler = nullptr;
+	DirtyReport* m_dirty_report = nullptr;
+	static constexpr int PENDING_RETIRE = -2;
+	std::atomic<int> m_pending_fd = -1;
+	bool m_retired = false;
+	// A connection accepted on the host, waiting for the guest's accept4
+	int m_injected_fd = -1;
+	// A connection parked by the guest's request-done call
+	int m_parked_fd = -1;
+	// The master's listening socket, as seen by forks
+	int m_listener_vfd = -1;
+	int m_listener_fd = -1;
+	int m_drain_listener_fd = -1;
+	// Host epoll set used to pre-accept connections on the listener
+	int m_accept_epoll_fd = -1;
+	// Compiled by a master VM and shared with its forks
+	std::shared_ptr<const AllowedPaths> m_allowed_paths;
+	// Only forks have a cache, as the socket callbacks of forks check
+	// paths on their master, from many threads
+	std::unique_ptr<PathCache> m_path_cache;
 };
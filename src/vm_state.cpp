@@ -1,22 +1,193 @@
 #include "vm.hpp"
+#include "listener.hpp"
+#include "mmap_file.hpp"
+#include "symbols.hpp"
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
 #include <fcntl.h>
+#include <set>
 #include <stdexcept>
-#include <sys/socket.h>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 static constexpr bool VERBOSE_SNAPSHOT = false;
+static constexpr size_t MAX_LISTENERS = 8;
+static constexpr size_t MAX_EVENT_FDS = 16;
+
+// An eventfd or a timerfd of the guest. A timer is rearmed with the
+// time it had left when the snapshot was saved.
+struct EventFdInfo {
+	enum Kind : int { EventFd, TimerFd };
+	int vfd;
+	Kind kind;
+	int flags;
+	int clockid;
+	uint64_t count; // Eventfd counter, or unread timer expirations
+	struct itimerspec timer;
+
+	static bool capture(int vfd, int fd, EventFdInfo& info);
+	int create() const;
+};
 
 struct AppSnapshotState {
+	static constexpr uint32_t MAGIC = 0x4B564D04; // Version 4: shared object checksum
+	uint32_t magic;
+	// The program the snapshot was booted from
+	uint64_t binary_size;
+	uint64_t binary_checksum;
+	// The dynamic linker and the shared objects it had loaded
+	uint64_t objects_checksum;
 	VirtualMachine::PollMethod poll_method;
 	int tracked_client_vfd;
-	int backlog;
-	int domain;
-	int type;
-	int protocol;
-	int flags;
-	int reuseaddr;
-	socklen_t addr_len;
-	struct sockaddr_storage addr;
+	uint32_t listener_count;
+	uint32_t event_fd_count;
+	struct {
+		int vfd;
+		ListenerInfo info;
+	} listeners[MAX_LISTENERS];
+	EventFdInfo event_fds[MAX_EVENT_FDS];
 };
+// Assumed to fit the user area tinykvm reserves in the snapshot
+static_assert(sizeof(AppSnapshotState) <= 4096);
+
+static constexpr uint64_t CHECKSUM_MUL = 0xFF51AFD7ED558CCDULL;
+// A fast 64-bit hash of the program, read in four independent lanes
+static uint64_t content_checksum(std::string_view data)
+{
+	static constexpr uint64_t MUL = CHECKSUM_MUL;
+	uint64_t lanes[4] = { 0x9E3779B97F4A7C15ULL ^ data.size(), 1, 2, 3 };
+	size_t i = 0;
+	for (; i + sizeof(lanes) <= data.size(); i += sizeof(lanes)) {
+		for (size_t lane = 0; lane < 4; lane++) {
+			uint64_t word;
+			std::memcpy(&word, data.data() + i + lane * sizeof(word), sizeof(word));
+			lanes[lane] = (lanes[lane] ^ word) * MUL;
+			lanes[lane] ^= lanes[lane] >> 32;
+		}
+	}
+	uint64_t hash = lanes[0];
+	for (size_t lane = 1; lane < 4; lane++)
+		hash = (hash ^ lanes[lane]) * MUL;
+	for (; i < data.size(); i++)
+		hash = (hash ^ (unsigned char)data[i]) * MUL;
+	return hash ^ (hash >> 29);
+}
+
+// The loaded shared objects are in the snapshot memory, just like the
+// program, so upgrading one on the host must not go unnoticed
+uint64_t VirtualMachine::loaded_objects_checksum() const
+{
+	const std::string_view loaded_binary = this->loaded_binary();
+	if (loaded_binary.data() == m_original_binary.data())
+		return 0; // A static program
+	uint64_t checksum = content_checksum(loaded_binary);
+	for (const auto& object : GuestSymbols::loaded_objects(machine(), loaded_binary))
+	{
+		if (object.name.empty())
+			continue; // The program, see binary_checksum
+		const std::string path = this->object_host_path(object.name);
+		if (path.empty())
+			continue;
+		try {
+			MmapFile file(path);
+			checksum = (checksum ^ content_checksum(file.view())) * CHECKSUM_MUL;
+		} catch (const std::exception& e) {
+			// Eg. linux-vdso.so.1 does not exist as a file
+		}
+	}
+	return checksum;
+}
+
+// The fields of /proc/self/fdinfo describing eventfds and timerfds
+static std::string read_fdinfo(int fd)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+	FILE* fp = fopen(path, "r");
+	if (fp == nullptr)
+		return "";
+	std::string info;
+	char buffer[512];
+	size_t len;
+	while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+		info.append(buffer, len);
+	fclose(fp);
+	return info;
+}
+static bool fdinfo_field(const std::string& info, const char* name, const char* format, void* value)
+{
+	const size_t pos = info.find(name);
+	return pos != std::string::npos && sscanf(info.c_str() + pos + strlen(name), format, value) == 1;
+}
+
+bool EventFdInfo::capture(int vfd, int fd, EventFdInfo& info)
+{
+	char target[64];
+	snprintf(target, sizeof(target), "/proc/self/fd/%d", fd);
+	char link[64] {};
+	if (readlink(target, link, sizeof(link) - 1) < 0)
+		return false;
+	const std::string fdinfo = read_fdinfo(fd);
+	info = EventFdInfo { .vfd = vfd };
+	info.flags = fcntl(fd, F_GETFL, 0) & O_NONBLOCK;
+	if (strcmp(link, "anon_inode:[eventfd]") == 0) {
+		info.kind = EventFd;
+		unsigned long long count = 0;
+		if (!fdinfo_field(fdinfo, "eventfd-count:", "%llx", &count))
+			return false;
+		info.count = count;
+		// Linux 6.6 and later show the semaphore flag
+		int semaphore = 0;
+		if (fdinfo_field(fdinfo, "eventfd-semaphore:", "%d", &semaphore) && semaphore)
+			info.flags |= EFD_SEMAPHORE;
+		return true;
+	}
+	if (strcmp(link, "anon_inode:[timerfd]") == 0) {
+		info.kind = TimerFd;
+		unsigned long long ticks = 0;
+		if (!fdinfo_field(fdinfo, "clockid:", "%d", &info.clockid)
+			|| !fdinfo_field(fdinfo, "ticks:", "%llu", &ticks))
+			return false;
+		info.count = ticks;
+		return timerfd_gettime(fd, &info.timer) == 0;
+	}
+	return false;
+}
+
+int EventFdInfo::create() const
+{
+	if (kind == EventFd) {
+		const int fd = eventfd(0, this->flags);
+		if (fd < 0) {
+			throw std::runtime_error("eventfd() failed: " + std::string(strerror(errno)));
+		}
+		if (this->count > 0 && write(fd, &this->count, sizeof(this->count)) != sizeof(this->count)) {
+			close(fd);
+			throw std::runtime_error("Failed to restore eventfd counter: " + std::string(strerror(errno)));
+		}
+		return fd;
+	}
+	const int fd = timerfd_create(this->clockid, this->flags);
+	if (fd < 0) {
+		throw std::runtime_error("timerfd_create() failed: " + std::string(strerror(errno)));
+	}
+	// Unread expirations are not restorable, but one expiring right away
+	// keeps the timer readable. A periodic timer then continues with its
+	// interval from there.
+	struct itimerspec timer = this->timer;
+	if (this->count > 0) {
+		timer.it_value.tv_sec = 0;
+		timer.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(fd, 0, &timer, nullptr) < 0) {
+		close(fd);
+		throw std::runtime_error("timerfd_settime() failed: " + std::string(strerror(errno)));
+	}
+	return fd;
+}
 
 void VirtualMachine::save_state()
 {
@@ -26,34 +197,57 @@ void VirtualMachine::save_state()
 		throw std::runtime_error("snapshot user area is null");
 	}
 	AppSnapshotState& state = *reinterpret_cast<AppSnapshotState*>(map);
+	state.magic = AppSnapshotState::MAGIC;
+	state.binary_size = m_original_binary.size();
+	state.binary_checksum = content_checksum(m_original_binary);
+	state.objects_checksum = this->loaded_objects_checksum();
 	state.poll_method = this->m_poll_method;
 	state.tracked_client_vfd = this->m_tracked_client_vfd;
-	state.backlog = 128; // XXX
+	state.listener_count = 0;
+	state.event_fd_count = 0;
 
-	const auto fd = this->m_tracked_client_fd;
-	int len = sizeof(state.domain);
-	if(getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &(state.domain), (socklen_t*) &len) < 0) {
-		throw std::runtime_error(strerror(errno));
-	}
-	len = sizeof(state.type);
-	if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &(state.type), (socklen_t*) &len) < 0) {
-		throw std::runtime_error(strerror(errno));
-	}
-	len = sizeof(state.protocol);
-	if(getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &(state.protocol), (socklen_t*) &len) < 0) {
-		throw std::runtime_error(strerror(errno));
-	}
-	len = sizeof(state.reuseaddr);
-	if (getsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(state.reuseaddr), (socklen_t*) &len) < 0) {
-		throw std::runtime_error(strerror(errno));
-	}
-	state.flags = fcntl(fd, F_GETFL, 0);
-	if (state.flags < 0) {
-		throw std::runtime_error(strerror(errno));
+	// Every listener that is still open
+	for (const int vfd : this->m_listener_vfds)
+	{
+		const int fd = machine().fds().translate(vfd);
+		int listening = 0;
+		socklen_t len = sizeof(listening);
+		if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening)
+			continue;
+		if (state.listener_count == MAX_LISTENERS) {
+			fprintf(stderr, "Warning: Snapshot holds at most %zu listeners, vfd %d is not saved\n",
+				MAX_LISTENERS, vfd);
+			continue;
+		}
+		auto& listener = state.listeners[state.listener_count++];
+		listener.vfd = vfd;
+		listener.info = ListenerInfo::capture(fd);
 	}
-	state.addr_len = sizeof(state.addr);
-	if (getsockname(fd, (struct sockaddr*)&(state.addr), &(state.addr_len)) < 0) {
-		throw std::runtime_error(strerror(errno));
+	// Eventfds and timerfds in the epoll sets of the guest
+	for (const auto& [epoll_vfd, epoll_entry] : machine().fds().get_epoll_entries())
+	{
+		for (const auto& [vfd, event] : epoll_entry->epoll_fds)
+		{
+			if (this->m_listener_vfds.count(vfd) != 0)
+				continue;
+			const auto* first = state.event_fds;
+			const auto* last = state.event_fds + state.event_fd_count;
+			if (std::find_if(first, last, [vfd](const EventFdInfo& info) { return info.vfd == vfd; }) != last)
+				continue; // In more than one epoll set
+			EventFdInfo info;
+			const int fd = machine().fds().translate(vfd);
+			if (fd < 0 || !EventFdInfo::capture(vfd, fd, info)) {
+				fprintf(stderr, "Warning: Snapshot cannot restore vfd %d in epoll set %d\n",
+					vfd, epoll_vfd);
+				continue;
+			}
+			if (state.event_fd_count == MAX_EVENT_FDS) {
+				fprintf(stderr, "Warning: Snapshot holds at most %zu eventfds and timerfds, vfd %d is not saved\n",
+					MAX_EVENT_FDS, vfd);
+				continue;
+			}
+			state.event_fds[state.event_fd_count++] = info;
+		}
 	}
 }
 
@@ -64,61 +258,66 @@ void VirtualMachine::load_state()
 		throw std::runtime_error("snapshot user area is null");
 	}
 	AppSnapshotState& state = *reinterpret_cast<AppSnapshotState*>(map);
-	const auto fdm = machine().fds();
-	this->m_poll_method = state.poll_method;
-	int fd = socket(state.domain, state.type, state.protocol);
-	if (fd < 0) {
-		throw std::runtime_error(strerror(errno));
+	if (state.magic != AppSnapshotState::MAGIC) {
+		throw std::runtime_error("Snapshot was saved by an older kvmserver, remove it to create a new one");
 	}
-	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(state.reuseaddr), sizeof(state.reuseaddr)) < 0) {
-		throw std::runtime_error(strerror(errno));
+	// Every process sharing the snapshot must run the program it was booted from
+	if (state.binary_size != m_original_binary.size()
+		|| state.binary_checksum != content_checksum(m_original_binary)) {
+		throw std::runtime_error("Snapshot " + config().snapshot_filename + " was created from another build of "
+			+ config().main_filename + ", remove it to create a new one");
 	}
-	if (fcntl(fd, F_SETFL, state.flags) < 0) {
-		throw std::runtime_error(strerror(errno));
+	if (state.objects_checksum != this->loaded_objects_checksum()) {
+		throw std::runtime_error("Snapshot " + config().snapshot_filename + " was created with other versions of the shared"
+			" libraries of " + config().main_filename + ", remove it to create a new one");
 	}
-	if (bind(fd, (struct sockaddr*) &(state.addr), state.addr_len) < 0) {
-		throw std::runtime_error(strerror(errno));
+	auto& fdm = machine().fds();
+	this->m_poll_method = state.poll_method;
+	this->m_tracked_client_vfd = state.tracked_client_vfd;
+
+	// Recreate the host fds behind the vfds of the guest
+	std::set<int> restored;
+	for (uint32_t i = 0; i < state.listener_count; i++) {
+		const auto& listener = state.listeners[i];
+		const int fd = listener.info.create();
+		fdm.manage_as(listener.vfd, fd, true, true);
+		restored.insert(listener.vfd);
+		this->m_listener_vfds.insert(listener.vfd);
+		if (listener.vfd == this->m_tracked_client_vfd) {
+			this->m_tracked_client_fd = fd;
+		}
 	}
-	if (listen(fd, state.backlog) < 0) {
-		throw std::runtime_error(strerror(errno));
+	for (uint32_t i = 0; i < state.event_fd_count; i++) {
+		const auto& info = state.event_fds[i];
+		fdm.manage_as(info.vfd, info.create(), false, true);
+		restored.insert(info.vfd);
 	}
-	this->m_tracked_client_vfd = state.tracked_client_vfd;
-	this->m_tracked_client_fd = fd;
-	this->machine().fds().manage_as(state.tracked_client_vfd, fd, true, true);
 
 	// Look through epoll systems
 	for (auto& [vfd, epoll_entry] : fdm.get_epoll_entries())
 	{
-		// Find the tracked client vfd in the epoll entries
-		auto it = epoll_entry->epoll_fds.find(this->m_tracked_client_vfd);
-		if (it != epoll_entry->epoll_fds.end()) {
-			const int entry_vfd = it->first;
-			auto& event = it->second;
-			const int epoll_fd = this->machine().fds().translate(vfd);
-			// Remove old entry (with old fd)
-			int old_fd = this->machine().fds().translate(entry_vfd);
-			if (old_fd >= 0) {
-				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, old_fd, &event);
-			}
-			// Add new entry (with new fd)
-			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
-			if constexpr (VERBOSE_SNAPSHOT) {
-				printf("TinyKVM: Restored epoll entry for vfd %d to new fd %d\n", entry_vfd, fd);
-			}
-		}
-		// Remove entries where we don't have the tracked fd
+		const int epoll_fd = fdm.translate(vfd);
 		for (auto it = epoll_entry->epoll_fds.begin(); it != epoll_entry->epoll_fds.end(); ) {
 			const int entry_vfd = it->first;
-			const int entry_fd = this->machine().fds().translate(entry_vfd);
+			const int entry_fd = fdm.translate(entry_vfd);
 			if (entry_fd < 0) {
 				// Remove the fd from the epoll entry since we can't use it anymore
 				it = epoll_entry->epoll_fds.erase(it);
 				if constexpr (VERBOSE_SNAPSHOT) {
 					printf("TinyKVM: Removed stale epoll entry for vfd %d\n", entry_vfd);
 				}
-			} else {
-				++it;
+				continue;
+			}
+			// Register the new host fds
+			if (restored.count(entry_vfd) != 0) {
+				if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, entry_fd, &it->second) < 0) {
+					throw std::runtime_error("epoll_ctl() failed: " + std::string(strerror(errno)));
+				}
+				if constexpr (VERBOSE_SNAPSHOT) {
+					printf("TinyKVM: Restored epoll entry for vfd %d to new fd %d\n", entry_vfd, entry_fd);
+				}
 			}
+			++it;
 		}
 	}
 }
@@ -1,5 +1,6 @@
 #include "vm.hpp"
 
+#include "probes.hpp"
 #include <atomic>
 #include <cstring>
 #include <limits.h>
@@ -88,6 +89,7 @@ void VirtualMachine::warmup()
 	};
 
 	// Start the warmup client
+	KVMSERVER_PROBE(warmup_start, config().warmup_connect_requests, config().warmup_intra_connect_requests);
 	this->begin_warmup_client();
 
 	this->restart_poll_syscall();
@@ -99,9 +101,11 @@ void VirtualMachine::warmup()
 		fprintf(stderr, "The program did not wait for requests after warmup\n");
 		throw std::runtime_error("The program did not wait for requests after warmup");
 	}
+	KVMSERVER_PROBE(warmup_guest_done, freed_sockets);
 
 	// Stop the warmup client
 	this->stop_warmup_client();
+	KVMSERVER_PROBE(warmup_end);
 }
 
 bool VirtualMachine::connect_and_send_requests(const sockaddr* serv_addr, socklen_t serv_addr_len)